@@ -0,0 +1,778 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   A small client for the adb server's smart-socket protocol.
+
+   Instead of forking the adb executable for every push, pull or shell
+   command we talk to the adb server on localhost:5037 (or
+   $ANDROID_ADB_SERVER_PORT) directly.  A request is a four digit hex
+   length followed by the service name; the server answers "OKAY" or
+   "FAIL" plus a length-prefixed message.  "host:transport:<serial>"
+   (or "host:transport-any") binds the socket to a device, after which
+   "shell:", "exec:" and "sync:" services can be opened on it.
+
+   The sync service speaks little-endian binary packets: a four byte id
+   followed by a 32-bit length or value.  Only STAT, LIST, RECV, SEND
+   and QUIT are implemented here, plus the LST2/LIS2 variants of STAT
+   and LIST which devices with the "stat_v2" and "ls_v2" features
+   support.
+
+   This file does not depend on FUSE so that it can be tested against
+   tests/fake_adb_server.py without a device.
+*/
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/** Largest payload the sync service accepts in one DATA packet. */
+static const size_t SYNC_DATA_MAX = 64 * 1024;
+
+/**
+   Write the whole buffer to fd, retrying on short writes.
+
+   @return false if the descriptor is no longer writable.
+ */
+bool write_all(int fd, const char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+   Read exactly size bytes from fd.
+
+   @return false on error or if the stream ended early.
+ */
+bool read_all(int fd, char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = read(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+void put_le32(char* p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+uint32_t get_le32(const char* p)
+{
+    const unsigned char* u = (const unsigned char*)p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+uint64_t get_le64(const char* p)
+{
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+/**
+   Open a TCP connection to the local adb server.
+
+   @return the socket, or -1 if the server is not running.
+ */
+int adb_server_connect()
+{
+    int port = 5037;
+    const char* env = getenv("ANDROID_ADB_SERVER_PORT");
+    if (env && atoi(env) > 0) port = atoi(env);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof addr) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return fd;
+}
+
+/**
+   Send one smart-socket request and wait for the server's verdict.
+
+   @param fd connection to the adb server.
+   @param service the service name, e.g. "host:version" or "sync:".
+   @param error receives the server's message on FAIL; may be NULL.
+   @return true if the server answered OKAY.
+ */
+bool adb_request(int fd, const string& service, string* error)
+{
+    char len[5];
+    snprintf(len, sizeof len, "%04x", (unsigned)service.size());
+    string msg(len);
+    msg.append(service);
+    if (!write_all(fd, msg.data(), msg.size())) {
+        if (error) error->assign("adb server connection lost");
+        return false;
+    }
+
+    char status[4];
+    if (!read_all(fd, status, 4)) {
+        if (error) error->assign("adb server connection lost");
+        return false;
+    }
+    if (!memcmp(status, "OKAY", 4)) return true;
+
+    if (error) {
+        error->assign("adb server protocol error");
+        char hex[5] = {0};
+        if (!memcmp(status, "FAIL", 4) && read_all(fd, hex, 4)) {
+            size_t n = strtoul(hex, NULL, 16);
+            vector<char> text(n);
+            if (n == 0 || read_all(fd, &text[0], n)) error->assign(text.begin(), text.end());
+        }
+    }
+    return false;
+}
+
+/**
+   Read one length-prefixed payload, as sent after OKAY by host
+   services such as "host:version" and, repeatedly, "host:track-devices".
+
+   @return false if the connection broke.
+ */
+bool adb_read_payload(int fd, string& payload)
+{
+    char hex[5] = {0};
+    if (!read_all(fd, hex, 4)) return false;
+    size_t n = strtoul(hex, NULL, 16);
+    vector<char> text(n);
+    if (n > 0 && !read_all(fd, &text[0], n)) return false;
+    payload.assign(text.begin(), text.end());
+    return true;
+}
+
+/**
+   Run a host service that replies with a length-prefixed payload,
+   such as "host:version" or "host:features".
+
+   @return true on success, with the payload stored in reply.
+ */
+bool adb_query(const string& service, string& reply, string* error)
+{
+    int fd = adb_server_connect();
+    if (fd < 0) {
+        if (error) error->assign("cannot connect to adb server");
+        return false;
+    }
+    bool ok = adb_request(fd, service, error) && adb_read_payload(fd, reply);
+    close(fd);
+    return ok;
+}
+
+/**
+   Serial of the device the calling thread works for, when one process
+   serves several devices; empty for the one $ANDROID_SERIAL names, or
+   the only one attached.  Set it with adb_serial_scope.
+ */
+thread_local string adbSerial;
+
+/** @return the serial of the device this thread talks to, or "" for any. */
+string adb_serial()
+{
+    if (!adbSerial.empty()) return adbSerial;
+    const char* serial = getenv("ANDROID_SERIAL");
+    return serial ? serial : "";
+}
+
+/**
+   Points adbSerial at a device until the end of the scope.
+ */
+class adb_serial_scope {
+public:
+    adb_serial_scope(const string& serial) : saved(adbSerial) { adbSerial = serial; }
+    ~adb_serial_scope() { adbSerial = saved; }
+
+private:
+    string saved;
+};
+
+/**
+   Connect to a service on the device selected by adb_serial(), or on
+   the only attached device if that is empty.
+
+   @param service device service, e.g. "shell:ls" or "sync:".
+   @param error receives a description of the failure; may be NULL.
+   @return a socket connected to the service, or -1.
+ */
+int adb_device_service(const string& service, string* error)
+{
+    int fd = adb_server_connect();
+    if (fd < 0) {
+        if (error) error->assign("cannot connect to adb server");
+        return -1;
+    }
+    string serial = adb_serial();
+    string transport = !serial.empty()
+        ? "host:transport:" + serial : string("host:transport-any");
+    if (!adb_request(fd, transport, error) || !adb_request(fd, service, error)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+   Ask the adb server which protocol features the current device
+   supports, as a comma separated list (e.g. "shell_v2,stat_v2,ls_v2").
+
+   @return false if the server or the device is not available.
+ */
+bool adb_device_features(string& features, string* error = NULL)
+{
+    string serial = adb_serial();
+    string service = !serial.empty()
+        ? "host-serial:" + serial + ":features" : string("host:features");
+    return adb_query(service, features, error);
+}
+
+/**
+   Pick the devices that are ready for use out of a "host:devices"
+   reply: lines of a serial, a tab and a state, of which only "device"
+   means online (others are "offline", "unauthorized", ...).
+ */
+vector<string> adb_parse_devices(const string& reply)
+{
+    vector<string> serials;
+    size_t start = 0;
+    while (start < reply.size()) {
+        size_t end = reply.find('\n', start);
+        if (end == string::npos) end = reply.size();
+        string line = reply.substr(start, end - start);
+        size_t tab = line.find('\t');
+        if (tab != string::npos && tab > 0 && line.compare(tab + 1, string::npos, "device") == 0)
+            serials.push_back(line.substr(0, tab));
+        start = end + 1;
+    }
+    sort(serials.begin(), serials.end());
+    return serials;
+}
+
+/**
+   List the serials of the online devices, sorted.
+
+   @return false if the adb server cannot be asked.
+ */
+bool adb_devices(vector<string>& serials, string* error = NULL)
+{
+    string reply;
+    if (!adb_query("host:devices", reply, error)) return false;
+    serials = adb_parse_devices(reply);
+    return true;
+}
+
+/**
+   Check whether a comma separated feature list contains a feature.
+ */
+bool adb_has_feature(const string& features, const string& feature)
+{
+    size_t start = 0;
+    while (start <= features.size()) {
+        size_t end = features.find(',', start);
+        if (end == string::npos) end = features.size();
+        if (features.compare(start, end - start, feature) == 0) return true;
+        start = end + 1;
+    }
+    return false;
+}
+
+/**
+   Run a command through the "exec:" service and collect its raw
+   stdout.  Unlike "shell:" the stream is binary-safe.
+
+   @return false if the service could not be opened.
+ */
+bool adb_exec(const string& command, string& output, string* error = NULL)
+{
+    int fd = adb_device_service("exec:" + command, error);
+    if (fd < 0) return false;
+    char buf[SYNC_DATA_MAX];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        output.append(buf, n);
+    }
+    close(fd);
+    return true;
+}
+
+/**
+   Run a command through the "exec:" service and hand its stdout to
+   on_line one line at a time, without the newline, as it arrives.
+   Commands with a lot of output need not be held in memory whole.
+
+   @return false if the service could not be opened.
+ */
+template <class F>
+bool adb_exec_lines(const string& command, F on_line, string* error = NULL)
+{
+    int fd = adb_device_service("exec:" + command, error);
+    if (fd < 0) return false;
+    char buf[SYNC_DATA_MAX];
+    string line;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        const char* p = buf;
+        const char* end = buf + n;
+        while (p < end) {
+            const char* nl = (const char*)memchr(p, '\n', end - p);
+            if (!nl) {
+                line.append(p, end);
+                break;
+            }
+            line.append(p, nl);
+            on_line(line);
+            line.clear();
+            p = nl + 1;
+        }
+    }
+    if (!line.empty()) on_line(line);
+    close(fd);
+    return true;
+}
+
+/**
+   File metadata as reported by the sync service.  A mode of 0 means
+   the file does not exist.  The v1 requests only fill in mode, size
+   and mtime; the v2 ones fill in everything, with error holding the
+   device-side errno of a failed lstat.
+ */
+struct sync_stat {
+    uint32_t mode;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t error;
+    uint64_t ino;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t atime;
+    int64_t ctime;
+    sync_stat() { memset(this, 0, sizeof *this); }
+};
+
+struct sync_dirent {
+    string name;
+    sync_stat st;
+};
+
+/**
+   A connection to the device's sync service.  Each instance owns one
+   socket; it is not safe to use the same instance from two threads.
+ */
+class adb_sync {
+public:
+    adb_sync() : fd(-1) {}
+    ~adb_sync() { quit(); }
+
+    /**
+       Open the sync service on the current device.
+
+       @return false if the adb server or device is not available.
+     */
+    bool connect(string* error = NULL)
+    {
+        quit();
+        fd = adb_device_service("sync:", error);
+        return fd >= 0;
+    }
+
+    bool connected() const { return fd >= 0; }
+
+    /**
+       lstat() a path on the device.
+
+       @return false on a protocol error; a missing file is reported as
+       success with st.mode == 0.
+     */
+    bool stat(const string& path, sync_stat& st)
+    {
+        char reply[16];
+        if (!send_request("STAT", path) || !read_all(fd, reply, sizeof reply)
+            || memcmp(reply, "STAT", 4)) {
+            broken();
+            return false;
+        }
+        st.mode = get_le32(reply + 4);
+        st.size = get_le32(reply + 8);
+        st.mtime = get_le32(reply + 12);
+        return true;
+    }
+
+    /**
+       lstat() a path on the device using the v2 request, which gives
+       64-bit sizes and times, ownership and the errno on failure.
+       Needs the "stat_v2" device feature.
+
+       @return false on a protocol error.
+     */
+    bool stat_v2(const string& path, sync_stat& st)
+    {
+        char reply[72];
+        if (!send_request("LST2", path) || !read_all(fd, reply, sizeof reply)
+            || memcmp(reply, "LST2", 4)) {
+            broken();
+            return false;
+        }
+        parse_v2(reply, st);
+        return true;
+    }
+
+    /**
+       lstat() several paths, sending every request before reading the
+       first reply, so that they cost one round trip instead of one
+       each.  Keep the batch small enough (a few KB of requests) for
+       the socket buffers to hold.
+
+       @param v2 use LST2 requests, as stat_v2() does.
+       @param st receives one record per path, in order.
+       @return false on a protocol error.
+     */
+    bool stat_many(const vector<string>& paths, bool v2, vector<sync_stat>& st)
+    {
+        const char* id = v2 ? "LST2" : "STAT";
+        string packets;
+        for (size_t i = 0; i < paths.size(); ++i) append_request(packets, id, paths[i]);
+        if (fd < 0 || !write_all(fd, packets.data(), packets.size())) return broken();
+        st.assign(paths.size(), sync_stat());
+        for (size_t i = 0; i < paths.size(); ++i) {
+            char reply[72];
+            size_t size = v2 ? 72 : 16;
+            if (!read_all(fd, reply, size) || memcmp(reply, id, 4)) return broken();
+            if (v2) {
+                parse_v2(reply, st[i]);
+            } else {
+                st[i].mode = get_le32(reply + 4);
+                st[i].size = get_le32(reply + 8);
+                st[i].mtime = get_le32(reply + 12);
+            }
+        }
+        return true;
+    }
+
+    /**
+       List a directory on the device, including "." and "..".  The
+       whole listing comes back in a single request.
+
+       @return false on a protocol error.  A missing or unreadable
+       directory yields an empty list.
+     */
+    bool list(const string& path, vector<sync_dirent>& entries)
+    {
+        if (!send_request("LIST", path)) return broken();
+        for (;;) {
+            char header[20];
+            if (!read_all(fd, header, sizeof header)) return broken();
+            if (!memcmp(header, "DONE", 4)) return true;
+            if (memcmp(header, "DENT", 4)) return broken();
+            sync_dirent entry;
+            entry.st.mode = get_le32(header + 4);
+            entry.st.size = get_le32(header + 8);
+            entry.st.mtime = get_le32(header + 12);
+            uint32_t namelen = get_le32(header + 16);
+            if (namelen > 1024) return broken();
+            vector<char> name(namelen);
+            if (namelen > 0 && !read_all(fd, &name[0], namelen)) return broken();
+            entry.name.assign(name.begin(), name.end());
+            entries.push_back(entry);
+        }
+    }
+
+    /**
+       Like list(), but with v2 records.  Needs the "ls_v2" device
+       feature.
+     */
+    bool list_v2(const string& path, vector<sync_dirent>& entries)
+    {
+        if (!send_request("LIS2", path)) return broken();
+        for (;;) {
+            char header[76];
+            if (!read_all(fd, header, sizeof header)) return broken();
+            if (!memcmp(header, "DONE", 4)) return true;
+            if (memcmp(header, "DNT2", 4)) return broken();
+            sync_dirent entry;
+            parse_v2(header, entry.st);
+            uint32_t namelen = get_le32(header + 72);
+            if (namelen > 1024) return broken();
+            vector<char> name(namelen);
+            if (namelen > 0 && !read_all(fd, &name[0], namelen)) return broken();
+            entry.name.assign(name.begin(), name.end());
+            entries.push_back(entry);
+        }
+    }
+
+    /**
+       Copy a device file into the given local descriptor.
+
+       @return false if the file could not be read; the reason is
+       stored in error.
+     */
+    bool recv(const string& path, int local_fd, string* error = NULL)
+    {
+        if (!send_request("RECV", path)) return broken(error);
+        vector<char> buf(SYNC_DATA_MAX);
+        for (;;) {
+            char header[8];
+            if (!read_all(fd, header, sizeof header)) return broken(error);
+            uint32_t len = get_le32(header + 4);
+            if (!memcmp(header, "DONE", 4)) return true;
+            if (!memcmp(header, "FAIL", 4)) return failed(len, error);
+            if (memcmp(header, "DATA", 4) || len > SYNC_DATA_MAX) return broken(error);
+            if (!read_all(fd, &buf[0], len)) return broken(error);
+            if (!write_all(local_fd, &buf[0], len)) {
+                // keep draining so that the connection stays usable
+                local_fd = -1;
+                if (error) error->assign(strerror(errno));
+            }
+        }
+    }
+
+    /**
+       Create or replace a device file with the contents of the given
+       local descriptor, read from its current offset to EOF.
+
+       @param path destination on the device.
+       @param mode st_mode for the new file.
+       @param mtime modification time to set on the device file.
+       @return false if the device refused the file, or if the local
+       descriptor could not be read; the device then holds only part
+       of it.
+     */
+    bool send(const string& path, unsigned mode, int local_fd, time_t mtime,
+              string* error = NULL)
+    {
+        if (!send_begin(path, mode)) return broken(error);
+
+        vector<char> buf(SYNC_DATA_MAX);
+        int read_error = 0;
+        for (;;) {
+            ssize_t n = read(local_fd, &buf[0], SYNC_DATA_MAX);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                // the device side cannot be told to abort; finish the
+                // transfer with what we have and report the error
+                read_error = errno;
+                break;
+            }
+            if (n == 0) break;
+            if (!send_data(&buf[0], n)) return broken(error);
+        }
+        if (!send_end(mtime, error)) return false;
+        if (read_error == 0) return true;
+        if (error) error->assign(strerror(read_error));
+        return false;
+    }
+
+    /**
+       Start a SEND whose data is supplied piecewise with send_data()
+       and finished by send_end().  No other request may be made on the
+       connection in between.
+     */
+    bool send_begin(const string& path, unsigned mode)
+    {
+        char spec[16];
+        snprintf(spec, sizeof spec, ",%u", mode);
+        return send_request("SEND", path + spec) || broken();
+    }
+
+    /** Append data to the file being sent. */
+    bool send_data(const char* data, size_t count)
+    {
+        char header[8];
+        memcpy(header, "DATA", 4);
+        while (count > 0) {
+            size_t n = min(count, (size_t)SYNC_DATA_MAX);
+            put_le32(header + 4, n);
+            if (!write_all(fd, header, sizeof header) || !write_all(fd, data, n))
+                return broken();
+            data += n;
+            count -= n;
+        }
+        return true;
+    }
+
+    /**
+       Finish the file being sent.
+
+       @return false if the device refused the file.
+     */
+    bool send_end(time_t mtime, string* error = NULL)
+    {
+        char done[8];
+        memcpy(done, "DONE", 4);
+        put_le32(done + 4, (uint32_t)mtime);
+        if (!write_all(fd, done, sizeof done)) return broken(error);
+
+        char reply[8];
+        if (!read_all(fd, reply, sizeof reply)) return broken(error);
+        if (!memcmp(reply, "FAIL", 4)) return failed(get_le32(reply + 4), error);
+        return !memcmp(reply, "OKAY", 4) || broken(error);
+    }
+
+    /** End the sync session and close the socket. */
+    void quit()
+    {
+        if (fd < 0) return;
+        char packet[8];
+        memcpy(packet, "QUIT", 4);
+        put_le32(packet + 4, 0);
+        write_all(fd, packet, sizeof packet);
+        close(fd);
+        fd = -1;
+    }
+
+private:
+    int fd;
+
+    /** Decode the stat part shared by LST2 and DNT2 records. */
+    static void parse_v2(const char* p, sync_stat& st)
+    {
+        st.error = get_le32(p + 4);
+        st.ino = get_le64(p + 16);
+        st.mode = get_le32(p + 24);
+        st.nlink = get_le32(p + 28);
+        st.uid = get_le32(p + 32);
+        st.gid = get_le32(p + 36);
+        st.size = get_le64(p + 40);
+        st.atime = (int64_t)get_le64(p + 48);
+        st.mtime = (int64_t)get_le64(p + 56);
+        st.ctime = (int64_t)get_le64(p + 64);
+    }
+
+    static void append_request(string& packet, const char* id, const string& path)
+    {
+        packet.append(id, 4);
+        char len[4];
+        put_le32(len, path.size());
+        packet.append(len, 4);
+        packet.append(path);
+    }
+
+    bool send_request(const char* id, const string& path)
+    {
+        if (fd < 0) return false;
+        string packet;
+        append_request(packet, id, path);
+        return write_all(fd, packet.data(), packet.size());
+    }
+
+    /** Drop a connection whose framing we no longer trust. */
+    bool broken(string* error = NULL)
+    {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        if (error && error->empty()) error->assign("adb sync protocol error");
+        return false;
+    }
+
+    /** Read the message following a FAIL header. */
+    bool failed(uint32_t len, string* error)
+    {
+        if (len > SYNC_DATA_MAX) return broken(error);
+        vector<char> text(len);
+        if (len > 0 && !read_all(fd, &text[0], len)) return broken(error);
+        if (error) error->assign(text.begin(), text.end());
+        return false;
+    }
+};
+
+/**
+   Idle sync connections kept around so that a metadata request does
+   not have to reconnect and re-select the transport every time.
+ */
+class adb_sync_pool {
+public:
+    /**
+       Take an idle connection or open a new one.
+
+       @return a connected adb_sync the caller must hand back with
+       release(), or NULL if the sync service is not available.
+     */
+    adb_sync* acquire(string* error = NULL)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            if (!idle.empty()) {
+                adb_sync* sync = idle.back();
+                idle.pop_back();
+                return sync;
+            }
+        }
+        adb_sync* sync = new adb_sync;
+        if (!sync->connect(error)) {
+            delete sync;
+            return NULL;
+        }
+        return sync;
+    }
+
+    /** Return a connection; broken ones are closed. */
+    void release(adb_sync* sync)
+    {
+        if (sync == NULL) return;
+        lock_guard<mutex> guard(lock);
+        if (sync->connected() && idle.size() < 4) {
+            idle.push_back(sync);
+        } else {
+            delete sync;
+        }
+    }
+
+private:
+    mutex lock;
+    vector<adb_sync*> idle;
+};
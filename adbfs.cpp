@@ -71,8 +71,34 @@
  *      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef ADBFS_FUSE3
+#define FUSE_USE_VERSION 31
+#else
 #define FUSE_USE_VERSION 26
+#endif
+#include "trace.h"
 #include "utils.h"
+#include "stats.h"
+#include "adb_client.h"
+#include "compression.h"
+#include "shell_session.h"
+#include "remote_file.h"
+#include "readahead.h"
+#include "writeback.h"
+#include "striped_map.h"
+#include "negative_cache.h"
+#include "dir_cache.h"
+#include "path_tree.h"
+#include "batcher.h"
+#include "transfer.h"
+#include "devices.h"
+#include "local_copies.h"
+#include "extents.h"
+#include "digest.h"
+#include "inodes.h"
+#ifdef ADBFS_FUSE3
+#include "lowlevel.h"
+#endif
 #include <unistd.h>
 
 #include<stddef.h>
@@ -83,6 +109,26 @@
 #include <pwd.h>
 #include <grp.h>
 
+/**
+   File the trace is dumped to, next to the local copies; set in main
+   because a signal handler cannot build it.
+ */
+static char traceDumpPath[4096];
+
+/**
+   Write the newest trace events to stderr and to traceDumpPath, which
+   stays readable when adbfs runs in the background.  Safe to call
+   from a signal handler.
+ */
+void dump_trace(int sig) {
+  traceLog.dump(2);
+  if (!traceDumpPath[0]) return;
+  int fd = open(traceDumpPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd < 0) return;
+  traceLog.dump(fd);
+  close(fd);
+}
+
 void handler(int sig) {
   void *array[10];
   size_t size;
@@ -93,6 +139,7 @@ void handler(int sig) {
   // print out all the frames to stderr
   fprintf(stderr, "Error: signal %d:\n", sig);
   backtrace_symbols_fd(array, size, 2);
+  dump_trace(sig);
   exit(1);
 }
 
@@ -101,40 +148,353 @@ using namespace std;
 
 void shell_escape_command(string&);
 void adb_shell_escape_command(string&);
-queue<string> adb_push(const string&, const string&);
-queue<string> adb_pull(const string&, const string&);
+queue<string> adb_push(const string&, const string&, bool* = NULL,
+                       int = TRANSFER_INTERACTIVE);
+queue<string> adb_pull(const string&, const string&, int = TRANSFER_INTERACTIVE);
 queue<string> adb_shell(const string&, bool);
 queue<string> shell(const string&);
+bool writeback_push_file(const string&, const string&, string&);
 
 static const char PERMISSION_ERR_MSG[] = ": Permission denied";
 
+/**
+   Seconds attributes are kept in fileData; with the low-level backend
+   the kernel keeps them as long.
+ */
+static const int ATTR_CACHE_TTL = 30;
+
 string tempDirPath;
-map<string,fileCache> fileData;
-void invalidateCache(const string& path) {
-    cout << "invalidate cache " << path << endl;
-    map<string, fileCache>::iterator it = fileData.find(path);
-    if (it != fileData.end())
-        fileData.erase(it);
-}
 
-map<int,bool> filePendingWrite;
-map<string,bool> fileTruncated;
+striped_map<int,bool> filePendingWrite;
+
+/** What each write handle changed since its copy matched the device. */
+striped_map<int,dirty_extents> fileDirty;
+
+/**
+   A handle opened read-only and served from contentCache.
+ */
+struct lazy_handle {
+    shared_ptr<remote_file> file;
+    shared_ptr<readahead_state> ra;
+};
+striped_map<int,lazy_handle> lazyFiles;
+
+/**
+   A write handle whose data goes straight to the device through a sync
+   SEND, as long as it is written sequentially from offset 0.
+ */
+struct upload_stream {
+    mutex lock;
+    adb_sync* sync;     /* NULL once the SEND is finished */
+    off_t offset;       /* bytes sent so far */
+};
+striped_map<int,shared_ptr<upload_stream> > fileStreams;
 
 /**
    Custom options
  */
 
+/* flags are int: fuse_opt_parse stores an int for every flag option */
 struct adb_config {
-    bool rescan;
+    int rescan;
+    int adbcli;
+    int lsmeta;
+    unsigned sessions;
+    unsigned cachesize;
+    unsigned readahead;
+    int writeback;
+    unsigned negcache;
+    unsigned metacache;
+    char* prefetch;
+    char* trace;
+    unsigned batchwait;
+    int compress;
+    unsigned transfers;
+    int devices;
+    int devicehash;
 };
 
 static struct fuse_opt adb_opts[] = {
     { "rescan", offsetof(struct adb_config, rescan), true },
+    { "adbcli", offsetof(struct adb_config, adbcli), true },
+    { "lsmeta", offsetof(struct adb_config, lsmeta), true },
+    { "writeback", offsetof(struct adb_config, writeback), true },
+    { "compress", offsetof(struct adb_config, compress), true },
+    { "devices", offsetof(struct adb_config, devices), true },
+    { "devicehash", offsetof(struct adb_config, devicehash), true },
+    { "sessions=%u", offsetof(struct adb_config, sessions), 0 },
+    { "cachesize=%u", offsetof(struct adb_config, cachesize), 0 },
+    { "readahead=%u", offsetof(struct adb_config, readahead), 0 },
+    { "negcache=%u", offsetof(struct adb_config, negcache), 0 },
+    { "metacache=%u", offsetof(struct adb_config, metacache), 0 },
+    { "prefetch=%s", offsetof(struct adb_config, prefetch), 0 },
+    { "trace=%s", offsetof(struct adb_config, trace), 0 },
+    { "batchwait=%u", offsetof(struct adb_config, batchwait), 0 },
+    { "transfers=%u", offsetof(struct adb_config, transfers), 0 },
     FUSE_OPT_END
 };
 
 static struct adb_config adbfs_conf;
 
+/**
+   What the device's sync service can do for adb_getattr and
+   adb_readdir.  Probed once, on first use.
+ */
+struct sync_metadata {
+    bool available;     /* false: parse ls output instead */
+    bool stat_v2;       /* LST2 instead of STAT */
+    bool ls_v2;         /* LIS2 instead of LIST */
+};
+
+/**
+   What a batched lookup found out about a path.
+ */
+struct attr_lookup {
+    bool ok;                /* false: the device did not answer */
+    unsigned long since;    /* missingPaths token taken before asking */
+    fileCache entry;
+};
+
+static void lookup_attributes(const vector<string>&, vector<attr_lookup>&);
+
+/**
+   Everything adbfs keeps for one device: its connections, caches and
+   transfer queues.  A mount of one device has one of these; with
+   -o devices every attached device gets its own, so that devices share
+   no cache and never wait for each other's connections or transfers.
+
+   They are never freed: their worker threads keep running, and a
+   device that is plugged in again finds its caches where it left them.
+ */
+struct adb_device {
+    /** Device serial; empty for $ANDROID_SERIAL or the only device. */
+    string serial;
+
+    /** Directory of local copies, ending in "/". */
+    string tempDir;
+
+    /** Attributes of device paths, by escaped path. */
+    path_tree fileData;
+
+    striped_map<string,bool> fileTruncated;
+
+    /** Held while the local copy of a path is pulled, pushed or removed. */
+    striped_lock<> localCopyLocks;
+
+    /** Local copies kept after release, and what they were pulled from. */
+    local_copies localCopies;
+
+    /** Digests of what the device has of each local copy, by escaped path. */
+    striped_map<string, file_digest> copyDigests;
+
+    /** Persistent device shells shared by all adb_shell calls. */
+    shell_session_pool* sessionPool;
+
+    /** Idle connections to the device's sync service. */
+    adb_sync_pool syncPool;
+
+    /** Blocks of device files read so far, kept across open/release. */
+    content_cache* contentCache;
+
+    /** Background fetching ahead of sequential readers of lazyFiles. */
+    readahead_engine* readaheadEngine;
+
+    /** Files flushed in write-back mode, waiting to be pushed. */
+    writeback_queue* writebackQueue;
+
+    /**
+       Workers for whole-file pulls and pushes, and for fetching ahead
+       of readers that go through a directory file by file.
+     */
+    transfer_pool* transferPool;
+
+    /** Paths that getattr found missing, so repeated probes skip the device. */
+    negative_cache missingPaths;
+
+    /**
+       Names in recently listed directories, kept up to date by the
+       callbacks that create and remove files.
+     */
+    dir_cache dirListings;
+
+    struct sync_metadata syncMetadata;
+    once_flag syncMetadataProbe;
+
+    /** Coalesces the cache misses of concurrent getattr calls. */
+    request_batcher<attr_lookup> statBatcher;
+
+    /** Held while prefetch_tree runs. */
+    mutex prefetchLock;
+
+    adb_device(const string& serial);
+};
+
+/** The device of the FUSE call or worker on this thread, if any. */
+static thread_local adb_device* currentDevice;
+
+/** The device of a mount of one device, and of threads that have none. */
+static adb_device* defaultDevice;
+
+/** @return the device this thread works for. */
+static adb_device& device()
+{
+    return currentDevice ? *currentDevice : *defaultDevice;
+}
+
+/**
+   Makes a device the one this thread works for, until the end of the
+   scope.
+ */
+class device_scope {
+public:
+    device_scope(adb_device* dev)
+        : saved(currentDevice), serial(dev->serial)
+    {
+        currentDevice = dev;
+    }
+
+    ~device_scope() { currentDevice = saved; }
+
+private:
+    adb_device* saved;
+    adb_serial_scope serial;
+};
+
+adb_device::adb_device(const string& serial)
+    : serial(serial),
+      sessionPool(new shell_session_pool),
+      contentCache(new content_cache(serial)),
+      readaheadEngine(new readahead_engine),
+      transferPool(new transfer_pool),
+      statBatcher(lookup_attributes)
+{
+    memset(&syncMetadata, 0, sizeof(syncMetadata));
+    writebackQueue = new writeback_queue(
+        [this](const string& spool, const string& remote, string& error) {
+            device_scope scope(this);
+            return writeback_push_file(spool, remote, error);
+        });
+}
+
+/**
+   With -o devices, the device of every serial seen so far.
+ */
+static map<string, adb_device*> deviceContexts;
+static mutex deviceContextsLock;
+
+/**
+   The devices that are online, for -o devices.
+ */
+static device_tracker deviceTracker;
+
+/** @return every device this process has state for. */
+static vector<adb_device*> known_devices()
+{
+    vector<adb_device*> all;
+    if (!adbfs_conf.devices) {
+        all.push_back(defaultDevice);
+        return all;
+    }
+    lock_guard<mutex> guard(deviceContextsLock);
+    for (map<string, adb_device*>::iterator it = deviceContexts.begin();
+         it != deviceContexts.end(); ++it)
+        all.push_back(it->second);
+    return all;
+}
+
+void invalidateCache(const string& path) {
+    TRACE(TRACE_DEBUG, "invalidate cache " << path);
+    device().fileData.erase(path);
+}
+
+/**
+   Directory served by adbfs itself rather than the device, and the
+   statistics file in it.  Neither shows up in the listing of /.
+ */
+static const char CONTROL_DIR[] = "/.adbfs";
+static const char STATS_FILE[] = "/.adbfs/stats";
+
+/**
+   Snapshots of the statistics, taken when STATS_FILE is opened, by
+   file handle.  The handles are descriptors of /dev/null, so that they
+   cannot clash with those of real files.
+ */
+striped_map<int,shared_ptr<string> > statsFiles;
+
+static bool is_control_path(const char* path)
+{
+    size_t n = sizeof(CONTROL_DIR) - 1;
+    return strncmp(path, CONTROL_DIR, n) == 0 && (path[n] == '\0' || path[n] == '/');
+}
+
+/**
+   @return the contents of STATS_FILE: adbfsStats followed by the
+   state of the caches, per device if there are several.
+ */
+static string render_stats()
+{
+    ostringstream out;
+    out << adbfsStats.render();
+    vector<adb_device*> devices = known_devices();
+    for (size_t i = 0; i < devices.size(); ++i) {
+        adb_device& dev = *devices[i];
+        if (!dev.serial.empty()) out << "\ndevice " << dev.serial << "\n";
+        content_cache_stats blocks = dev.contentCache->stats();
+        out << "block cache hits: " << blocks.hits << "\n"
+            << "block cache misses: " << blocks.misses << "\n"
+            << "block cache evictions: " << blocks.evictions << "\n"
+            << "block cache bytes: " << blocks.bytes << "\n"
+            << "attribute cache entries: " << dev.fileData.size() << "\n"
+            << "attribute cache bytes: " << dev.fileData.memory() << "\n"
+            << "transfers queued: " << dev.transferPool->queued() << "\n";
+    }
+    return out.str();
+}
+
+static int control_getattr(const char* path, struct stat* stbuf)
+{
+    stbuf->st_ino = 1;
+    stbuf->st_mtime = stbuf->st_atime = stbuf->st_ctime = time(NULL);
+    if (!strcmp(path, CONTROL_DIR)) {
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+    if (!strcmp(path, STATS_FILE)) {
+        // reads are direct_io, so this is only a hint
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = render_stats().size();
+        return 0;
+    }
+    return -ENOENT;
+}
+
+static int control_open(const char* path, struct fuse_file_info* fi)
+{
+    if (strcmp(path, STATS_FILE)) return strcmp(path, CONTROL_DIR) ? -ENOENT : -EISDIR;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+    int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -errno;
+    statsFiles.set(fd, make_shared<string>(render_stats()));
+    fi->fh = fd;
+    fi->direct_io = 1;
+    return 0;
+}
+
+void shell_unescape_dquoted(string&);
+void shell_unescape_path(string&);
+
+/**
+   @return "adb " followed by the option that picks the device of this
+   thread, to start commands with when the adb executable is run.
+ */
+static string adb_cli()
+{
+    if (adbSerial.empty()) return "adb ";
+    return "adb -s " + shell_single_quote(adbSerial) + " ";
+}
+
 /**
    Return the result of executing the given command string, using
    exec_command, on the local host.
@@ -154,19 +514,36 @@ queue<string> shell(const string& command)
    Return the result of executing the given command on the Android
    device using adb.
 
-   The given string command is prefixed with "adb shell " to
-   yield the adb command line.
+   The command is normally sent to one of the persistent shells in
+   sessionPool.  If that is disabled (-o sessions=0) or no session can
+   be started, the given string command is prefixed with "adb shell "
+   to yield the adb command line.
 
    @param command the command to execute.
    @see exec_command.
+   @see shell_session_pool.
    @todo perhaps avoid use of local shell to simplify escaping.
  */
 queue<string> adb_shell(const string& command, bool getStderr = false)
 {
+    stats_timer timer(adbfsStats.commands[adbfs_stats::classify(command)]);
+    if (adbfs_conf.sessions > 0) {
+        string device_command;
+        device_command.assign(command);
+        shell_unescape_dquoted(device_command);
+        shared_ptr<shell_session> session = device().sessionPool->acquire(adbfs_conf.sessions, !adbfs_conf.adbcli);
+        if (session) {
+            TRACE(TRACE_INFO, "adb_shell[session]: " << device_command);
+            shell_request req;
+            if (session->run(device_command, getStderr, req))
+                return req.output;
+        }
+    }
+
     string actual_command;
     actual_command.assign(command);
     //adb_shell_escape_command(actual_command);
-    actual_command.insert(0, "adb shell \"");
+    actual_command.insert(0, adb_cli() + "shell \"");
     actual_command.append("\"");
     if (getStderr) actual_command.append(" 2>&1");
     return exec_command(actual_command);
@@ -232,8 +609,43 @@ void shell_escape_path(string &path)
 }
 
 /**
-   Make a secure temporary directory for each mounted filesystem. Use with
-   ANDROID_SERIAL environment variable to mount multiple phones at once.
+   Modify, in place, the given string by removing the escapes that the
+   local shell strips inside double quotes.  Commands passed to
+   adb_shell are written for "adb shell \"...\"", so this is needed
+   when they reach the device shell without going through the local
+   one.
+
+   @param cmd the string to modify.
+   @see shell_escape_path.
+ */
+void shell_unescape_dquoted(string& cmd)
+{
+    string result;
+    for (size_t i = 0; i < cmd.size(); ++i) {
+        if (cmd[i] == '\\' && i + 1 < cmd.size() &&
+            strchr("\"\\$`", cmd[i + 1]) != NULL)
+            ++i;
+        result.push_back(cmd[i]);
+    }
+    cmd.swap(result);
+}
+
+/**
+   Modify, in place, the given path string by undoing shell_escape_path,
+   for paths that are handed to the adb server instead of a shell.
+
+   @param path the string to modify.
+   @see shell_escape_path.
+ */
+void shell_unescape_path(string &path)
+{
+  string_replacer(path, "'\\''", "'");
+  string_replacer(path, "\\\"", "\"");
+}
+
+/**
+   Make a secure temporary directory for each mounted filesystem. With
+   -o devices each device gets a directory of its own inside it.
 
    Also set up a callback to cleanup after ourselves on clean shutdown.
  */
@@ -263,7 +675,7 @@ void makeTmpDir(void) {
 void adb_push_pull_cmd(string& cmd, const bool push,
 		       const string& local_path, const string& remote_path)
 {
-    cmd.assign("adb ");
+    cmd.assign(adb_cli());
     cmd.append((push ? "push '" : "pull '"));
     cmd.append((push ? local_path : remote_path));
     cmd.append("' '");
@@ -272,41 +684,409 @@ void adb_push_pull_cmd(string& cmd, const bool push,
 }
 
 /**
-   Copy (using adb pull) a file from the Android device to the local
-   host.
+   @param path escaped device path.
+   @return the size fileData has for path, or -1 if it has none.
+ */
+static int64_t cached_size(const string& path)
+{
+    fileCache entry = fileCache();
+    if (!device().fileData.get(path, entry) || !entry.haveStat) return -1;
+    return entry.st.st_size;
+}
+
+/**
+   Pull a file through the device's gzip; see compression.h.
+
+   @param remote unescaped device path.
+   @param fd local file, empty, to write to.
+   @return false if that did not work, with fd emptied again.
+ */
+static bool compressed_pull(const string& remote, int fd)
+{
+    TRACE(TRACE_INFO, "gzip pull: " << remote);
+    int sock = adb_device_service("exec:gzip -1 -c " + shell_single_quote(remote)
+                                  + " 2>/dev/null", NULL);
+    if (sock < 0) return false;
+    gunzip_stream gz;
+    char buf[SYNC_DATA_MAX];
+    bool ok = true;
+    for (;;) {
+        ssize_t n = read(sock, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (!gz.feed(buf, n, [fd](const char* data, size_t size) {
+                return write_all(fd, data, size);
+            })) {
+            ok = false;
+            break;
+        }
+    }
+    close(sock);
+    if (!ok || !gz.done()) {
+        // e.g. a file we may not read: the sync service will say why
+        ftruncate(fd, 0);
+        lseek(fd, 0, SEEK_SET);
+        return false;
+    }
+    if (gz.raw() > gz.compressed()) adbfsStats.add(BYTES_SAVED, gz.raw() - gz.compressed());
+    transferCompression.observe(remote, gz.raw(), gz.compressed());
+    return true;
+}
+
+/**
+   Push a file gzipped, and unpack it on the device; see compression.h.
+
+   @param local unescaped local path.
+   @param remote unescaped device path.
+   @return false if the file was not pushed this way; nothing is left
+   on the device then, and the caller pushes it as it is.
+ */
+static bool compressed_push(const string& local, const string& remote)
+{
+    int in = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) < 0) {
+        if (in >= 0) close(in);
+        return false;
+    }
+    string packed = device().tempDir + "push-XXXXXX";
+    int out = mkstemp(&packed[0]);
+    uint64_t raw = 0, compressed = 0;
+    bool ok = out >= 0 && gzip_file(in, out, raw, compressed);
+    close(in);
+    transferCompression.observe(remote, raw, compressed);
+    if (!ok || compressed * 10 >= raw * 9) {
+        if (out >= 0) close(out);
+        unlink(packed.c_str());
+        return false;
+    }
+
+    TRACE(TRACE_INFO, "gzip push: " << remote << " " << raw << " -> " << compressed);
+    string spool = remote + ".adbfs-" + to_string(getpid()) + ".gz";
+    adb_sync* sync = device().syncPool.acquire();
+    string error;
+    ok = sync && lseek(out, 0, SEEK_SET) == 0
+        && sync->send(spool, S_IFREG | 0600, out, st.st_mtime, &error);
+    device().syncPool.release(sync);
+    close(out);
+    unlink(packed.c_str());
+    if (ok) {
+        // unpacked next to the target and moved over it, so that a
+        // failure leaves the old file; the time comes from the spool,
+        // which the SEND gave the local copy's (toolbox touch only
+        // knows -t seconds)
+        char mode[8];
+        snprintf(mode, sizeof mode, "%o", (unsigned)(st.st_mode & 0777));
+        string quoted_spool = shell_single_quote(spool);
+        string unpacked = shell_single_quote(remote + ".adbfs-" + to_string(getpid()) + ".tmp");
+        string unpack = "(gzip -d -c " + quoted_spool + " > " + unpacked
+            + " && chmod " + mode + " " + unpacked
+            + " && (touch -r " + quoted_spool + " " + unpacked + " 2>/dev/null || touch -t "
+            + to_string((long long)st.st_mtime) + " " + unpacked + ")"
+            + " && mv -f " + unpacked + " " + shell_single_quote(remote)
+            + " && echo ok); rm -f " + quoted_spool + " " + unpacked;
+        string output;
+        ok = adb_exec(unpack, output) && output == "ok\n";
+    }
+    if (!ok) {
+        TRACE(TRACE_ERROR, "gzip push of " << remote << " failed " << error);
+        return false;
+    }
+    adbfsStats.add(BYTES_SAVED, raw - compressed);
+    return true;
+}
+
+/**
+   The work of adb_pull, done on a transferPool worker.
+ */
+static queue<string> pull_now(const string& remote_source,
+                              const string& local_destination)
+{
+    stats_timer timer(adbfsStats.commands[CMD_PULL]);
+    if (!adbfs_conf.adbcli
+        && transferCompression.worth_it(remote_source, cached_size(remote_source))) {
+        string remote = remote_source, local = local_destination;
+        shell_unescape_path(remote);
+        shell_unescape_path(local);
+        int fd = open(local.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        struct stat st;
+        bool ok = fd >= 0 && compressed_pull(remote, fd) && fstat(fd, &st) == 0;
+        if (ok) adbfsStats.add(BYTES_PULLED, st.st_size);
+        if (fd >= 0) close(fd);
+        if (ok) return queue<string>();
+    }
+    adb_sync* sync = adbfs_conf.adbcli ? NULL : device().syncPool.acquire();
+    if (sync) {
+        string remote = remote_source, local = local_destination;
+        shell_unescape_path(remote);
+        shell_unescape_path(local);
+        TRACE(TRACE_INFO, "sync RECV: " << remote);
+        queue<string> output;
+        string error;
+        int fd = open(local.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            output.push(strerror(errno));
+            device().syncPool.release(sync);
+            return output;
+        }
+        bool ok = sync->recv(remote, fd, &error);
+        struct stat st;
+        if (ok && fstat(fd, &st) == 0) adbfsStats.add(BYTES_PULLED, st.st_size);
+        close(fd);
+        if (!error.empty()) output.push(error);
+        // a broken connection is retried through the adb executable
+        bool usable = ok || sync->connected();
+        device().syncPool.release(sync);
+        if (usable) return output;
+    }
+
+    string cmd;
+    adb_push_pull_cmd(cmd, false, local_destination, remote_source);
+    queue<string> res = exec_command(cmd);
+    string local = local_destination;
+    shell_unescape_path(local);
+    struct stat st;
+    if (stat(local.c_str(), &st) == 0) adbfsStats.add(BYTES_PULLED, st.st_size);
+    return res;
+}
+
+/**
+   The work of adb_push, done on a transferPool worker.
+ */
+static queue<string> push_now(const string& local_source,
+                              const string& remote_destination, bool* ok)
+{
+    stats_timer timer(adbfsStats.commands[CMD_PUSH]);
+    if (!adbfs_conf.adbcli) {
+        string remote = remote_destination, local = local_source;
+        shell_unescape_path(remote);
+        shell_unescape_path(local);
+        struct stat st;
+        if (stat(local.c_str(), &st) == 0 && transferCompression.worth_it(remote, st.st_size)
+            && compressed_push(local, remote)) {
+            adbfsStats.add(BYTES_PUSHED, st.st_size);
+            invalidateCache(remote_destination);
+            device().contentCache->invalidate(remote);
+            if (ok) *ok = true;
+            return queue<string>();
+        }
+    }
+    adb_sync* sync = adbfs_conf.adbcli ? NULL : device().syncPool.acquire();
+    if (sync) {
+        string remote = remote_destination, local = local_source;
+        shell_unescape_path(remote);
+        shell_unescape_path(local);
+        TRACE(TRACE_INFO, "sync SEND: " << remote);
+        queue<string> output;
+        string error;
+        struct stat st;
+        int fd = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            output.push(strerror(errno));
+            if (fd >= 0) close(fd);
+            device().syncPool.release(sync);
+            if (ok) *ok = false;
+            return output;
+        }
+        bool sent = sync->send(remote, S_IFREG | (st.st_mode & 0777), fd,
+                               st.st_mtime, &error);
+        close(fd);
+        if (sent) adbfsStats.add(BYTES_PUSHED, st.st_size);
+        if (!error.empty()) output.push(error);
+        bool usable = sent || sync->connected();
+        device().syncPool.release(sync);
+        if (usable) {
+            invalidateCache(remote_destination);
+            device().contentCache->invalidate(remote);
+            if (ok) *ok = sent;
+            return output;
+        }
+    }
+
+    string cmd;
+    adb_push_pull_cmd(cmd, true, local_source, remote_destination);
+    queue<string> res = exec_command(cmd);
+    string local = local_source;
+    shell_unescape_path(local);
+    struct stat st;
+    if (stat(local.c_str(), &st) == 0) adbfsStats.add(BYTES_PUSHED, st.st_size);
+    if (ok) {
+        // adb push reports failures as "adb: error: ..." or, on old
+        // versions, "failed to copy ..."
+        *ok = true;
+        for (queue<string> lines = res; !lines.empty(); lines.pop())
+            if (lines.front().find("error") != string::npos ||
+                lines.front().find("failed") != string::npos) *ok = false;
+    }
+    invalidateCache(remote_destination);
+    string remote = remote_destination;
+    shell_unescape_path(remote);
+    device().contentCache->invalidate(remote);
+    return res;
+}
+
+/**
+   Ranges are written to the device in blocks of this size, so that dd
+   can place them without byte-granular seeks, which old dd lacks.
+ */
+static const off_t RANGED_WRITE_BLOCK = 4096;
+
+/** Files smaller than this are pushed whole; it costs one round trip less. */
+static const off_t RANGED_WRITE_MIN_SIZE = 1 << 20;
+
+/** More ranges than this are pushed whole rather than in one long command. */
+static const size_t RANGED_WRITE_MAX_RANGES = 64;
+
+/**
+   The work of adb_push_ranges, done on a transferPool worker: send the
+   dirty blocks of the local copy to a spool file next to the device
+   file, and copy them into place with "dd conv=notrunc".
+
+   @return false if a full push is needed instead.
+ */
+static bool push_ranges_now(const string& local, const string& remote,
+                            const dirty_extents& dirty)
+{
+    struct stat st;
+    if (adbfs_conf.adbcli || dirty.empty() || dirty.base_size() < 0
+        || stat(local.c_str(), &st) < 0 || st.st_size < RANGED_WRITE_MIN_SIZE
+        || st.st_size != max(dirty.base_size(), dirty.end()))
+        return false;
+    vector<pair<off_t, off_t> > ranges = dirty.aligned(RANGED_WRITE_BLOCK, st.st_size);
+    off_t bytes = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) bytes += ranges[i].second - ranges[i].first;
+    if (ranges.size() > RANGED_WRITE_MAX_RANGES || bytes * 2 > st.st_size) return false;
+
+    stats_timer timer(adbfsStats.commands[CMD_PUSH]);
+    int in = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+    string packed = device().tempDir + "ranges-XXXXXX";
+    int out = in < 0 ? -1 : mkostemp(&packed[0], O_CLOEXEC);
+    bool ok = out >= 0;
+    vector<char> buf(REMOTE_BLOCK_SIZE);
+    for (size_t i = 0; ok && i < ranges.size(); ++i) {
+        for (off_t pos = ranges[i].first; ok && pos < ranges[i].second; ) {
+            size_t want = min((off_t)buf.size(), ranges[i].second - pos);
+            ssize_t n = pread(in, &buf[0], want, pos);
+            ok = n == (ssize_t)want && write(out, &buf[0], n) == n;
+            pos += want;
+        }
+    }
+    if (in >= 0) close(in);
+
+    TRACE(TRACE_INFO, "ranged write: " << remote << " " << ranges.size() << " ranges, "
+          << bytes << " of " << st.st_size << " bytes");
+    string spool = remote + ".adbfs-" + to_string(getpid()) + ".ranges";
+    adb_sync* sync = ok ? device().syncPool.acquire() : NULL;
+    string error;
+    ok = sync && lseek(out, 0, SEEK_SET) == 0
+        && sync->send(spool, S_IFREG | 0600, out, time(NULL), &error);
+    device().syncPool.release(sync);
+    if (out >= 0) {
+        close(out);
+        unlink(packed.c_str());
+    }
+    if (ok) {
+        // all blocks in the spool are whole but perhaps the last one,
+        // which is the end of the file
+        string place = "(";
+        off_t skip = 0;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            off_t count = (ranges[i].second - ranges[i].first + RANGED_WRITE_BLOCK - 1)
+                / RANGED_WRITE_BLOCK;
+            place += "dd if=" + shell_single_quote(spool) + " of=" + shell_single_quote(remote)
+                + " bs=" + to_string(RANGED_WRITE_BLOCK) + " skip=" + to_string(skip)
+                + " seek=" + to_string(ranges[i].first / RANGED_WRITE_BLOCK)
+                + " count=" + to_string(count) + " conv=notrunc 2>/dev/null && ";
+            skip += count;
+        }
+        place += "echo ok); rm -f " + shell_single_quote(spool);
+        string output;
+        ok = adb_exec(place, output) && output == "ok\n";
+    }
+    if (!ok) {
+        TRACE(TRACE_ERROR, "ranged write of " << remote << " failed " << error);
+        return false;
+    }
+    adbfsStats.add(BYTES_PUSHED, bytes);
+    adbfsStats.add(RANGED_WRITES);
+    string escaped = remote;
+    shell_escape_path(escaped);
+    invalidateCache(escaped);
+    device().contentCache->invalidate(remote);
+    return true;
+}
+
+/**
+   Copy (using the sync service's RECV, or adb pull if the adb server
+   cannot be reached) a file from the Android device to the local host.
 
    @param remote_source Android-side file path to copy.
    @param local_destination local host-side destination path for copy.
-   @return result of the "adb pull ..." executed using exec_command.
+   @param priority TRANSFER_BACKGROUND if no FUSE call waits for it.
+   @return error messages, or the result of the "adb pull ..." executed
+   using exec_command.
    @see adb_push.
    @see adb_push_pull_cmd.
    @todo perhaps avoid or simplify shell-escaping.
    @bug problems with files with spaces in filenames (adb bug?)
  */
 queue<string> adb_pull(const string& remote_source,
-		       const string& local_destination)
+		       const string& local_destination, int priority)
 {
-    string cmd;
-    adb_push_pull_cmd(cmd, false, local_destination, remote_source);
-    return exec_command(cmd);
+    queue<string> output;
+    adb_device* dev = &device();
+    dev->transferPool->run(priority, [&] {
+        device_scope scope(dev);
+        output = pull_now(remote_source, local_destination);
+    });
+    return output;
 }
 
 /**
-   Copy (using adb push) a file from the local host to the Android
-   device. Very similar to adb_pull.
+   Copy (using the sync service's SEND, or adb push) a file from the
+   local host to the Android device. Very similar to adb_pull.
 
+   @param ok if given, set to whether the file arrived on the device.
+   @param priority TRANSFER_BACKGROUND if no FUSE call waits for it.
    @see adb_pull.
    @see adb_push_pull_cmd.
    @bug problems with files with spaces in filenames (adb bug?)
  */
 queue<string> adb_push(const string& local_source,
-		       const string& remote_destination)
+		       const string& remote_destination, bool* ok, int priority)
 {
-    string cmd;
-    adb_push_pull_cmd(cmd, true, local_source, remote_destination);
-    queue<string> res = exec_command(cmd);
-    invalidateCache(remote_destination);
-    return res;
+    queue<string> output;
+    bool sent = false;
+    adb_device* dev = &device();
+    dev->transferPool->run(priority, [&] {
+        device_scope scope(dev);
+        output = push_now(local_source, remote_destination, &sent);
+    });
+    if (ok) *ok = sent;
+    return output;
+}
+
+/**
+   Write only what changed of a file whose device copy is otherwise
+   the same as the local one.
+
+   @param local unescaped local copy.
+   @param remote unescaped device path.
+   @param dirty what was written to the local copy.
+   @return false if nothing was written, because the ranges cover too
+   much of the file or the device copy may differ elsewhere; push the
+   whole file then.
+ */
+static bool adb_push_ranges(const string& local, const string& remote,
+                            const dirty_extents& dirty)
+{
+    bool done = false;
+    adb_device* dev = &device();
+    dev->transferPool->run(TRANSFER_INTERACTIVE, [&] {
+        device_scope scope(dev);
+        done = push_ranges_now(local, remote, dirty);
+    });
+    return done;
 }
 
 /**
@@ -333,6 +1113,23 @@ queue<string> adb_rescan_dir_removed(const string& remote_path)
     return adb_shell(cmd);
 }
 
+/**
+   Push a file queued in write-back mode; see writeback.h.
+ */
+bool writeback_push_file(const string& spool, const string& remote,
+                         string& error)
+{
+    string local_string = spool, remote_string = remote;
+    shell_escape_path(local_string);
+    shell_escape_path(remote_string);
+    bool ok = false;
+    queue<string> output = adb_push(local_string, remote_string, &ok,
+                                    TRANSFER_BACKGROUND);
+    if (!ok) error = output.empty() ? "push failed" : output.back();
+    if (ok && adbfs_conf.rescan) adb_rescan_file(remote_string);
+    return ok;
+}
+
 /**
    adbFS implementation of FUSE interface function fuse_operations.getattr.
    @todo check shell escaping.
@@ -340,7 +1137,7 @@ queue<string> adb_rescan_dir_removed(const string& remote_path)
 
 
 
-int strmode_to_rawmode(const string& str) {
+int strmode_to_rawmode(const char* str) {
     int fmode = 0;
     switch (str[0]) {
     case 's': fmode |= S_IFSOCK; break;
@@ -408,156 +1205,391 @@ bool is_valid_ls_output(const string& file) {
   return true;
 }
 
-static int adb_getattr(const char *path, struct stat *stbuf)
-{
-    cout << "adb_getattr" << endl;
-    int res = 0;
-    struct passwd * foruid;
-    struct group * forgid;
-    memset(stbuf, 0, sizeof(struct stat));
-    queue<string> output;
-    string path_string;
-    path_string.assign(path);
-    shell_escape_path(path_string);
-    // TODO /caching?
-    //
-    vector<string> output_chunk;
-    if (fileData.find(path_string) ==  fileData.end()
-	|| fileData[path_string].timestamp + 30 < time(NULL)) {
-        string command = "ls -l -a -d '";
-        command.append(path_string);
-        command.append("'");
-        output = adb_shell(command, true);
-        if (output.empty()) return -EAGAIN; /* no phone */
-        // error format: "/sbin/healthd: Permission denied"
-        if (
-            output.front().length() > sizeof(PERMISSION_ERR_MSG) &&
-            (!output.front().compare(output.front().length() - sizeof(PERMISSION_ERR_MSG) + 1,
-                                    sizeof(PERMISSION_ERR_MSG) - 1, PERMISSION_ERR_MSG)))
-        {
-            fileData[path_string].statOutput.erase();
+/**
+   Names in ls output resolved to host ids, so that each owner is
+   looked up once instead of on every getattr.
+ */
+class ls_id_cache {
+public:
+    /**
+       @param name user or group name, not necessarily NUL terminated.
+       @param len length of name.
+       @return the host's id for name, or 98 if it has none.
+     */
+    unsigned lookup(const char* name, size_t len, bool group)
+    {
+        char key[64];
+        if (len >= sizeof key) return 98;
+        memcpy(key, name, len);
+        key[len] = '\0';
+        lock_guard<mutex> guard(lock);
+        map<string, unsigned>& ids = group ? groups : users;
+        map<string, unsigned>::iterator it = ids.find(key);
+        if (it != ids.end()) return it->second;
+        // 98 has been chosen (poorly) so that it doesn't map to anything
+        unsigned id = 98;
+        char buf[1024];
+        if (group) {
+            struct group grp, * found;
+            if (getgrnam_r(key, &grp, buf, sizeof buf, &found) == 0 && found)
+                id = found->gr_gid;
         } else {
-            output_chunk = make_array(output.front());
-            fileData[path_string].statOutput = output.front();
+            struct passwd pwd, * found;
+            if (getpwnam_r(key, &pwd, buf, sizeof buf, &found) == 0 && found)
+                id = found->pw_uid;
         }
-        fileData[path_string].timestamp = time(NULL);
-    } else{
-        output_chunk = make_array(fileData[path_string].statOutput);
-        cout << "from cache " << path << "\n";
-    }
-    if (fileData[path_string].statOutput.empty()) {
-        // return empty structure - file exists, but no info available
-        stbuf->st_mode = S_IFREG;
-        return res;
+        if (ids.size() >= 1024) ids.clear();
+        ids[key] = id;
+        return id;
     }
 
-    if(!is_valid_ls_output(output_chunk[0])) {
-        return -ENOENT;
+private:
+    mutex lock;
+    map<string, unsigned> users, groups;
+};
+
+/**
+   Local times from ls output converted with mktime once per hour of
+   the day they fall in; DST changes happen on the hour.
+ */
+class ls_time_cache {
+public:
+    /**
+       @param date "YYYY-MM-DD".
+       @param hm "HH:MM".
+     */
+    time_t convert(const char* date, const char* hm)
+    {
+        int year = atoi(date), month = 0, day = 0;
+        const char* dash = strchr(date, '-');
+        if (dash) {
+            month = atoi(dash + 1);
+            dash = strchr(dash + 1, '-');
+            if (dash) day = atoi(dash + 1);
+        }
+        int hour = atoi(hm), minute = 0;
+        const char* colon = strchr(hm, ':');
+        if (colon) minute = atoi(colon + 1);
+
+        long long key = ((year * 16LL + month) * 32 + day) * 32 + hour;
+        lock_guard<mutex> guard(lock);
+        map<long long, time_t>::iterator it = hours.find(key);
+        if (it == hours.end()) {
+            struct tm ftime;
+            memset(&ftime, 0, sizeof ftime);
+            ftime.tm_year = year - 1900;
+            ftime.tm_mon  = month - 1;
+            ftime.tm_mday = day;
+            ftime.tm_hour = hour;
+            ftime.tm_isdst = -1;
+            if (hours.size() >= 4096) hours.clear();
+            it = hours.insert(make_pair(key, mktime(&ftime))).first;
+        }
+        return it->second + minute * 60;
     }
 
-    //
-    // ls -lad explained
-    // -rw-rw-r-- root     sdcard_rw   763362 2012-06-22 02:16 file.html
-    //
-    // Alternative
-    // -rw-r--r--   1 root   root      5905 1970-01-01 01:00 ueventd.rc
-    //stbuf->st_dev = atoi(output_chunk[1].c_str());     /* ID of device containing file */
-    //
-    // In octal,
-    // 40XXX is folder, 100xxx is file
-    // xxx is regular mode e.g. 755 = rwxr-xr-x
-    //
+private:
+    mutex lock;
+    map<long long, time_t> hours;
+};
 
-    stbuf->st_ino = 1;      /* inode number, fake. */
+static ls_id_cache lsIds;
+static ls_time_cache lsTimes;
 
-    stbuf->st_mode = strmode_to_rawmode(output_chunk[0]); // | 0700
+/**
+   Parse one line of "ls -l -a" output into a struct stat, and the
+   link target if it is a symbolic link.  The line is only scanned in
+   place; nothing is allocated unless the line has a link target.
 
-    int uid_offset = 0;
+   ls -lad explained
+   -rw-rw-r-- root     sdcard_rw   763362 2012-06-22 02:16 file.html
 
-    stbuf->st_nlink = atoi(output_chunk[1].c_str());
-    if (stbuf->st_nlink > 0) uid_offset = 1;
-    else stbuf->st_nlink = 1;
+   Alternative
+   -rw-r--r--   1 root   root      5905 1970-01-01 01:00 ueventd.rc
 
-    foruid = getpwnam(output_chunk[uid_offset + 1].c_str());
-    if (foruid)
-	    stbuf->st_uid = foruid->pw_uid;     /* user ID of owner */
-    else
-	    stbuf->st_uid = 98; /* 98 has been chosen (poorly) so that it doesn't map to anything */
+   @return false if the line is not a valid listing (an error message).
+ */
+bool parse_ls_line(const string& line, struct stat& st, string& link)
+{
+    memset(&st, 0, sizeof(struct stat));
+    link.clear();
+    if (line.size() < 10 || !is_valid_ls_output(line)) return false;
+
+    // up to the time, the fields are separated by runs of spaces
+    static const int FIELDS = 10;
+    const char* field[FIELDS];
+    size_t length[FIELDS];
+    int fields = 0;
+    const char* p = line.c_str();
+    while (fields < FIELDS) {
+        while (*p == ' ') ++p;
+        if (!*p) break;
+        field[fields] = p;
+        while (*p && *p != ' ') ++p;
+        length[fields] = p - field[fields];
+        ++fields;
+    }
 
-    forgid = getgrnam(output_chunk[uid_offset + 2].c_str());
-    if (forgid)
-	    stbuf->st_gid = forgid->gr_gid;     /* group ID of owner */
-    else
-	    stbuf->st_gid = 98;
+    st.st_ino = 1;      /* inode number, fake. */
+    st.st_mode = strmode_to_rawmode(field[0]);
 
-    //unsigned int device_id;
-    //xtoi(output_chunk[6].c_str(),&device_id);
-    //stbuf->st_rdev = device_id;    // device ID (if special file)
+    int uid_offset = 0;
+    st.st_nlink = fields > 1 ? atoi(field[1]) : 0;
+    if (st.st_nlink > 0) uid_offset = 1;
+    else st.st_nlink = 1;
+    if (fields < uid_offset + 6) return false;
 
-    int iDate;
+    st.st_uid = lsIds.lookup(field[uid_offset + 1], length[uid_offset + 1], false);
+    st.st_gid = lsIds.lookup(field[uid_offset + 2], length[uid_offset + 2], true);
 
-    switch (stbuf->st_mode & S_IFMT) {
+    int iDate;
+    switch (st.st_mode & S_IFMT) {
     case S_IFBLK:
     case S_IFCHR:
-	    stbuf->st_rdev = atoi(output_chunk[uid_offset + 3].c_str()) * 256 +
-                         atoi(output_chunk[uid_offset + 4].c_str());
-	    stbuf->st_size = 0;
-	    iDate = uid_offset + 5;
-	    break;
-
-	    break;
-
+        st.st_rdev = atoi(field[uid_offset + 3]) * 256 + atoi(field[uid_offset + 4]);
+        iDate = uid_offset + 5;
+        break;
     case S_IFREG:
-	    stbuf->st_size = atol(output_chunk[uid_offset + 3].c_str());    /* total size, in bytes */
-	    iDate = uid_offset + 4;
-	    break;
-
+        st.st_size = atoll(field[uid_offset + 3]);    /* total size, in bytes */
+        iDate = uid_offset + 4;
+        break;
     default:
-    case S_IFSOCK:
-    case S_IFIFO:
-    case S_IFLNK:
-    case S_IFDIR:
-	    stbuf->st_size = 0;
-	    iDate = uid_offset + 3;
-        if (output_chunk[iDate].find_first_of("-") == string::npos) ++iDate;
-	    break;
+        iDate = uid_offset + 3;
+        if (!memchr(field[iDate], '-', length[iDate])) ++iDate;
+        break;
     }
+    if (iDate + 1 >= fields) return false;
 
     // du calculates sizes based on number of 512b blocks
-    stbuf->st_blksize = 512;
-    stbuf->st_blocks = (stbuf->st_size + 256) / 512;
-
-    //for (int k = 0; k < output_chunk.size(); ++k) cout << output_chunk[k] << " ";
-    //cout << endl;
-
-    vector<string> ymd = make_array(output_chunk[iDate], "-");
-    vector<string> hm = make_array(output_chunk[iDate + 1], ":");
-
-
-    //for (int k = 0; k < ymd.size(); ++k) cout << ymd[k] << " ";
-    //cout << endl;
-    //for (int k = 0; k <  hm.size(); ++k) cout <<  hm[k] << " ";
-    //cout << endl;
-    struct tm ftime;
-    ftime.tm_year = atoi(ymd[0].c_str()) - 1900;
-    ftime.tm_mon  = atoi(ymd[1].c_str()) - 1;
-    ftime.tm_mday = atoi(ymd[2].c_str());
-    ftime.tm_hour = atoi(hm[0].c_str());
-    ftime.tm_min  = atoi(hm[1].c_str());
-    ftime.tm_sec  = 0;
-    ftime.tm_isdst = -1;
-    time_t now = mktime(&ftime);
-    //cout << "after mktime" << endl;
-
-    //long now = time(0);
-
-    stbuf->st_atime = now;   /* time of last access */
-    //stbuf->st_atime = atol(output_chunk[11].c_str());   /* time of last access */
-    stbuf->st_mtime = now;   /* time of last modification */
-    //stbuf->st_mtime = atol(output_chunk[12].c_str());   /* time of last modification */
-    stbuf->st_ctime = now;   /* time of last status change */
-    //stbuf->st_ctime = atol(output_chunk[13].c_str());   /* time of last status change */
-    return res;
+    st.st_blksize = 512;
+    st.st_blocks = (st.st_size + 256) / 512;
+    st.st_mtime = lsTimes.convert(field[iDate], field[iDate + 1]);
+    st.st_atime = st.st_mtime;
+    st.st_ctime = st.st_mtime;
+
+    if (S_ISLNK(st.st_mode)) {
+        size_t arrow = line.find(" -> ", field[iDate + 1] - line.c_str());
+        if (arrow != string::npos) link.assign(line, arrow + 4, string::npos);
+    }
+    return true;
+}
+
+
+static void probe_sync_metadata()
+{
+    string features;
+    memset(&device().syncMetadata, 0, sizeof(device().syncMetadata));
+    if (adbfs_conf.adbcli || adbfs_conf.lsmeta) return;
+    if (!adb_device_features(features)) return;
+    device().syncMetadata.available = true;
+    device().syncMetadata.stat_v2 = adb_has_feature(features, "stat_v2");
+    device().syncMetadata.ls_v2 = adb_has_feature(features, "ls_v2");
+    TRACE(TRACE_INFO, "sync metadata: stat_v2=" << device().syncMetadata.stat_v2
+          << " ls_v2=" << device().syncMetadata.ls_v2);
+}
+
+/**
+   lstat() a device path through the sync service.
+
+   @param path unescaped device path.
+   @return false if the sync service is unavailable; the caller should
+   fall back to ls.
+ */
+bool sync_lstat(const string& path, sync_stat& st)
+{
+    stats_timer timer(adbfsStats.commands[CMD_STAT]);
+    call_once(device().syncMetadataProbe, probe_sync_metadata);
+    if (!device().syncMetadata.available) return false;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        adb_sync* sync = device().syncPool.acquire();
+        if (!sync) return false;
+        bool ok = device().syncMetadata.stat_v2 ? sync->stat_v2(path, st) : sync->stat(path, st);
+        device().syncPool.release(sync);
+        if (ok) return true;
+        // an idle pooled connection may have gone stale; retry once
+    }
+    return false;
+}
+
+/**
+   List a device directory through the sync service.
+
+   @param path unescaped device path.
+   @return false if the sync service is unavailable.
+ */
+bool sync_list(const string& path, vector<sync_dirent>& entries)
+{
+    stats_timer timer(adbfsStats.commands[CMD_LIST]);
+    call_once(device().syncMetadataProbe, probe_sync_metadata);
+    if (!device().syncMetadata.available) return false;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        adb_sync* sync = device().syncPool.acquire();
+        if (!sync) return false;
+        entries.clear();
+        bool ok = device().syncMetadata.ls_v2 ? sync->list_v2(path, entries) : sync->list(path, entries);
+        device().syncPool.release(sync);
+        if (ok) return true;
+    }
+    return false;
+}
+
+/**
+   Store a line of "ls -l -a -d" output in a cache entry.  A permission
+   error leaves an entry for a file that exists but has no info.
+ */
+void cache_ls_line(fileCache& entry, const string& line)
+{
+    entry.timestamp = time(NULL);
+    // error format: "/sbin/healthd: Permission denied"
+    if (line.length() > sizeof(PERMISSION_ERR_MSG) &&
+        !line.compare(line.length() - sizeof(PERMISSION_ERR_MSG) + 1,
+                      sizeof(PERMISSION_ERR_MSG) - 1, PERMISSION_ERR_MSG)) {
+        entry.haveStat = false;
+        entry.haveLink = false;
+        entry.link.clear();
+        return;
+    }
+    entry.haveStat = true;
+    entry.haveLink = true;
+    if (!parse_ls_line(line, entry.st, entry.link))
+        entry.st.st_mode = 0;   /* no such file */
+}
+
+/**
+   Store a sync stat record in a cache entry.  Exact mode, size and
+   mtime (to the second) come straight from the device; v2 records also
+   carry link count and ownership.
+ */
+void cache_sync_stat(fileCache& entry, const sync_stat& sst)
+{
+    entry.timestamp = time(NULL);
+    entry.haveLink = false;
+    entry.link.clear();
+    if (sst.error != 0 && sst.error != ENOENT && sst.error != ENOTDIR) {
+        // e.g. EACCES: the file exists, but no info available
+        entry.haveStat = false;
+        return;
+    }
+    entry.haveStat = true;
+    memset(&entry.st, 0, sizeof(struct stat));
+    if (sst.error != 0 || sst.mode == 0) return;   /* no such file */
+
+    entry.st.st_ino = 1;    /* inode number, fake. */
+    entry.st.st_mode = sst.mode;
+    entry.st.st_nlink = sst.nlink > 0 ? sst.nlink : 1;
+    entry.st.st_uid = device().syncMetadata.stat_v2 ? sst.uid : 98;
+    entry.st.st_gid = device().syncMetadata.stat_v2 ? sst.gid : 98;
+    entry.st.st_size = S_ISREG(sst.mode) ? sst.size : 0;
+    entry.st.st_blksize = 512;
+    entry.st.st_blocks = (entry.st.st_size + 256) / 512;
+    entry.st.st_mtime = sst.mtime;
+    entry.st.st_atime = sst.atime ? sst.atime : sst.mtime;
+    entry.st.st_ctime = sst.ctime ? sst.ctime : sst.mtime;
+}
+
+/**
+   Look up several paths in one round trip: pipelined STAT requests
+   on one sync connection, or else one shell command with an ls for
+   each path.  The batch function of statBatcher.
+
+   @param paths unescaped device paths.
+ */
+static void lookup_attributes(const vector<string>& paths, vector<attr_lookup>& results)
+{
+    unsigned long since = device().missingPaths.begin();
+    for (size_t i = 0; i < results.size(); ++i) results[i].since = since;
+    call_once(device().syncMetadataProbe, probe_sync_metadata);
+    if (device().syncMetadata.available) {
+        stats_timer timer(adbfsStats.commands[CMD_STAT]);
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            adb_sync* sync = device().syncPool.acquire();
+            if (!sync) break;
+            vector<sync_stat> st;
+            bool ok = sync->stat_many(paths, device().syncMetadata.stat_v2, st);
+            device().syncPool.release(sync);
+            if (!ok) continue;  /* an idle connection may have gone stale */
+            for (size_t i = 0; i < paths.size(); ++i) {
+                cache_sync_stat(results[i].entry, st[i]);
+                results[i].ok = true;
+            }
+            return;
+        }
+    }
+
+    // "ls -d" prints one line per path, error or not; each gets its
+    // own 2>&1 so the lines stay in order
+    vector<string> escaped(paths);
+    string command;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        shell_escape_path(escaped[i]);
+        if (i > 0) command.append("; ");
+        command.append("ls -l -a -d '" + escaped[i] + "' 2>&1");
+    }
+    queue<string> output = adb_shell(command, true);
+    if (output.size() != paths.size() && paths.size() > 1) {
+        TRACE(TRACE_INFO, "batched ls gave " << output.size() << " lines for "
+              << paths.size() << " paths; asking one by one");
+        output = queue<string>();
+        for (size_t i = 0; i < paths.size(); ++i) {
+            queue<string> one = adb_shell("ls -l -a -d '" + escaped[i] + "'", true);
+            output.push(one.empty() ? string() : one.front());
+        }
+    }
+    for (size_t i = 0; i < paths.size() && !output.empty(); ++i, output.pop()) {
+        if (output.front().empty()) continue;   /* no phone */
+        cache_ls_line(results[i].entry, output.front());
+        results[i].ok = true;
+    }
+}
+
+
+static int adb_getattr(const char *path, struct stat *stbuf)
+{
+    stats_timer timer(adbfsStats.ops[OP_GETATTR]);
+    TRACE(TRACE_DEBUG, "adb_getattr " << path);
+    memset(stbuf, 0, sizeof(struct stat));
+    if (is_control_path(path)) return control_getattr(path, stbuf);
+    if (adbfs_conf.writeback && device().writebackQueue->pending_stat(path, *stbuf)) {
+        // report what the device will have once the push is done
+        stbuf->st_ino = 1;
+        stbuf->st_blksize = 512;
+        stbuf->st_blocks = (stbuf->st_size + 256) / 512;
+        return 0;
+    }
+    if (device().missingPaths.missing(path)) {
+        TRACE(TRACE_DEBUG, "known missing " << path);
+        adbfsStats.add(NEGATIVE_HITS);
+        return -ENOENT;
+    }
+    string path_string;
+    path_string.assign(path);
+    shell_escape_path(path_string);
+    fileCache entry = fileCache();
+    bool found = device().fileData.get(path_string, entry);
+    if (!found || entry.timestamp + ATTR_CACHE_TTL < time(NULL)) {
+      adbfsStats.add(found ? ATTR_EXPIRED : ATTR_MISSES);
+      attr_lookup lookup = device().statBatcher.get(path);
+      if (!lookup.ok) return -EAGAIN; /* no phone */
+      entry = lookup.entry;
+      if (entry.haveStat && entry.st.st_mode == 0) {
+          // misses live in missingPaths only
+          device().fileData.erase(path_string);
+          device().missingPaths.add(path, lookup.since);
+          return -ENOENT;
+      }
+      device().fileData.set(path_string, entry);
+    } else{
+        TRACE(TRACE_DEBUG, "from cache " << path);
+        adbfsStats.add(ATTR_HITS);
+    }
+    if (!entry.haveStat) {
+        // return empty structure - file exists, but no info available
+        stbuf->st_mode = S_IFREG;
+        return 0;
+    }
+    if (entry.st.st_mode == 0) return -ENOENT;
+    memcpy(stbuf, &entry.st, sizeof(struct stat));
+    return 0;
 }
 
 
@@ -571,6 +1603,97 @@ size_t find_nth(int n, const string& substr, const string& corpus) {
 }
 
 
+/**
+   Directory whose subtree is listed in one go (-o prefetch), without
+   a trailing slash; empty if none.
+ */
+static string prefetchRoot;
+
+/** Format of the lines prefetch_tree asks stat for. */
+#define PREFETCH_STAT_FORMAT "%f %h %u %g %s %X %Y %Z %n"
+
+static bool in_prefetch_root(const string& dir)
+{
+    if (prefetchRoot.empty()) return false;
+    if (prefetchRoot == "/" || dir == prefetchRoot) return true;
+    return dir.compare(0, prefetchRoot.size() + 1, prefetchRoot + "/") == 0;
+}
+
+/**
+   Parse a line of PREFETCH_STAT_FORMAT output.
+
+   @param line the line, e.g. "81a4 1 1023 1023 5905 1335 1335 1335 /a/b".
+   @param st receives what the line says about the file.
+   @param path receives the file's path.
+   @return false if the line is not in that format.
+ */
+static bool parse_stat_line(const string& line, sync_stat& st, string& path)
+{
+    unsigned mode, nlink, uid, gid;
+    unsigned long long size;
+    long long atime, mtime, ctime;
+    int name = 0;
+    if (sscanf(line.c_str(), "%x %u %u %u %llu %lld %lld %lld %n", &mode, &nlink,
+               &uid, &gid, &size, &atime, &mtime, &ctime, &name) < 8
+        || name == 0 || line[name] != '/')
+        return false;
+    st = sync_stat();
+    st.mode = mode;
+    st.nlink = nlink;
+    st.uid = uid;
+    st.gid = gid;
+    st.size = size;
+    st.atime = atime;
+    st.mtime = mtime;
+    st.ctime = ctime;
+    path = line.substr(name);
+    return true;
+}
+
+/**
+   Fill fileData and dirListings for a whole subtree from a single
+   find on the device, instead of one listing per directory and one
+   stat per file that fileData has forgotten.  The output is parsed as
+   it arrives.
+
+   @param dir unescaped device path of the top directory.
+   @return false if nothing could be listed.
+ */
+static bool prefetch_tree(const string& dir)
+{
+    if (adbfs_conf.adbcli) return false;
+    unsigned long listing = device().dirListings.begin();
+    map<string, vector<string> > listings;
+    size_t files = 0;
+    string command = "find " + shell_single_quote(dir)
+        + " -exec stat -c '" PREFETCH_STAT_FORMAT "' {} + 2>/dev/null";
+    TRACE(TRACE_INFO, "prefetch: " << command);
+    stats_timer timer(adbfsStats.commands[CMD_FIND]);
+    bool ok = adb_exec_lines(command, [&](const string& line) {
+        sync_stat sst;
+        string path;
+        if (!parse_stat_line(line, sst, path)) return;
+        fileCache entry = fileCache();
+        cache_sync_stat(entry, sst);
+        entry.st.st_uid = sst.uid;
+        entry.st.st_gid = sst.gid;
+        string path_string(path);
+        shell_escape_path(path_string);
+        device().fileData.set(path_string, entry);
+        device().missingPaths.forget(path);
+        if (S_ISDIR(sst.mode)) listings[path];
+        if (path != dir)
+            listings[dir_cache::parent(path)].push_back(path.substr(path.rfind('/') + 1));
+        ++files;
+    });
+    if (!ok || files == 0) return false;
+    for (map<string, vector<string> >::iterator it = listings.begin(); it != listings.end(); ++it)
+        device().dirListings.store(it->first, it->second, listing);
+    TRACE(TRACE_INFO, "prefetch: " << dir << ": " << files << " entries in "
+          << listings.size() << " directories");
+    return true;
+}
+
 /**
    adbFS implementation of FUSE interface function fuse_operations.readdir.
    @todo check shell escaping.
@@ -580,16 +1703,66 @@ static int adb_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 {
     (void) offset;
     (void) fi;
+    stats_timer timer(adbfsStats.ops[OP_READDIR]);
+    if (!strcmp(path, CONTROL_DIR)) {
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        filler(buf, STATS_FILE + sizeof(CONTROL_DIR), NULL, 0);
+        return 0;
+    }
+    if (is_control_path(path)) return -ENOTDIR;
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    local_path_string = tempDirPath;
+    local_path_string = device().tempDir;
     string_replacer(path_string,"/","-");
     local_path_string.append(path_string);
     path_string.assign(path);
 
     shell_escape_path(path_string);
 
+    vector<string> names;
+    bool cached = device().dirListings.get(path, names);
+    if (!cached && in_prefetch_root(path)) {
+        lock_guard<mutex> guard(device().prefetchLock);
+        cached = device().dirListings.get(path, names)
+            || (prefetch_tree(path) && device().dirListings.get(path, names));
+    }
+    adbfsStats.add(cached ? LISTING_HITS : LISTING_MISSES);
+    if (cached) {
+        TRACE(TRACE_DEBUG, "listing from cache " << path);
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        for (size_t i = 0; i < names.size(); ++i)
+            filler(buf, names[i].c_str(), NULL, 0);
+        return 0;
+    }
+    unsigned long listing = device().dirListings.begin();
+
+    // One LIST request returns binary records for the whole directory.
+    // An empty reply (not even ".") means we could not read it that
+    // way, so let ls have a go and report what it can.
+    vector<sync_dirent> entries;
+    if (sync_list(path, entries) && !entries.empty()) {
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const string& fname = entries[i].name;
+            filler(buf, fname.c_str(), NULL, 0);
+            names.push_back(fname);
+            if (fname == "." || fname == "..") continue;
+            string path_string_c(path);
+            if (path_string_c != "/") path_string_c.append("/");
+            path_string_c.append(fname);
+            device().missingPaths.forget(path_string_c);
+            shell_escape_path(path_string_c);
+            fileCache entry = fileCache();
+            cache_sync_stat(entry, entries[i].st);
+            device().fileData.set(path_string_c, entry);
+        }
+        TRACE(TRACE_DEBUG, "found files: " << entries.size());
+        device().dirListings.store(path, names, listing);
+        return 0;
+    }
+
     queue<string> output;
     string command = "ls -l -a '";
     command.append(path_string);
@@ -597,7 +1770,7 @@ static int adb_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     output = adb_shell(command);
 
     /* cannot tell between "no phone" and "empty directory" */
-    cout << "found files: " << output.size() << endl;
+    TRACE(TRACE_DEBUG, "found files: " << output.size());
     while (output.size() > 0) {
         // skip lines too short to process (should not happen)
         if (output.front().length() >= 3) {
@@ -610,47 +1783,177 @@ static int adb_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                                             sizeof(PERMISSION_ERR_MSG) - 1, PERMISSION_ERR_MSG))) {
                     size_t nameStart = output.front().rfind("/") + 1;
                     const string& fname_l = output.front().substr(nameStart, output.front().find("' ") - nameStart);
-                    cout << "Adding file:" << fname_l << ":" << endl;
                     filler(buf, fname_l.c_str(), NULL, 0);
+                    names.push_back(fname_l);
+                    device().missingPaths.forget(string(path) + (strcmp(path, "/") ? "/" : "") + fname_l);
                     const string& path_string_c = path_string
                         + (path_string == "/" ? "" : "/") + fname_l;
 
-                    cout << "caching " << path_string_c << " = " << output.front() <<  endl;
-                    fileData[path_string_c].statOutput.erase();
-                    fileData[path_string_c].timestamp = time(NULL);
-                    cout << "cached " << endl;
+                    TRACE(TRACE_DEBUG, "caching " << path_string_c << " = " << output.front());
+                    fileCache entry = fileCache();
+                    entry.haveStat = false;
+                    entry.timestamp = time(NULL);
+                    device().fileData.set(path_string_c, entry);
                 }
             } else {
                 // Start of filename = `ls -la` time separator + 4
                 size_t nameStart = output.front().find_first_of(":") + 4;
                 const string& fname_l = output.front().substr(nameStart);
                 const string fname_n = fname_l.substr(0, fname_l.find(" -> "));
-                cout << "Adding file:" << fname_n <<":" << endl;
                 filler(buf, fname_n.c_str(), NULL, 0);
+                names.push_back(fname_n);
+                device().missingPaths.forget(string(path) + (strcmp(path, "/") ? "/" : "") + fname_n);
                 const string path_string_c = path_string
                     + (path_string == "/" ? "" : "/") + fname_n;
 
-                cout << "caching " << path_string_c << " = " << output.front() <<  endl;
-                fileData[path_string_c].statOutput = output.front();
-                fileData[path_string_c].timestamp = time(NULL);
-                cout << "cached " << endl;
+                TRACE(TRACE_DEBUG, "caching " << path_string_c << " = " << output.front());
+                fileCache entry = fileCache();
+                cache_ls_line(entry, output.front());
+                device().fileData.set(path_string_c, entry);
             }
         }
         output.pop();
     }
-    cout << "done with found files" << endl;
+    if (!names.empty()) device().dirListings.store(path, names, listing);
 
 
     return 0;
 }
 
 
+/**
+   Key of the background fetch of a device file in transferPool.
+ */
+static string sibling_key(const string& path)
+{
+    return "fetch " + path;
+}
+
+/**
+   A reader going through a directory, as a copy of a camera folder
+   does, opens its files one after another.  Queue background fetches
+   of the next few small files after path into contentCache, so that
+   several are on their way at once instead of one per open.
+
+   @param path unescaped device path that was just opened.
+ */
+static void prefetch_siblings(const string& path)
+{
+    unsigned ahead = device().transferPool->size();
+    if (ahead == 0) return;
+    string dir = dir_cache::parent(path);
+    string name = path.substr(path.rfind('/') + 1);
+    vector<string> names;
+    if (!device().dirListings.get(dir, names)) return;
+    sort(names.begin(), names.end());
+    vector<string>::iterator it = upper_bound(names.begin(), names.end(), name);
+    // files larger than this would crowd the cache, and go fast anyway
+    int64_t limit = ((int64_t)adbfs_conf.cachesize << 20) / 16;
+    for (; it != names.end() && ahead > 0; ++it) {
+        string sibling = dir + (dir == "/" ? "" : "/") + *it;
+        string escaped = sibling;
+        shell_escape_path(escaped);
+        fileCache entry = fileCache();
+        if (!device().fileData.get(escaped, entry) || !entry.haveStat) continue;
+        if (!S_ISREG(entry.st.st_mode) || entry.st.st_size == 0
+            || entry.st.st_size > limit) continue;
+        --ahead;
+        adb_device* dev = &device();
+        dev->transferPool->submit(sibling_key(sibling), TRANSFER_BACKGROUND, [dev, sibling] {
+            device_scope scope(dev);
+            // the listing may be old; take the size and time the open will see
+            sync_stat sst;
+            if (!sync_lstat(sibling, sst) || sst.error != 0 || !S_ISREG(sst.mode)) return;
+            shared_ptr<remote_file> file =
+                device().contentCache->open(sibling, sst.size, sst.mtime, device().tempDir);
+            if (!file) return;
+            TRACE(TRACE_DEBUG, "prefetch sibling " << sibling);
+            atomic<unsigned> generation(0);
+            if (file->prefetch(0, file->blocks(), &generation, 0))
+                adbfsStats.add(FILES_FETCHED_AHEAD);
+        });
+    }
+}
+
+/**
+   The size and mtime of a file that is being opened: from the
+   attribute cache while it is fresh, which it usually is because the
+   kernel looked the file up just before, else with one STAT.  Only
+   entries of the sync service are trusted, as ls rounds mtimes;
+   haveLink marks those that came from ls.
+
+   @return false if the sync service is unavailable.
+ */
+static bool open_lstat(const char* path, sync_stat& sst)
+{
+    call_once(device().syncMetadataProbe, probe_sync_metadata);
+    if (!device().syncMetadata.available) return false;
+    string path_string = path;
+    shell_escape_path(path_string);
+    fileCache entry;
+    if (device().fileData.get(path_string, entry) && entry.haveStat && !entry.haveLink
+        && entry.st.st_mode != 0 && entry.timestamp + ATTR_CACHE_TTL >= time(NULL)) {
+        sst = sync_stat();
+        sst.mode = entry.st.st_mode;
+        sst.size = entry.st.st_size;
+        sst.mtime = entry.st.st_mtime;
+        return true;
+    }
+    return sync_lstat(path, sst);
+}
+
+/** The local copy of path no longer holds what the device has. */
+static void forget_local_copy(const char* path)
+{
+    string path_string = path;
+    shell_escape_path(path_string);
+    device().localCopies.forget(path_string);
+}
+
+/** Delete the kept local copies that are over the budget. */
+static void trim_local_copies()
+{
+    vector<pair<string, string> > victims = device().localCopies.over_budget();
+    for (size_t i = 0; i < victims.size(); ++i) {
+        lock_guard<mutex> guard(device().localCopyLocks[victims[i].first]);
+        if (device().localCopies.unused(victims[i].first)) {
+            unlink(victims[i].second.c_str());
+            device().copyDigests.erase(victims[i].first);
+        }
+    }
+}
+
+/**
+   Take the digest of a local copy that was just pulled.
+
+   @param path_string escaped device path.
+   @param local unescaped local copy.
+   @param expected size of the device file, or -1 if not known, in
+   which case the copy may not be what the device has and no digest is
+   kept.
+ */
+static void digest_pulled_copy(const string& path_string, const string& local, off_t expected)
+{
+    file_digest digest;
+    int fd = expected < 0 ? -1 : open(local.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        digest.refresh(fd);
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size != expected) digest.clear();
+        close(fd);
+    }
+    if (digest.known()) device().copyDigests.set(path_string, digest);
+    else device().copyDigests.erase(path_string);
+}
+
 static int adb_open(const char *path, struct fuse_file_info *fi)
 {
+    stats_timer timer(adbfsStats.ops[OP_OPEN]);
+    if (is_control_path(path)) return control_open(path, fi);
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    local_path_string = tempDirPath;
+    local_path_string = device().tempDir;
     string_replacer(path_string,"/","-");
     local_path_string.append(path_string);
 
@@ -660,43 +1963,220 @@ static int adb_open(const char *path, struct fuse_file_info *fi)
     shell_escape_path(path_string);
     shell_escape_path(local_path_string);
 
-    cout << "-- adb_open --" << path_string << " " << local_path_string << "\n";
-    if (!fileTruncated[path_string]){
-        queue<string> output;
-        string command = "ls -l -a -d '";
-        command.append(path_string);
-        command.append("'");
-        cout << command<<"\n";
-        output = adb_shell(command);
-        vector<string> output_chunk = make_array(output.front());
-        if (!is_valid_ls_output(output_chunk[0])) {
-          return -ENOENT;
+    TRACE(TRACE_DEBUG, "adb_open " << path_string << " " << local_path_string);
+    if (adbfs_conf.writeback) {
+        int res = device().writebackQueue->wait(path);
+        if (res < 0) return res;
+    }
+    if (!device().fileTruncated.get(path_string)){
+        // Read-only opens of regular files are served on demand from
+        // contentCache, reusing whatever blocks are left from earlier
+        // opens if the file has not changed on the device.
+        sync_stat sst;
+        bool statted = open_lstat(path, sst);
+        if (statted && (sst.error == ENOENT || sst.error == ENOTDIR
+                        || (sst.error == 0 && sst.mode == 0)))
+            return -ENOENT;
+        // e.g. EACCES: getattr reports the file, so do not deny it exists
+        if (statted && sst.error != 0) return -sst.error;
+        if ((fi->flags & O_ACCMODE) == O_RDONLY && statted) {
+            if (S_ISREG(sst.mode)) {
+                // a fetch queued for it by an earlier open goes first
+                device().transferPool->promote(sibling_key(path));
+                bool reused = false;
+                shared_ptr<remote_file> file =
+                    device().contentCache->open(path, sst.size, sst.mtime, device().tempDir,
+                                                &reused);
+                int fd = file ? file->dup_fd() : -1;
+                if (fd < 0) return -errno;
+                // unchanged on the device, so what the kernel has is too
+                fi->keep_cache = reused;
+                lazy_handle handle;
+                handle.file = file;
+                handle.ra.reset(new readahead_state);
+                lazyFiles.set(fd, handle);
+                fi->fh = fd;
+                prefetch_siblings(path);
+                return 0;
+            }
+        }
+
+        if (!statted) {
+            queue<string> output;
+            string command = "ls -l -a -d '";
+            command.append(path_string);
+            command.append("'");
+            output = adb_shell(command);
+            vector<string> output_chunk = make_array(output.front());
+            if (!is_valid_ls_output(output_chunk[0])) {
+              return -ENOENT;
+            }
         }
         path_string.assign(path);
-        local_path_string = tempDirPath;
+        local_path_string = device().tempDir;
         string_replacer(path_string,"/","-");
         local_path_string.append(path_string);
         path_string.assign(path);
         shell_escape_path(path_string);
         shell_escape_path(local_path_string);
-        adb_pull(path_string,local_path_string);
+        lock_guard<mutex> guard(device().localCopyLocks[path_string]);
+        device().localCopies.acquire(path_string, filehandle_path);
+        if (statted && device().localCopies.matches(path_string, sst.size, sst.mtime)
+            && access(filehandle_path.c_str(), F_OK) == 0) {
+            TRACE(TRACE_DEBUG, "local copy of " << path << " is current");
+            adbfsStats.add(PULLS_SKIPPED);
+            fi->keep_cache = 1;
+        } else {
+            device().localCopies.forget(path_string);
+            adb_pull(path_string,local_path_string);
+            struct stat st;
+            if (statted && stat(filehandle_path.c_str(), &st) == 0
+                && st.st_size == (off_t)sst.size)
+                device().localCopies.pulled(path_string, sst.size, sst.mtime);
+            else
+                statted = false;
+            digest_pulled_copy(path_string, filehandle_path, statted ? sst.size : -1);
+        }
+        int fd = open(filehandle_path.c_str(), fi->flags);
+        if (fd < 0) {
+            int res = -errno;
+            // no release will come for this handle
+            if (!device().localCopies.release(path_string)) {
+                unlink(filehandle_path.c_str());
+                device().copyDigests.erase(path_string);
+            }
+            return res;
+        }
+        fi->fh = fd;
+        // what the handle writes can be sent alone if we know the
+        // device has the rest
+        fileDirty.set(fd, dirty_extents(statted ? sst.size : -1));
     } else {
-        fileTruncated[path_string] = false;
+        lock_guard<mutex> guard(device().localCopyLocks[path_string]);
+        device().localCopies.acquire(path_string, filehandle_path);
+        int fd = open(filehandle_path.c_str(), fi->flags);
+        if (fd < 0) {
+            // the truncated copy waits for the next open
+            int res = -errno;
+            device().localCopies.release(path_string);
+            return res;
+        }
+        device().fileTruncated.set(path_string, false);
+        fi->fh = fd;
+        fileDirty.set(fd, dirty_extents());
     }
 
-    fi->fh = open(filehandle_path.c_str(), fi->flags);
+    trim_local_copies();
 
     return 0;
 }
 
+/**
+   Start streaming a write handle to the device.  Only done when the
+   local copy is empty and untouched, so that what gets written is the
+   whole file.
+
+   @return the new stream, or an empty pointer if the handle should be
+   written to the local copy instead.
+ */
+static shared_ptr<upload_stream> upload_stream_start(const char *path, int fd)
+{
+    struct stat st;
+    if (adbfs_conf.adbcli || filePendingWrite.get(fd) || fstat(fd, &st) < 0
+        || st.st_size != 0)
+        return shared_ptr<upload_stream>();
+    // a file that will be pushed gzipped has to be complete first
+    if (transferCompression.worth_it(path, -1)) return shared_ptr<upload_stream>();
+    // an existing file being rewritten goes to the local copy, so that
+    // the flush can tell whether it changed at all
+    string path_string = path;
+    shell_escape_path(path_string);
+    if (device().copyDigests.contains(path_string)) return shared_ptr<upload_stream>();
+    // a fresh connection: an idle one may have been dropped by the
+    // server, and data sent into a dead stream cannot be recovered
+    adb_sync* sync = new adb_sync;
+    if (!sync->connect() || !sync->send_begin(path, S_IFREG | (st.st_mode & 0777))) {
+        delete sync;
+        return shared_ptr<upload_stream>();
+    }
+    TRACE(TRACE_INFO, "streaming upload: " << path);
+    shared_ptr<upload_stream> stream(new upload_stream);
+    stream->sync = sync;
+    stream->offset = 0;
+    fileStreams.set(fd, stream);
+    return stream;
+}
+
+/**
+   Finish the SEND of a streamed handle, if it is still running.
+
+   @param spill if true, also pull the device file back into the local
+   copy and drop the stream, so that the handle can be read or written
+   out of order from now on.
+   @return 0, or -EIO if the device did not get the file.
+ */
+static int upload_stream_finish(const char *path, int fd, bool spill)
+{
+    shared_ptr<upload_stream> stream;
+    if (!fileStreams.get(fd, stream)) return 0;
+    lock_guard<mutex> guard(stream->lock);
+    string path_string = path;
+    shell_escape_path(path_string);
+    int res = 0;
+    if (stream->sync) {
+        adb_sync* sync = stream->sync;
+        stream->sync = NULL;
+        string error;
+        if (sync->send_end(time(NULL), &error)) {
+            device().syncPool.release(sync);
+        } else {
+            TRACE(TRACE_ERROR, "streaming upload of " << path << " failed: " << error);
+            delete sync;
+            res = -EIO;
+        }
+        invalidateCache(path_string);
+        device().contentCache->invalidate(path);
+        device().copyDigests.erase(path_string);
+    }
+    if (spill && fileStreams.erase(fd) && res == 0) {
+        TRACE(TRACE_INFO, "streaming upload: spilling " << path);
+        string local_path_string = path;
+        string_replacer(local_path_string, "/", "-");
+        local_path_string.insert(0, device().tempDir);
+        shell_escape_path(local_path_string);
+        lock_guard<mutex> guard(device().localCopyLocks[path_string]);
+        adb_pull(path_string, local_path_string);
+        shell_unescape_path(local_path_string);
+        digest_pulled_copy(path_string, local_path_string, stream->offset);
+    }
+    return res;
+}
+
 static int adb_read(const char *path, char *buf, size_t size, off_t offset,
     struct fuse_file_info *fi)
 {
+    stats_timer timer(adbfsStats.ops[OP_READ]);
     int fd;
     int res;
     fd = fi->fh; //open(local_path_string.c_str(), O_RDWR);
     if(fd == -1)
         return -errno;
+    shared_ptr<string> snapshot;
+    if (statsFiles.get(fd, snapshot)) {
+        if (offset >= (off_t)snapshot->size()) return 0;
+        size = min(size, snapshot->size() - offset);
+        memcpy(buf, snapshot->data() + offset, size);
+        return size;
+    }
+    lazy_handle handle;
+    if (lazyFiles.get(fd, handle)) {
+        device().readaheadEngine->on_read(handle.file, handle.ra, offset, size);
+        return handle.file->read(buf, size, offset);
+    }
+    if (fileStreams.contains(fd)) {
+        res = upload_stream_finish(path, fd, true);
+        if (res < 0) return res;
+    }
     res = pread(fd, buf, size, offset);
     //close(fd);
     if(res == -1)
@@ -711,11 +2191,35 @@ static int adb_write(const char *path, const char *buf, size_t size, off_t offse
     //path_string.assign(path);
     //shell_escape_path(path_string);
 
+    stats_timer timer(adbfsStats.ops[OP_WRITE]);
     int fd = fi->fh; //open(local_path_string.c_str(), O_CREAT|O_RDWR|O_TRUNC);
 
-    filePendingWrite[fd] = true;
+    if (!filePendingWrite.get(fd)) forget_local_copy(path);
+    shared_ptr<upload_stream> stream;
+    if (!fileStreams.get(fd, stream) && offset == 0)
+        stream = upload_stream_start(path, fd);
+    if (stream) {
+        unique_lock<mutex> guard(stream->lock);
+        if (stream->sync && offset == stream->offset) {
+            if (!stream->sync->send_data(buf, size)) {
+                guard.unlock();
+                upload_stream_finish(path, fd, false);
+                return -EIO;
+            }
+            stream->offset += size;
+            adbfsStats.add(BYTES_PUSHED, size);
+            return size;
+        }
+        guard.unlock();
+        // the writer went back: continue on a local copy
+        int res = upload_stream_finish(path, fd, true);
+        if (res < 0) return res;
+    }
+
+    filePendingWrite.set(fd, true);
 
     int res = pwrite(fd, buf, size, offset);
+    if (res > 0) fileDirty.update(fd, [&](dirty_extents& dirty) { dirty.add(offset, res); });
     //close(fd);
     //adb_push(local_path_string,path_string);
     //adb_shell("sync");
@@ -725,11 +2229,61 @@ static int adb_write(const char *path, const char *buf, size_t size, off_t offse
 }
 
 
+/** With -o devicehash, files this large are compared with md5sum on the device. */
+static const off_t DEVICE_HASH_MIN_SIZE = 1 << 20;
+
+/**
+   Tell whether flushing a write handle would push what the device has
+   already: compare the blocks it wrote, or all of them if the rest may
+   differ too, with the digest of the device's copy.  Without a digest
+   the whole file can be compared with the device's md5sum instead.
+
+   @param local unescaped local copy; it is read through a descriptor
+   of its own, as the handle may be write only.
+   @param digest set to the digest of the local copy as it is now, if
+   there was one to bring up to date.
+   @return true if the local copy holds what the device has.
+ */
+static bool copy_unchanged(const char* path, const string& local, const dirty_extents& dirty,
+                           file_digest& digest)
+{
+    string path_string = path;
+    shell_escape_path(path_string);
+    int fd = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    bool same = false;
+    if (fstat(fd, &st) < 0) {
+        same = false;
+    } else if (!device().copyDigests.get(path_string, digest)) {
+        if (adbfs_conf.devicehash && st.st_size >= DEVICE_HASH_MIN_SIZE) {
+            string local_sum = md5_hex(fd), output;
+            same = !local_sum.empty()
+                && adb_exec("md5sum " + shell_single_quote(path) + " 2>/dev/null", output)
+                && output.compare(0, local_sum.size(), local_sum) == 0;
+            TRACE(TRACE_INFO, "md5sum of " << path << (same ? " matches" : " differs"));
+            if (same) digest.refresh(fd);
+        }
+    } else if (dirty.empty() || dirty.was_truncated() || st.st_size != dirty.base_size()) {
+        same = !digest.refresh(fd);
+    } else {
+        bool changed = false;
+        vector<pair<off_t, off_t> > blocks = dirty.aligned(DIGEST_BLOCK_SIZE, st.st_size);
+        for (size_t i = 0; i < blocks.size(); ++i)
+            changed = digest.refresh(fd, blocks[i].first, blocks[i].second) || changed;
+        same = !changed;
+    }
+    close(fd);
+    return same;
+}
+
 static int adb_flush(const char *path, struct fuse_file_info *fi) {
+    stats_timer timer(adbfsStats.ops[OP_FLUSH]);
+    if (statsFiles.contains(fi->fh)) return 0;
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    local_path_string = tempDirPath;
+    local_path_string = device().tempDir;
     string_replacer(path_string,"/","-");
     local_path_string.append(path_string);
     path_string.assign(path);
@@ -739,34 +2293,177 @@ static int adb_flush(const char *path, struct fuse_file_info *fi) {
 
     int flags = fi->flags;
     int fd = fi->fh;
-    cout << "flag is: "<< flags <<"\n";
+    TRACE(TRACE_DEBUG, "adb_flush " << path << " flags " << flags);
     invalidateCache(path_string);
-    if (filePendingWrite[fd]) {
-        filePendingWrite[fd] = false;
-        adb_push(local_path_string, path_string);
+    shared_ptr<upload_stream> stream;
+    if (fileStreams.get(fd, stream) && stream->sync) {
+        // everything written so far is on the device already
+        int res = upload_stream_finish(path, fd, false);
+        if (res < 0) return res;
+        device().dirListings.add(path);
+        if (!adbfs_conf.writeback) adb_shell("sync");
+        if (adbfs_conf.rescan) adb_rescan_file(path_string);
+        return 0;
+    }
+    bool pending = false;
+    if (filePendingWrite.take(fd, pending) && pending) {
+        lock_guard<mutex> guard(device().localCopyLocks[path_string]);
+        dirty_extents dirty;
+        fileDirty.take(fd, dirty);
+        file_digest digest;
+        struct stat st;
+        string local = local_path_string;
+        shell_unescape_path(local);
+        if (copy_unchanged(path, local, dirty, digest)) {
+            TRACE(TRACE_INFO, "flush: " << path << " is unchanged, not pushed");
+            adbfsStats.add(PUSHES_ELIDED);
+            device().copyDigests.set(path_string, digest);
+            // as good as pulled again, so it can be kept after release
+            device().localCopies.restore(path_string);
+            fileDirty.set(fd, dirty_extents(fstat(fd, &st) == 0 ? st.st_size : -1));
+            return adbfs_conf.writeback ? device().writebackQueue->failed(path) : 0;
+        }
+        // until a push succeeds, the device may have either version
+        device().copyDigests.erase(path_string);
+        if (adbfs_conf.writeback) {
+            shell_unescape_path(local_path_string);
+            int res = device().writebackQueue->enqueue(local_path_string, path, device().tempDir);
+            int failed = device().writebackQueue->failed(path);
+            // getattr reports the queued copy until it is pushed
+            if (res == 0) device().dirListings.add(path);
+            return res < 0 ? res : failed;
+        }
+        bool pushed = adb_push_ranges(local, path, dirty);
+        if (!pushed) adb_push(local_path_string, path_string, &pushed);
+        if (pushed) device().dirListings.add(path);
+        else device().dirListings.invalidate(dir_cache::parent(path));
+        // the device has the local copy now; later writes start from it
+        if (pushed && digest.known()) device().copyDigests.set(path_string, digest);
+        fileDirty.set(fd, dirty_extents(pushed && fstat(fd, &st) == 0 ? st.st_size : -1));
         adb_shell("sync");
         if (adbfs_conf.rescan) adb_rescan_file(path_string);
+    } else if (adbfs_conf.writeback) {
+        return device().writebackQueue->failed(path);
     }
     return 0;
 }
 
+/**
+   List prefetchRoot of a device in the background, if -o prefetch is
+   given.
+ */
+static void start_prefetch(adb_device* dev)
+{
+    if (prefetchRoot.empty()) return;
+    thread([dev] {
+        device_scope scope(dev);
+        lock_guard<mutex> guard(dev->prefetchLock);
+        prefetch_tree(prefetchRoot);
+    }).detach();
+}
+
+/**
+   adbFS implementation of FUSE interface function fuse_operations.init.
+   Starts listing the -o prefetch subtree, or with -o devices tracking
+   the attached devices, now that fuse_main has forked.
+ */
+static void* adb_init(struct fuse_conn_info *conn) {
+    if (!adbfs_conf.devices) start_prefetch(defaultDevice);
+    else deviceTracker.list();  // start tracking, and set up the devices
+    return NULL;
+}
+
+/**
+   adbFS implementation of FUSE interface function fuse_operations.fsync.
+   In write-back mode this is where the data is made durable: wait for
+   the path's push and sync the device.  A streamed upload has to be
+   finished to be durable, so later writes will go to a local copy.
+ */
+static int adb_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    stats_timer timer(adbfsStats.ops[OP_FSYNC]);
+    if (statsFiles.contains(fi->fh)) return 0;
+    int res = 0;
+    shared_ptr<upload_stream> stream;
+    if (fileStreams.get(fi->fh, stream) && stream->sync) {
+        res = adb_flush(path, fi);
+        if (res < 0 || !adbfs_conf.writeback) return res;
+    }
+    if (adbfs_conf.writeback) {
+        if (filePendingWrite.get(fi->fh)) {
+            int flushed = adb_flush(path, fi);
+            if (flushed < 0) return flushed;
+        }
+        res = device().writebackQueue->wait(path);
+        adb_shell("sync");
+    }
+    return res;
+}
+
+/**
+   adbFS implementation of FUSE interface function fuse_operations.destroy,
+   called at unmount: stop tracking devices, whose contexts would be
+   freed under it at exit, and push everything still queued.
+ */
+static void adb_destroy(void *private_data) {
+    deviceTracker.stop();
+    if (adbfs_conf.writeback) {
+        vector<adb_device*> devices = known_devices();
+        for (size_t i = 0; i < devices.size(); ++i) {
+            device_scope scope(devices[i]);
+            device().writebackQueue->drain();
+            adb_shell("sync");
+        }
+    }
+    traceLog.flush();
+}
+
 static int adb_release(const char *path, struct fuse_file_info *fi) {
+    stats_timer timer(adbfsStats.ops[OP_RELEASE]);
+    shared_ptr<string> snapshot;
+    if (statsFiles.take(fi->fh, snapshot)) {
+        close(fi->fh);
+        return 0;
+    }
     // just like in the other functions
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    local_path_string = tempDirPath;
+    local_path_string = device().tempDir;
     string_replacer(path_string,"/","-");
     local_path_string.append(path_string);
     path_string.assign(path);
 
     // untouched
     int fd = fi->fh;
-    filePendingWrite.erase(filePendingWrite.find(fd));
+    filePendingWrite.erase(fd);
+    fileDirty.erase(fd);
+    upload_stream_finish(path, fd, false);
+    fileStreams.erase(fd);
+
+    lazy_handle handle;
+    if (lazyFiles.take(fd, handle)) {
+        // the blocks stay in contentCache for the next open
+        device().readaheadEngine->cancel(handle.ra);
+        close(fd);
+        content_cache_stats stats = device().contentCache->stats();
+        TRACE(TRACE_DEBUG, "content cache: hits=" << stats.hits << " misses=" << stats.misses
+              << " evictions=" << stats.evictions << " bytes=" << stats.bytes);
+        return 0;
+    }
     close(fd);
     
-    // remove local copy
-    unlink(local_path_string.c_str());    
+    // remove the local copy, unless it is worth keeping for the next open
+    shell_escape_path(path_string);
+    {
+        lock_guard<mutex> guard(device().localCopyLocks[path_string]);
+        if (!device().localCopies.release(path_string)) {
+            unlink(local_path_string.c_str());
+            device().copyDigests.erase(path_string);
+            // a truncate made while it was open went out with its flush
+            device().fileTruncated.erase(path_string);
+        }
+    }
+    trim_local_copies();
     return 0;
 }
 
@@ -776,9 +2473,12 @@ static int adb_access(const char *path, int mask) {
 }
 
 static int adb_utimens(const char *path, const struct timespec ts[2]) {
+    stats_timer timer(adbfsStats.ops[OP_UTIMENS]);
+    if (is_control_path(path)) return -EROFS;
     string path_string;
+    if (adbfs_conf.writeback) device().writebackQueue->wait(path);
     path_string.assign(path);
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
+    device().fileData.update(path_string, [](fileCache& entry) { entry.timestamp += 50; });
 
     shell_escape_path(path_string);
 
@@ -786,7 +2486,6 @@ static int adb_utimens(const char *path, const struct timespec ts[2]) {
     string command = "touch '";
     command.append(path_string);
     command.append("'");
-    cout << command<<"\n";
     adb_shell(command);
 
     // If we forgot to mount -o rescan then we can remount and touch to trigger the scan.
@@ -795,12 +2494,35 @@ static int adb_utimens(const char *path, const struct timespec ts[2]) {
     return 0;
 }
 
+/**
+   A local copy was truncated to size.  Handles open on it (an
+   ftruncate, or a truncate of the path while they are open) now hold
+   something other than the device between the old size and size, so
+   those bytes are written as far as their flush is concerned.
+
+   @param copy the local copy as it was before.
+ */
+static void truncated_under_handles(const struct stat& copy, off_t size)
+{
+    off_t from = min(copy.st_size, size), to = max(copy.st_size, size);
+    fileDirty.update_all([&](int fd, dirty_extents& dirty) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_dev != copy.st_dev || st.st_ino != copy.st_ino) return;
+        dirty.add(from, to - from);
+        dirty.truncated();
+        filePendingWrite.set(fd, true);
+    });
+}
+
 static int adb_truncate(const char *path, off_t size) {
+    stats_timer timer(adbfsStats.ops[OP_TRUNCATE]);
+    if (is_control_path(path)) return -EROFS;
     string path_string;
     string local_path_string;
+    if (adbfs_conf.writeback) device().writebackQueue->wait(path);
     path_string.assign(path);
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
-    local_path_string = tempDirPath;
+    device().fileData.update(path_string, [](fileCache& entry) { entry.timestamp += 50; });
+    local_path_string = device().tempDir;
     string_replacer(path_string,"/","-");
     local_path_string.append(path_string);
     path_string.assign(path);
@@ -809,43 +2531,79 @@ static int adb_truncate(const char *path, off_t size) {
 
 
     queue<string> output;
-    cout << "adb_truncate" << endl;
+    TRACE(TRACE_DEBUG, "adb_truncate " << path);
     string command = "ls -l -a -d '";
     command.append(path_string);
     command.append("'");
-    cout << command << "\n";
     output = adb_shell(command);
     vector<string> output_chunk = make_array(output.front());
-    if (output_chunk[0][0] == '/'){
+    lock_guard<mutex> guard(device().localCopyLocks[path_string]);
+    string local = local_path_string;
+    shell_unescape_path(local);
+    bool exists = is_valid_ls_output(output_chunk[0]);
+    // a copy open for writing, or left by an earlier truncate for the
+    // next open, may hold writes the device has not seen yet
+    bool in_place = device().localCopies.in_use(path_string)
+        || device().fileTruncated.get(path_string);
+    sync_stat sst;
+    bool statted = false;
+    if (!in_place && exists && size > 0) {
+        statted = sync_lstat(path, sst) && S_ISREG(sst.mode);
+        in_place = statted && device().localCopies.matches(path_string, sst.size, sst.mtime)
+            && access(local.c_str(), F_OK) == 0;
+    }
+    device().localCopies.forget(path_string);
+    if (exists && size > 0 && !in_place) {
         adb_pull(path_string,local_path_string);
+        // what the device keeps until the truncated copy is flushed
+        digest_pulled_copy(path_string, local, statted ? sst.size : -1);
+    } else if (!exists) {
+        device().copyDigests.erase(path_string);
     }
+    // truncating to 0 needs nothing from the device, whose digest still holds
 
-    fileTruncated[path_string] = true;
+    device().fileTruncated.set(path_string, true);
 
     invalidateCache(path_string);
 
-    cout << "truncate[path=" << local_path_string << "][size=" << size << "]" << endl;
+    TRACE(TRACE_DEBUG, "truncate[path=" << local_path_string << "][size=" << size << "]");
 
-    return truncate(local_path_string.c_str(),size);
+    int fd = open(local.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return -errno;
+    struct stat before;
+    int res = fstat(fd, &before) < 0 || ftruncate(fd, size) < 0 ? -errno : 0;
+    close(fd);
+    if (res == 0 && before.st_size != size) truncated_under_handles(before, size);
+    return res;
 }
 
 static int adb_mknod(const char *path, mode_t mode, dev_t rdev) {
+    stats_timer timer(adbfsStats.ops[OP_MKNOD]);
+    if (is_control_path(path)) return -EROFS;
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    local_path_string = tempDirPath;
+    local_path_string = device().tempDir;
     string_replacer(path_string,"/","-");
     local_path_string.append(path_string);
     path_string.assign(path);
 
-    cout << "mknod for " << local_path_string << "\n";
+    shell_escape_path(path_string);
+    lock_guard<mutex> guard(device().localCopyLocks[path_string]);
+    device().localCopies.discard(path_string);
+    device().copyDigests.erase(path_string);
+    device().missingPaths.forget(path);
+
+    TRACE(TRACE_DEBUG, "mknod for " << local_path_string);
     mknod(local_path_string.c_str(),mode, rdev);
 
-    shell_escape_path(path_string);
     shell_escape_path(local_path_string);
 
-    adb_push(local_path_string,path_string);
+    bool pushed = false;
+    adb_push(local_path_string, path_string, &pushed);
     adb_shell("sync");
+    if (pushed) device().dirListings.add(path);
+    else device().dirListings.invalidate(dir_cache::parent(path));
 
     invalidateCache(path_string);
 
@@ -853,11 +2611,13 @@ static int adb_mknod(const char *path, mode_t mode, dev_t rdev) {
 }
 
 static int adb_mkdir(const char *path, mode_t mode) {
+    stats_timer timer(adbfsStats.ops[OP_MKDIR]);
+    if (is_control_path(path)) return -EROFS;
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
-    local_path_string = tempDirPath;
+    device().fileData.update(path_string, [](fileCache& entry) { entry.timestamp += 50; });
+    local_path_string = device().tempDir;
     string_replacer(path_string,"/","-");
     local_path_string.append(path_string);
     path_string.assign(path);
@@ -868,13 +2628,18 @@ static int adb_mkdir(const char *path, mode_t mode) {
     command.assign("mkdir '");
     command.append(path_string);
     command.append("'");
-    adb_shell(command);
+    // mkdir says nothing unless it failed
+    if (adb_shell(command, true).empty()) device().dirListings.add(path);
+    else device().dirListings.invalidate(dir_cache::parent(path));
+    device().missingPaths.forget(path);
     invalidateCache(path_string);
     return 0;
 }
 
 static int adb_rename(const char *from, const char *to) {
-    string local_from_string,local_to_string = tempDirPath;
+    stats_timer timer(adbfsStats.ops[OP_RENAME]);
+    if (is_control_path(from) || is_control_path(to)) return -EROFS;
+    string local_from_string,local_to_string = device().tempDir;
 
     string from_string = string(from), to_string = string(to);
 
@@ -889,28 +2654,47 @@ static int adb_rename(const char *from, const char *to) {
     shell_escape_path(to_string);
 
 
+    if (adbfs_conf.writeback) {
+        device().writebackQueue->wait_tree(from);
+        device().writebackQueue->discard_tree(to);
+    }
+
     string command = "mv '";
     command.append(from_string);
     command.append("' '");
     command.append(to_string);
     command.append("'");
-    cout << "Renaming " << from << " to " << to <<"\n";
-    adb_shell(command);
+    TRACE(TRACE_DEBUG, "Renaming " << from << " to " << to);
+    if (adb_shell(command, true).empty()) {
+        device().dirListings.rename(from, to);
+    } else {
+        device().dirListings.invalidate(dir_cache::parent(from));
+        device().dirListings.invalidate(dir_cache::parent(to));
+    }
     if (adbfs_conf.rescan) {
         adb_rescan_file(from);
         adb_rescan_file(to);
     }
-    invalidateCache(string(from));
-    invalidateCache(string(to));
+    device().fileData.rename_tree(from_string, to_string);
+    invalidateCache(to_string);
+    device().missingPaths.forget_tree(to);
+    device().contentCache->invalidate(from);
+    device().contentCache->invalidate(to);
+    device().localCopies.discard(from_string);
+    device().localCopies.discard(to_string);
+    device().copyDigests.erase(from_string);
+    device().copyDigests.erase(to_string);
     return 0;
 }
 
 static int adb_rmdir(const char *path) {
+    stats_timer timer(adbfsStats.ops[OP_RMDIR]);
+    if (is_control_path(path)) return -EROFS;
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
-    local_path_string = tempDirPath;
+    device().fileData.update(path_string, [](fileCache& entry) { entry.timestamp += 50; });
+    local_path_string = device().tempDir;
     string_replacer(path_string,"/","-");
     local_path_string.append(path_string);
     path_string.assign(path);
@@ -922,20 +2706,23 @@ static int adb_rmdir(const char *path) {
     string command = "rmdir '";
     command.append(path_string);
     command.append("'");
-    adb_shell(command);
+    if (adb_shell(command, true).empty()) device().dirListings.remove(path);
+    else device().dirListings.invalidate(dir_cache::parent(path));
     if (adbfs_conf.rescan) adb_rescan_dir_removed(path_string);
-    invalidateCache(path_string);
+    device().fileData.erase_tree(path_string);
 
     //rmdir(local_path_string.c_str());
     return 0;
 }
 
 static int adb_unlink(const char *path) {
+    stats_timer timer(adbfsStats.ops[OP_UNLINK]);
+    if (is_control_path(path)) return -EROFS;
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
-    local_path_string = tempDirPath;
+    device().fileData.update(path_string, [](fileCache& entry) { entry.timestamp += 50; });
+    local_path_string = device().tempDir;
     string_replacer(path_string,"/","-");
     local_path_string.append(path_string);
     path_string.assign(path);
@@ -943,19 +2730,28 @@ static int adb_unlink(const char *path) {
     shell_escape_path(path_string);
     shell_escape_path(local_path_string);
 
+    if (adbfs_conf.writeback) device().writebackQueue->discard(path);
+
     string command = "rm '";
     command.append(path_string);
     command.append("'");
-    adb_shell(command);
+    if (adb_shell(command, true).empty()) device().dirListings.remove(path);
+    else device().dirListings.invalidate(dir_cache::parent(path));
     if (adbfs_conf.rescan) adb_rescan_file(path_string);
     invalidateCache(path_string);
+    device().contentCache->invalidate(path);
+    lock_guard<mutex> guard(device().localCopyLocks[path_string]);
+    device().localCopies.discard(path_string);
+    device().copyDigests.erase(path_string);
     unlink(local_path_string.c_str());
     return 0;
 }
 
 static int adb_readlink(const char *path, char *buf, size_t size)
 {
-    cout << "adb_readlink" << endl;
+    stats_timer timer(adbfsStats.ops[OP_READLINK]);
+    TRACE(TRACE_DEBUG, "adb_readlink " << path);
+    if (is_control_path(path)) return -EINVAL;
     string path_string(path);
     shell_escape_path(path_string);
 
@@ -968,41 +2764,35 @@ static int adb_readlink(const char *path, char *buf, size_t size)
             num_slashes++;
     if (num_slashes >= 1) num_slashes--;
 
-    if (fileData.find(path_string) ==  fileData.end()
-	|| fileData[path_string].timestamp + 30 < time(NULL)) {
+    // Entries filled in from the sync service carry no link target,
+    // so those need an ls as well.
+    fileCache entry = fileCache();
+    if (!device().fileData.get(path_string, entry)
+	|| entry.timestamp + ATTR_CACHE_TTL < time(NULL)
+	|| (entry.haveStat && !entry.haveLink)) {
         string command = "ls -l -a -d '";
         command.append(path_string);
         command.append("'");
         output = adb_shell(command);
         if (output.empty())
             return -EINVAL;
-        // error format: "/sbin/healthd: Permission denied"
-
-        if ((output.front().length() > sizeof(PERMISSION_ERR_MSG)) &&
-           (!output.front().compare(output.front().length() - sizeof(PERMISSION_ERR_MSG) + 1,
-                                    sizeof(PERMISSION_ERR_MSG) - 1, PERMISSION_ERR_MSG)))
-        {
-            fileData[path_string].statOutput.erase();
-        } else {
-            fileData[path_string].statOutput = output.front();
-        }
-        fileData[path_string].timestamp = time(NULL);
+        cache_ls_line(entry, output.front());
+        device().fileData.set(path_string, entry);
     } else{
-        cout << "from cache " << path << "\n";
+        TRACE(TRACE_DEBUG, "from cache " << path);
     }
-    string &res = fileData[path_string].statOutput;
-    if (res.empty()) {
+    if (!entry.haveStat) {
         // file exists, but no info available
         return -EINVAL;
     }
-    if (!is_valid_ls_output(res)) {
+    if (entry.st.st_mode == 0) {
       return -ENOENT;
     }
-    cout << "adb_readlink " << res << endl;
-    size_t pos = res.find(" -> ");
-    if(pos == string::npos)
+    const string &res = entry.link;
+    TRACE(TRACE_DEBUG, "adb_readlink " << res);
+    if (res.empty())
        return -EINVAL;
-    pos+=4;
+    size_t pos = 0;
     size_t my_size = res.size();
     buf[0] = 0;
     if (res[pos] == '/') {
@@ -1021,6 +2811,215 @@ static int adb_readlink(const char *path, char *buf, size_t size)
     return 0;
 }
 
+/**
+   Apply the options to a device's caches and queues.  The cache
+   budgets are shared out equally among the devices with state, which
+   includes those that were detached and may come back.
+ */
+static void configure_device(adb_device& dev, size_t devices)
+{
+    if (devices == 0) devices = 1;
+    dev.statBatcher.set_wait(adbfs_conf.batchwait);
+    dev.transferPool->set_workers(adbfs_conf.transfers);
+    dev.missingPaths.set_ttl(adbfs_conf.negcache);
+    dev.fileData.set_budget(((size_t)adbfs_conf.metacache << 20) / devices);
+    dev.contentCache->set_budget(((unsigned long long)adbfs_conf.cachesize << 20) / devices);
+    dev.localCopies.set_budget(((unsigned long long)adbfs_conf.cachesize << 20) / devices);
+    dev.readaheadEngine->set_max_window(((size_t)adbfs_conf.readahead << 10) / REMOTE_BLOCK_SIZE);
+    dev.writebackQueue->set_error_log(dev.tempDir + "writeback-errors");
+}
+
+/**
+   @return the device with serial, set up on first use.
+ */
+static adb_device* device_context(const string& serial)
+{
+    lock_guard<mutex> guard(deviceContextsLock);
+    adb_device*& dev = deviceContexts[serial];
+    if (!dev) {
+        dev = new adb_device(serial);
+        dev->tempDir = tempDirPath + serial + "/";
+        mkdir(dev->tempDir.c_str(), 0700);
+        // share the caches out again
+        for (map<string, adb_device*>::iterator it = deviceContexts.begin();
+             it != deviceContexts.end(); ++it)
+            configure_device(*it->second, deviceContexts.size());
+        start_prefetch(dev);
+        TRACE(TRACE_INFO, "devices: serving " << serial);
+    }
+    return dev;
+}
+
+/**
+   Set up newly attached devices.
+ */
+static void devices_changed(const vector<string>& serials)
+{
+    for (size_t i = 0; i < serials.size(); ++i) device_context(serials[i]);
+}
+
+/**
+   Split a path of a multi-device mount, "/<serial>/...", into the
+   serial and the path on the device ("/" for "/<serial>").
+ */
+static void split_device_path(const char* path, string& serial, string& rest)
+{
+    const char* name = path + 1;
+    const char* slash = strchr(name, '/');
+    serial.assign(name, slash ? slash - name : strlen(name));
+    rest.assign(slash ? slash : "/");
+}
+
+/**
+   Run an adb_* callback on the device a path of a multi-device mount
+   is on, with the path on that device.  Control files are not on any
+   device.
+
+   @param handle true for calls on an open file, which are served
+   even if its device went away meanwhile, so that it can be closed.
+ */
+template <class F> static int on_device(const char* path, bool handle, F call)
+{
+    if (is_control_path(path)) return call(path);
+    string serial, rest;
+    split_device_path(path, serial, rest);
+    if (serial.empty()) return -ENOENT;
+    if (!handle && !deviceTracker.attached(serial)) return -ENOENT;
+    device_scope scope(device_context(serial));
+    return call(rest.c_str());
+}
+
+/**
+   The callbacks of a multi-device mount, whose top directory holds
+   one directory per attached device.
+ */
+static int devices_getattr(const char* path, struct stat* stbuf)
+{
+    if (strcmp(path, "/"))
+        return on_device(path, false, [&](const char* p) { return adb_getattr(p, stbuf); });
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2;
+    stbuf->st_mtime = stbuf->st_atime = stbuf->st_ctime = time(NULL);
+    return 0;
+}
+
+static int devices_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
+                           off_t offset, struct fuse_file_info* fi)
+{
+    if (strcmp(path, "/"))
+        return on_device(path, false, [&](const char* p) {
+            return adb_readdir(p, buf, filler, offset, fi);
+        });
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    vector<string> serials = deviceTracker.list();
+    for (size_t i = 0; i < serials.size(); ++i) filler(buf, serials[i].c_str(), NULL, 0);
+    return 0;
+}
+
+static int devices_readlink(const char* path, char* buf, size_t size)
+{
+    return on_device(path, false, [&](const char* p) { return adb_readlink(p, buf, size); });
+}
+
+static int devices_access(const char* path, int mask)
+{
+    return on_device(path, false, [&](const char* p) { return adb_access(p, mask); });
+}
+
+static int devices_open(const char* path, struct fuse_file_info* fi)
+{
+    return on_device(path, false, [&](const char* p) { return adb_open(p, fi); });
+}
+
+static int devices_read(const char* path, char* buf, size_t size, off_t offset,
+                        struct fuse_file_info* fi)
+{
+    return on_device(path, true, [&](const char* p) {
+        return adb_read(p, buf, size, offset, fi);
+    });
+}
+
+static int devices_write(const char* path, const char* buf, size_t size, off_t offset,
+                         struct fuse_file_info* fi)
+{
+    return on_device(path, true, [&](const char* p) {
+        return adb_write(p, buf, size, offset, fi);
+    });
+}
+
+static int devices_flush(const char* path, struct fuse_file_info* fi)
+{
+    return on_device(path, true, [&](const char* p) { return adb_flush(p, fi); });
+}
+
+static int devices_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    return on_device(path, true, [&](const char* p) { return adb_fsync(p, datasync, fi); });
+}
+
+static int devices_release(const char* path, struct fuse_file_info* fi)
+{
+    return on_device(path, true, [&](const char* p) { return adb_release(p, fi); });
+}
+
+static int devices_utimens(const char* path, const struct timespec ts[2])
+{
+    return on_device(path, false, [&](const char* p) { return adb_utimens(p, ts); });
+}
+
+static int devices_truncate(const char* path, off_t size)
+{
+    return on_device(path, false, [&](const char* p) { return adb_truncate(p, size); });
+}
+
+/** @return true for "/<name>": a device, which cannot be made or removed. */
+static bool is_device_dir(const char* path)
+{
+    return !is_control_path(path) && !strchr(path + 1, '/');
+}
+
+static int devices_mknod(const char* path, mode_t mode, dev_t rdev)
+{
+    if (is_device_dir(path)) return -EPERM;
+    return on_device(path, false, [&](const char* p) { return adb_mknod(p, mode, rdev); });
+}
+
+static int devices_mkdir(const char* path, mode_t mode)
+{
+    if (is_device_dir(path)) return -EPERM;
+    return on_device(path, false, [&](const char* p) { return adb_mkdir(p, mode); });
+}
+
+static int devices_rmdir(const char* path)
+{
+    if (is_device_dir(path)) return -EPERM;
+    return on_device(path, false, [&](const char* p) { return adb_rmdir(p); });
+}
+
+static int devices_unlink(const char* path)
+{
+    if (is_device_dir(path)) return -EPERM;
+    return on_device(path, false, [&](const char* p) { return adb_unlink(p); });
+}
+
+/**
+   Renames stay on one device; between devices the caller copies,
+   which runs on both devices' transfer workers at once.
+ */
+static int devices_rename(const char* from, const char* to)
+{
+    if (is_device_dir(from) || is_device_dir(to)) return -EPERM;
+    string from_serial, from_rest, to_serial, to_rest;
+    split_device_path(from, from_serial, from_rest);
+    split_device_path(to, to_serial, to_rest);
+    if (from_serial != to_serial) return -EXDEV;
+    return on_device(from, false, [&](const char* p) {
+        return adb_rename(p, to_rest.c_str());
+    });
+}
+
 /**
    Main struct for FUSE interface.
  */
@@ -1035,7 +3034,10 @@ static struct fuse_operations adbfs_oper;
 int main(int argc, char *argv[])
 {
     signal(SIGSEGV, handler);   // install our handler
+    signal(SIGPIPE, SIG_IGN);   // a dead shell session must not kill us
+    signal(SIGUSR1, dump_trace);
     makeTmpDir();
+    snprintf(traceDumpPath, sizeof traceDumpPath, "%strace", tempDirPath.c_str());
     memset(&adbfs_oper, 0, sizeof(adbfs_oper));
     adbfs_oper.readdir= adb_readdir;
     adbfs_oper.getattr= adb_getattr;
@@ -1043,6 +3045,9 @@ int main(int argc, char *argv[])
     adbfs_oper.open= adb_open;
     adbfs_oper.flush = adb_flush;
     adbfs_oper.release = adb_release;
+    adbfs_oper.fsync = adb_fsync;
+    adbfs_oper.init = adb_init;
+    adbfs_oper.destroy = adb_destroy;
     adbfs_oper.read= adb_read;
     adbfs_oper.write = adb_write;
     adbfs_oper.utimens = adb_utimens;
@@ -1053,11 +3058,63 @@ int main(int argc, char *argv[])
     adbfs_oper.rmdir = adb_rmdir;
     adbfs_oper.unlink = adb_unlink;
     adbfs_oper.readlink = adb_readlink;
-    adb_shell("ls");
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     memset(&adbfs_conf, 0, sizeof(adbfs_conf));
+    adbfs_conf.sessions = 2;
+    adbfs_conf.cachesize = 256;
+    adbfs_conf.readahead = 4096;
+    adbfs_conf.negcache = 30;
+    adbfs_conf.metacache = 64;
+    adbfs_conf.batchwait = 200;
+    adbfs_conf.transfers = 4;
     fuse_opt_parse(&args, &adbfs_conf, adb_opts, NULL);
+    transferCompression.set_enabled(adbfs_conf.compress);
+    if (adbfs_conf.trace && !traceLog.set_level(adbfs_conf.trace)) {
+        cerr << "unknown trace level " << adbfs_conf.trace
+             << "; use off, error, info or debug\n";
+        return 1;
+    }
+    if (adbfs_conf.prefetch) {
+        prefetchRoot = adbfs_conf.prefetch;
+        while (prefetchRoot.size() > 1 && prefetchRoot[prefetchRoot.size() - 1] == '/')
+            prefetchRoot.erase(prefetchRoot.size() - 1);
+    }
+#ifndef ADBFS_FUSE3
+    // let the kernel keep the misses for as long as we do
+    string negative_timeout = "-onegative_timeout=" + to_string(adbfs_conf.negcache);
+    fuse_opt_add_arg(&args, negative_timeout.c_str());
+#endif
+    defaultDevice = new adb_device("");
+    defaultDevice->tempDir = tempDirPath;
+    configure_device(*defaultDevice, 1);
+
+    if (adbfs_conf.devices) {
+        deviceTracker.set_listener(devices_changed);
+        adbfs_oper.getattr = devices_getattr;
+        adbfs_oper.readdir = devices_readdir;
+        adbfs_oper.readlink = devices_readlink;
+        adbfs_oper.access = devices_access;
+        adbfs_oper.open = devices_open;
+        adbfs_oper.read = devices_read;
+        adbfs_oper.write = devices_write;
+        adbfs_oper.flush = devices_flush;
+        adbfs_oper.fsync = devices_fsync;
+        adbfs_oper.release = devices_release;
+        adbfs_oper.utimens = devices_utimens;
+        adbfs_oper.truncate = devices_truncate;
+        adbfs_oper.mknod = devices_mknod;
+        adbfs_oper.mkdir = devices_mkdir;
+        adbfs_oper.rmdir = devices_rmdir;
+        adbfs_oper.unlink = devices_unlink;
+        adbfs_oper.rename = devices_rename;
+    } else {
+        adb_shell("ls");
+    }
 
+#ifdef ADBFS_FUSE3
+    return lowlevel_main(&args, &adbfs_oper, ATTR_CACHE_TTL, adbfs_conf.negcache);
+#else
     return fuse_main(args.argc, args.argv, &adbfs_oper, NULL);
+#endif
 }
@@ -0,0 +1,117 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Coalescing of concurrent lookups into batches.
+
+   A multithreaded indexer, or the kernel revalidating the entries of
+   a directory it just listed, fires many getattr calls at once, and
+   each one that missed the cache used to become its own round trip
+   to the device.  A request_batcher holds the first such lookup for a
+   short wait, collecting whatever other lookups arrive meanwhile, and
+   then answers all of them with one call of its batch function.
+   Lookups of a key that is already waiting in the batch share its
+   answer.
+
+   A lookup is only merged with one that has not been sent yet, never
+   with one whose answer is already on its way: that answer may have
+   been taken before a change the caller made just before asking.
+*/
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+template <class R>
+class request_batcher {
+public:
+    /** Answers the keys of a batch, one result per key, in order. */
+    typedef function<void(const vector<string>&, vector<R>&)> batch_function;
+
+    /** Most keys sent in one batch. */
+    static const size_t MAX_BATCH = 64;
+
+    request_batcher(batch_function run) : run(run), wait_us(200), leading(false) {}
+
+    /** Set how long, in microseconds, a batch waits for more keys. */
+    void set_wait(unsigned us)
+    {
+        lock_guard<mutex> guard(lock);
+        wait_us = us;
+    }
+
+    /** @return the answer for key, from the batch it ended up in. */
+    R get(const string& key)
+    {
+        unique_lock<mutex> guard(lock);
+        shared_ptr<request> req;
+        typename map<string, shared_ptr<request> >::iterator it = waiting.find(key);
+        if (it != waiting.end()) {
+            req = it->second;
+            adbfsStats.add(LOOKUPS_MERGED);
+        } else {
+            req.reset(new request);
+            waiting[key] = req;
+            order.push_back(key);
+            if (order.size() >= MAX_BATCH) cond.notify_all();
+            if (!leading) lead(guard);
+        }
+        while (!req->done) cond.wait(guard);
+        return req->result;
+    }
+
+private:
+    struct request {
+        bool done;
+        R result;
+        request() : done(false), result() {}
+    };
+
+    batch_function run;
+    unsigned wait_us;
+    mutex lock;
+    condition_variable cond;
+    map<string, shared_ptr<request> > waiting;  /* not sent yet */
+    vector<string> order;                       /* keys of waiting, in arrival order */
+    bool leading;                               /* a thread is collecting waiting */
+
+    /**
+       Collect keys for a while, then send them.  Must be called with
+       lock held, through guard.
+     */
+    void lead(unique_lock<mutex>& guard)
+    {
+        leading = true;
+        cond.wait_for(guard, chrono::microseconds(wait_us),
+                      [this] { return order.size() >= MAX_BATCH; });
+        leading = false;
+        vector<string> keys;
+        keys.swap(order);
+        vector<shared_ptr<request> > reqs;
+        for (size_t i = 0; i < keys.size(); ++i) reqs.push_back(waiting[keys[i]]);
+        waiting.clear();
+        guard.unlock();
+
+        vector<R> results(keys.size());
+        run(keys, results);
+        if (keys.size() > 1) adbfsStats.add(LOOKUPS_BATCHED, keys.size());
+
+        guard.lock();
+        for (size_t i = 0; i < reqs.size(); ++i) {
+            reqs[i]->result = results[i];
+            reqs[i]->done = true;
+        }
+        cond.notify_all();
+    }
+};
@@ -0,0 +1,248 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Compressed transfers (-o compress).
+
+   Over USB 2 or adb over Wi-Fi the link, not the phone, limits how
+   fast files move, and text, logs, databases and raw media shrink to
+   a fraction when gzipped.  The sync service only compresses on
+   recent devices, and then with brotli, lz4 or zstd, so instead the
+   device's own gzip (toybox has one) is run through the "exec:"
+   service: reads come back through "gzip -1 -c" and are inflated here,
+   and pushes are gzipped here and unpacked on the device.
+
+   Whether gzip works is probed once per device.
+
+   Compression costs a process on the device and, for pushes, an
+   extra round trip, so a compression_policy skips files that are
+   small or whose names say they are compressed already (jpg, mp4,
+   zip, ...), and learns from transfers that saved little: once a
+   file with a given extension did not shrink, later ones are sent as
+   they are.
+*/
+
+#include <zlib.h>
+#include <ctype.h>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+using namespace std;
+
+/** Files below this size are not worth the extra work. */
+static const uint64_t COMPRESS_MIN_SIZE = 64 << 10;
+
+/**
+   Inflates a gzip stream fed to it in pieces.
+ */
+class gunzip_stream {
+public:
+    gunzip_stream() : finished(false), failed(false)
+    {
+        memset(&z, 0, sizeof z);
+        failed = inflateInit2(&z, 16 + MAX_WBITS) != Z_OK;
+    }
+
+    ~gunzip_stream() { inflateEnd(&z); }
+
+    /**
+       Inflate some compressed bytes and hand the output to
+       sink(const char*, size_t), which returns false to stop.
+
+       @return false if the data is not gzip or sink gave up.
+     */
+    template <class F> bool feed(const char* data, size_t size, F sink)
+    {
+        if (failed) return false;
+        z.next_in = (Bytef*)data;
+        z.avail_in = size;
+        while (z.avail_in > 0 && !finished) {
+            char out[65536];
+            z.next_out = (Bytef*)out;
+            z.avail_out = sizeof out;
+            int res = inflate(&z, Z_NO_FLUSH);
+            if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+                failed = true;
+                return false;
+            }
+            size_t n = sizeof out - z.avail_out;
+            if (n > 0 && !sink(out, n)) {
+                failed = true;
+                return false;
+            }
+            if (res == Z_STREAM_END) finished = true;
+            else if (res == Z_BUF_ERROR && n == 0) break;
+        }
+        return true;
+    }
+
+    /** @return true once the whole stream, with its checksum, was read. */
+    bool done() const { return finished && !failed; }
+
+    uint64_t compressed() const { return z.total_in; }
+    uint64_t raw() const { return z.total_out; }
+
+private:
+    z_stream z;
+    bool finished;
+    bool failed;
+};
+
+/**
+   Write a gzip copy of the file open at in to out.
+
+   @return false on a read or write error.
+ */
+bool gzip_file(int in, int out, uint64_t& raw, uint64_t& compressed)
+{
+    z_stream z;
+    memset(&z, 0, sizeof z);
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    vector<char> input(1 << 16), output(1 << 16);
+    bool ok = true;
+    int flush = Z_NO_FLUSH;
+    while (ok && flush != Z_FINISH) {
+        ssize_t n = read(in, &input[0], input.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = (Bytef*)&input[0];
+        z.avail_in = n;
+        do {
+            z.next_out = (Bytef*)&output[0];
+            z.avail_out = output.size();
+            deflate(&z, flush);
+            size_t have = output.size() - z.avail_out;
+            if (have > 0 && !write_all(out, &output[0], have)) ok = false;
+        } while (ok && z.avail_out == 0);
+    }
+    raw = z.total_in;
+    compressed = z.total_out;
+    deflateEnd(&z);
+    return ok;
+}
+
+/**
+   Decides which transfers are compressed.
+ */
+class compression_policy {
+public:
+    compression_policy() : wanted(false) {}
+
+    /** Turn compression on (-o compress) or off; on, it is used if the device can. */
+    void set_enabled(bool on) { wanted = on; }
+
+    /**
+       @param path device path of the file.
+       @param size its size, or -1 if not known.
+       @return whether to compress a transfer of path.
+     */
+    bool worth_it(const string& path, int64_t size)
+    {
+        if (!wanted || (size >= 0 && (uint64_t)size < COMPRESS_MIN_SIZE)) return false;
+        string ext = extension(path);
+        if (incompressible(ext)) return false;
+        {
+            lock_guard<mutex> guard(lock);
+            if (poor.count(ext)) return false;
+        }
+        string serial = adb_serial();
+        {
+            lock_guard<mutex> guard(lock);
+            map<string, bool>::iterator it = available.find(serial);
+            if (it != available.end()) return it->second;
+        }
+        // two threads may both probe a new device; that is harmless
+        bool works = probe();
+        lock_guard<mutex> guard(lock);
+        available[serial] = works;
+        return works;
+    }
+
+    /**
+       Note how well a transfer of path compressed, so that files
+       like it are no longer compressed if it was not worth it.
+     */
+    void observe(const string& path, uint64_t raw, uint64_t compressed)
+    {
+        if (raw < COMPRESS_MIN_SIZE || compressed * 10 < raw * 9) return;
+        string ext = extension(path);
+        // files without one have nothing else in common
+        if (ext.empty()) return;
+        TRACE(TRACE_INFO, "compression: ." << ext << " files do not shrink; "
+              "sending them as they are");
+        lock_guard<mutex> guard(lock);
+        poor.insert(ext);
+    }
+
+private:
+    bool wanted;
+    mutex lock;
+    map<string, bool> available;   /* by device serial */
+    set<string> poor;   /* extensions seen not to compress */
+
+    /** @return the lower case extension of the last component of path. */
+    static string extension(const string& path)
+    {
+        size_t slash = path.rfind('/');
+        size_t dot = path.rfind('.');
+        if (dot == string::npos || (slash != string::npos && dot < slash)) return string();
+        string ext = path.substr(dot + 1);
+        for (size_t i = 0; i < ext.size(); ++i) ext[i] = tolower((unsigned char)ext[i]);
+        return ext;
+    }
+
+    static bool incompressible(const string& ext)
+    {
+        static const char* const known[] = {
+            "jpg", "jpeg", "png", "gif", "webp", "heic", "heif", "avif",
+            "mp4", "m4v", "mkv", "webm", "mov", "avi", "3gp", "ts",
+            "mp3", "m4a", "aac", "ogg", "opus", "flac", "amr",
+            "zip", "apk", "apks", "jar", "aab", "obb", "gz", "tgz", "xz",
+            "bz2", "7z", "rar", "zst", "br", "lz4", "pdf", "epub", "docx",
+            "xlsx", "pptx", "odt",
+        };
+        for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); ++i)
+            if (ext == known[i]) return true;
+        return false;
+    }
+
+    /** @return true if the device has a gzip that works through exec:. */
+    static bool probe()
+    {
+        int fd = adb_device_service("exec:echo adbfs | gzip -1 -c 2>/dev/null", NULL);
+        if (fd < 0) return false;
+        gunzip_stream gz;
+        string text;
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof buf)) != 0) {
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) break;
+            gz.feed(buf, n, [&](const char* data, size_t size) {
+                text.append(data, size);
+                return true;
+            });
+        }
+        close(fd);
+        bool ok = gz.done() && text == "adbfs\n";
+        TRACE(TRACE_INFO, "compression: device gzip " << (ok ? "works" : "not available"));
+        return ok;
+    }
+};
+
+/**
+   The compression settings of this process.
+ */
+compression_policy transferCompression;
@@ -0,0 +1,161 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   The set of attached devices, for mounting all of them at once
+   (-o devices).
+
+   A device_tracker keeps a "host:track-devices" connection to the adb
+   server open on a background thread; the server sends the whole list
+   of devices every time one is plugged in, unplugged or changes state.
+   If the server does not support tracking, the list is polled every
+   second instead.  Until the first list arrives, callers ask the
+   server themselves, so the first lookup after mounting does not fail.
+   The thread is stopped at unmount, before the devices it reports
+   are torn down.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class device_tracker {
+public:
+    /** Called with the online serials whenever they change. */
+    typedef function<void(const vector<string>&)> change_function;
+
+    device_tracker() : known(false), owner(0), running(false), stopping(false),
+                       connection(-1) {}
+
+    void set_listener(change_function listener)
+    {
+        lock_guard<mutex> guard(lock);
+        on_change = listener;
+    }
+
+    /** @return the serials of the online devices, sorted. */
+    vector<string> list()
+    {
+        start();
+        {
+            lock_guard<mutex> guard(lock);
+            if (known) return vector<string>(serials.begin(), serials.end());
+        }
+        vector<string> now;
+        if (adb_devices(now)) update(now);
+        return now;
+    }
+
+    bool attached(const string& serial)
+    {
+        vector<string> now = list();
+        return binary_search(now.begin(), now.end(), serial);
+    }
+
+    /**
+       Stop tracking, and wait until the listener is no longer called.
+       The next list() starts again.
+     */
+    void stop()
+    {
+        unique_lock<mutex> guard(lock);
+        if (owner != getpid()) return;
+        stopping = true;
+        if (connection >= 0) shutdown(connection, SHUT_RDWR);
+        changed.notify_all();
+        while (running) changed.wait(guard);
+        stopping = false;
+        known = false;
+        owner = 0;
+    }
+
+private:
+    mutex lock;
+    condition_variable changed;     /* running or stopping changed */
+    set<string> serials;
+    bool known;             /* serials came from the server */
+    change_function on_change;
+    pid_t owner;
+    bool running;           /* the tracking thread is in track() */
+    bool stopping;
+    int connection;         /* its connection to the server, or -1 */
+
+    void update(const vector<string>& now)
+    {
+        change_function listener;
+        {
+            lock_guard<mutex> guard(lock);
+            set<string> fresh(now.begin(), now.end());
+            bool changed = !known || fresh != serials;
+            known = true;
+            if (!changed) return;
+            serials.swap(fresh);
+            listener = on_change;
+        }
+        TRACE(TRACE_INFO, "devices: " << now.size() << " online");
+        if (listener) listener(now);
+    }
+
+    /**
+       Start tracking in the process that will use it; fuse_main forks
+       after we set up.
+     */
+    void start()
+    {
+        lock_guard<mutex> guard(lock);
+        if (owner == getpid()) return;
+        owner = getpid();
+        known = false;
+        // one inherited across fork is not running in this process
+        running = true;
+        thread(&device_tracker::track, this).detach();
+    }
+
+    void track()
+    {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            guard.unlock();
+            int fd = adb_server_connect();
+            guard.lock();
+            connection = fd;
+            if (stopping) break;
+            guard.unlock();
+            bool tracking = fd >= 0 && adb_request(fd, "host:track-devices", NULL);
+            string reply;
+            while (tracking && adb_read_payload(fd, reply)) update(adb_parse_devices(reply));
+            vector<string> now;
+            bool polled = !tracking && adb_devices(now);
+            guard.lock();
+            if (fd >= 0) close(fd);
+            connection = -1;
+            if (stopping) break;
+            guard.unlock();
+            if (polled) {
+                update(now);
+                guard.lock();
+            } else {
+                // the server went away; callers ask it themselves until it is back
+                guard.lock();
+                known = false;
+            }
+            changed.wait_for(guard, chrono::seconds(1), [this] { return stopping; });
+        }
+        if (connection >= 0) close(connection);
+        connection = -1;
+        running = false;
+        changed.notify_all();
+    }
+};
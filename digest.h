@@ -0,0 +1,230 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Digests of local copies, to tell whether a flush changed anything.
+
+   Programs often open a file for writing and close it unchanged, or
+   write back the bytes it already had, as editors saving an unchanged
+   buffer and rsync --inplace do; each of those used to push the whole
+   file and sync the device.  A file_digest keeps an MD5 of every block
+   of what the device has, taken when the local copy is pulled or
+   pushed, so that a flush can compare the blocks that were written
+   and skip the push if none of them changed.
+
+   MD5 is also what the device's md5sum prints, so files we hold no
+   digest of can be compared with the device's copy (-o devicehash).
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/** MD5 (RFC 1321), for telling copies apart, not for security. */
+class md5 {
+public:
+    md5() : length(0), used(0)
+    {
+        state[0] = 0x67452301;
+        state[1] = 0xefcdab89;
+        state[2] = 0x98badcfe;
+        state[3] = 0x10325476;
+    }
+
+    void update(const void* data, size_t n)
+    {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        length += n;
+        while (n > 0) {
+            size_t take = min(n, sizeof block - used);
+            memcpy(block + used, p, take);
+            used += take;
+            p += take;
+            n -= take;
+            if (used == sizeof block) {
+                transform(block);
+                used = 0;
+            }
+        }
+    }
+
+    /** @return the 16 byte digest; the object is spent afterwards. */
+    string digest()
+    {
+        uint64_t bits = length * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (used != 56) update(&pad, 1);
+        unsigned char tail[8];
+        for (int i = 0; i < 8; ++i) tail[i] = bits >> (8 * i);
+        update(tail, 8);
+        string out(16, '\0');
+        for (int i = 0; i < 16; ++i) out[i] = state[i / 4] >> (8 * (i % 4));
+        return out;
+    }
+
+    /** @return digest() as md5sum prints it. */
+    string hex()
+    {
+        string raw = digest(), out;
+        static const char digits[] = "0123456789abcdef";
+        for (size_t i = 0; i < raw.size(); ++i) {
+            out += digits[(unsigned char)raw[i] >> 4];
+            out += digits[raw[i] & 15];
+        }
+        return out;
+    }
+
+private:
+    uint32_t state[4];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+
+    static uint32_t rotate(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+    void transform(const unsigned char* chunk)
+    {
+        static const uint32_t K[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+            0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+            0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+            0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+            0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+            0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+            0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+            0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+            0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+        };
+        static const int R[64] = {
+            7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+            5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+            4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+            6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+        };
+        uint32_t m[16];
+        for (int i = 0; i < 16; ++i)
+            m[i] = chunk[i * 4] | (chunk[i * 4 + 1] << 8) | (chunk[i * 4 + 2] << 16)
+                | ((uint32_t)chunk[i * 4 + 3] << 24);
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t f;
+            int g;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+            uint32_t next = d;
+            d = c;
+            c = b;
+            b = b + rotate(a + f + K[i] + m[g], R[i]);
+            a = next;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+};
+
+/** Granularity at which copies are compared. */
+static const off_t DIGEST_BLOCK_SIZE = 64 * 1024;
+
+/**
+   The MD5 of each block of a file, and its size.
+ */
+class file_digest {
+public:
+    file_digest() : size(-1) {}
+
+    bool known() const { return size >= 0; }
+
+    /**
+       Take the digest of the blocks of fd that overlap [start, end),
+       or of all of it if the size changed.
+
+       @return true if any of them differ from before, or fd could not
+       be read; the digest is of fd as it is now either way.
+     */
+    bool refresh(int fd, off_t start, off_t end)
+    {
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            size = -1;
+            return true;
+        }
+        bool changed = st.st_size != size;
+        if (changed) {
+            size = st.st_size;
+            blocks.assign(((size + DIGEST_BLOCK_SIZE - 1) / DIGEST_BLOCK_SIZE) * 16, '\0');
+            start = 0;
+            end = size;
+        }
+        vector<char> buf(DIGEST_BLOCK_SIZE);
+        for (off_t b = start / DIGEST_BLOCK_SIZE; b * DIGEST_BLOCK_SIZE < min(end, size); ++b) {
+            size_t want = min(DIGEST_BLOCK_SIZE, size - b * DIGEST_BLOCK_SIZE);
+            if (pread(fd, &buf[0], want, b * DIGEST_BLOCK_SIZE) != (ssize_t)want) {
+                size = -1;
+                return true;
+            }
+            md5 hash;
+            hash.update(&buf[0], want);
+            string d = hash.digest();
+            if (blocks.compare(b * 16, 16, d) != 0) {
+                blocks.replace(b * 16, 16, d);
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    /** Take the digest of the whole of fd; @return true if it changed. */
+    bool refresh(int fd) { return refresh(fd, 0, numeric_limits<off_t>::max()); }
+
+    /** Forget the digest, as if the file had never been read. */
+    void clear()
+    {
+        size = -1;
+        blocks.clear();
+    }
+
+private:
+    off_t size;
+    string blocks;          /* 16 bytes of MD5 per block */
+};
+
+/** @return the MD5 of the whole of fd as md5sum prints it, or "" on error. */
+static string md5_hex(int fd)
+{
+    md5 hash;
+    vector<char> buf(DIGEST_BLOCK_SIZE);
+    off_t pos = 0;
+    for (;;) {
+        ssize_t n = pread(fd, &buf[0], buf.size(), pos);
+        if (n < 0) return string();
+        if (n == 0) return hash.hex();
+        hash.update(&buf[0], n);
+        pos += n;
+    }
+}
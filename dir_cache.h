@@ -0,0 +1,186 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Directory listings kept between readdir calls.
+
+   find, tab completion and file managers list the same directories
+   many times a second, and every adb_readdir used to list the
+   directory on the device again.  A dir_cache keeps the names found in
+   each directory for DIR_CACHE_TTL seconds, the same time attributes
+   are kept in fileData.  Changes made through adbfs are applied to the
+   cached listings as they happen, so they stay valid until they
+   expire: creating a name adds it to its parent, removing one takes it
+   out, and renaming a directory moves the listings below it.
+*/
+
+#include <map>
+#include <mutex>
+#include <set>
+
+using namespace std;
+
+/** Seconds a directory listing is served from the cache. */
+static const time_t DIR_CACHE_TTL = 30;
+
+class dir_cache {
+public:
+    dir_cache() : generation(0) {}
+
+    /**
+       Note the start of a listing on the device, so that it is not
+       stored if the directory changed while it was running.
+
+       @return the token to hand to store().
+     */
+    unsigned long begin()
+    {
+        lock_guard<mutex> guard(lock);
+        return generation;
+    }
+
+    /**
+       @param dir unescaped directory path.
+       @param names receives the names in dir, without "." and "..".
+       @return false if dir is not cached or its listing expired.
+     */
+    bool get(const string& dir, vector<string>& names)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, listing>::iterator it = dirs.find(dir);
+        if (it == dirs.end()) return false;
+        if (it->second.timestamp + DIR_CACHE_TTL < time(NULL)) {
+            dirs.erase(it);
+            return false;
+        }
+        names.assign(it->second.names.begin(), it->second.names.end());
+        return true;
+    }
+
+    /**
+       Store the listing of a directory.
+
+       @param since the value begin() returned before the listing.
+     */
+    void store(const string& dir, const vector<string>& names, unsigned long since)
+    {
+        lock_guard<mutex> guard(lock);
+        if (since != generation) return;
+        if (dirs.size() >= MAX_DIRS) expire();
+        listing& l = dirs[dir];
+        l.timestamp = time(NULL);
+        l.names.clear();
+        for (size_t i = 0; i < names.size(); ++i)
+            if (names[i] != "." && names[i] != "..") l.names.insert(names[i]);
+    }
+
+    /** A name was created at path. */
+    void add(const string& path)
+    {
+        string dir, name;
+        split_path(path, dir, name);
+        lock_guard<mutex> guard(lock);
+        ++generation;
+        map<string, listing>::iterator it = dirs.find(dir);
+        if (it != dirs.end()) it->second.names.insert(name);
+    }
+
+    /** The name at path was removed, with everything below it. */
+    void remove(const string& path)
+    {
+        string dir, name;
+        split_path(path, dir, name);
+        lock_guard<mutex> guard(lock);
+        ++generation;
+        map<string, listing>::iterator it = dirs.find(dir);
+        if (it != dirs.end()) it->second.names.erase(name);
+        erase_tree(path);
+    }
+
+    /** from was renamed to to, replacing whatever was there. */
+    void rename(const string& from, const string& to)
+    {
+        string from_dir, from_name, to_dir, to_name;
+        split_path(from, from_dir, from_name);
+        split_path(to, to_dir, to_name);
+        lock_guard<mutex> guard(lock);
+        ++generation;
+        map<string, listing>::iterator it = dirs.find(from_dir);
+        if (it != dirs.end()) it->second.names.erase(from_name);
+        it = dirs.find(to_dir);
+        if (it != dirs.end()) it->second.names.insert(to_name);
+
+        // a renamed directory takes its listings along
+        erase_tree(to);
+        map<string, listing> moved;
+        string prefix = from + "/";
+        it = dirs.find(from);
+        if (it != dirs.end()) {
+            moved[to] = it->second;
+            dirs.erase(it);
+        }
+        it = dirs.lower_bound(prefix);
+        while (it != dirs.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+            moved[to + it->first.substr(from.size())] = it->second;
+            dirs.erase(it++);
+        }
+        dirs.insert(moved.begin(), moved.end());
+    }
+
+    /** Forget the listing of dir, e.g. after a change that may have failed. */
+    void invalidate(const string& dir)
+    {
+        lock_guard<mutex> guard(lock);
+        ++generation;
+        dirs.erase(dir);
+    }
+
+    /** @return the parent directory of an unescaped path. */
+    static string parent(const string& path)
+    {
+        string dir, name;
+        split_path(path, dir, name);
+        return dir;
+    }
+
+private:
+    struct listing {
+        time_t timestamp;
+        set<string> names;
+    };
+
+    /** Bound on cached directories; past it expired ones are dropped. */
+    static const size_t MAX_DIRS = 4096;
+
+    mutex lock;
+    map<string, listing> dirs;
+    unsigned long generation;   /* bumped by every change */
+
+    /** Must be called with lock held. */
+    void erase_tree(const string& path)
+    {
+        dirs.erase(path);
+        string prefix = path + "/";
+        map<string, listing>::iterator it = dirs.lower_bound(prefix);
+        while (it != dirs.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+            dirs.erase(it++);
+    }
+
+    /**
+       Drop expired listings, or all of them if none had expired.  Must
+       be called with lock held.
+     */
+    void expire()
+    {
+        time_t now = time(NULL);
+        for (map<string, listing>::iterator it = dirs.begin(); it != dirs.end();) {
+            if (it->second.timestamp + DIR_CACHE_TTL < now) dirs.erase(it++);
+            else ++it;
+        }
+        if (dirs.size() >= MAX_DIRS) dirs.clear();
+    }
+};
@@ -0,0 +1,99 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   The parts of a file written through one handle.
+
+   Writing to a handle used to just mark it dirty, and flushing it
+   pushed the whole file again, so appending a line to a large log or
+   changing a page of a database sent all of it.  A dirty_extents keeps
+   the byte ranges that were written, merging those that overlap or
+   touch, so that a flush can write only them into the device file in
+   place.
+*/
+
+#include <sys/types.h>
+#include <map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+class dirty_extents {
+public:
+    /**
+       @param base size of the device file when the handle's copy last
+       matched it, or -1 if that is not known, which makes only a full
+       push safe.
+     */
+    explicit dirty_extents(off_t base = -1) : base(base), total(0), cut(false) {}
+
+    /** Record a write of count bytes at offset. */
+    void add(off_t offset, size_t count)
+    {
+        if (count == 0) return;
+        off_t start = offset, end = offset + count;
+        map<off_t, off_t>::iterator it = ranges.upper_bound(start);
+        if (it != ranges.begin()) {
+            map<off_t, off_t>::iterator prev = it;
+            if ((--prev)->second >= start) it = prev;
+        }
+        while (it != ranges.end() && it->first <= end) {
+            start = min(start, it->first);
+            end = max(end, it->second);
+            total -= it->second - it->first;
+            ranges.erase(it++);
+        }
+        ranges[start] = end;
+        total += end - start;
+    }
+
+    /**
+       The file was truncated under the handle, so its size has changed
+       even if it is back at the base size by now.
+     */
+    void truncated() { cut = true; }
+
+    bool empty() const { return ranges.empty(); }
+
+    bool was_truncated() const { return cut; }
+
+    off_t base_size() const { return base; }
+
+    /** Bytes written, counting rewritten ones once. */
+    off_t bytes() const { return total; }
+
+    /** End of the last range written, 0 if none. */
+    off_t end() const { return ranges.empty() ? 0 : ranges.rbegin()->second; }
+
+    /**
+       The ranges widened to multiples of block, but not past limit,
+       and merged again where that makes them touch.
+
+       @return (start, end) pairs in order.
+     */
+    vector<pair<off_t, off_t> > aligned(off_t block, off_t limit) const
+    {
+        vector<pair<off_t, off_t> > out;
+        for (map<off_t, off_t>::const_iterator it = ranges.begin(); it != ranges.end(); ++it) {
+            off_t start = it->first / block * block;
+            off_t end = min((it->second + block - 1) / block * block, limit);
+            if (start >= end) continue;
+            if (!out.empty() && out.back().second >= start)
+                out.back().second = max(out.back().second, end);
+            else
+                out.push_back(make_pair(start, end));
+        }
+        return out;
+    }
+
+private:
+    off_t base;
+    off_t total;
+    bool cut;
+    map<off_t, off_t> ranges;   /* start -> end, disjoint and not touching */
+};
@@ -0,0 +1,160 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Inode numbers for the low-level FUSE backend (lowlevel.h).
+
+   The high-level API names files by path and libfuse numbers the
+   kernel's nodes itself, so adbfs could report st_ino 1 for every
+   file.  The low-level API names files by number, so that backend
+   keeps an inode_table: a path gets a number when the kernel first
+   looks it up, and keeps it, through renames of it or of a directory
+   above it, until the kernel has forgotten every lookup.  Numbers are
+   not reused, so a stale one never reaches another file.
+*/
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+/** Number of the root directory, as the kernel knows it. */
+static const uint64_t ROOT_INODE = 1;
+
+class inode_table {
+public:
+    inode_table() : next(ROOT_INODE + 1)
+    {
+        // the kernel never forgets the root
+        inodes[ROOT_INODE].path = "/";
+        inodes[ROOT_INODE].lookups = 1;
+        paths["/"] = ROOT_INODE;
+    }
+
+    /**
+       Count a lookup of path, giving it a number if it has none.
+
+       @return the number of path's inode.
+     */
+    uint64_t lookup(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, uint64_t>::iterator it = paths.find(path);
+        uint64_t ino;
+        if (it != paths.end()) {
+            ino = it->second;
+        } else {
+            ino = next++;
+            paths[path] = ino;
+            inodes[ino].path = path;
+        }
+        ++inodes[ino].lookups;
+        return ino;
+    }
+
+    /** @return the number of path's inode without counting a lookup, 0 if none. */
+    uint64_t find(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, uint64_t>::iterator it = paths.find(path);
+        return it == paths.end() ? 0 : it->second;
+    }
+
+    /**
+       @param path receives the path ino was last known by, which is
+       still that of an open file after it has been removed.
+       @return false if ino is not known.
+     */
+    bool path(uint64_t ino, string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        unordered_map<uint64_t, inode>::iterator it = inodes.find(ino);
+        if (it == inodes.end()) return false;
+        path = it->second.path;
+        return true;
+    }
+
+    /** The kernel dropped count lookups of ino; after the last, ino is freed. */
+    void forget(uint64_t ino, uint64_t count)
+    {
+        lock_guard<mutex> guard(lock);
+        unordered_map<uint64_t, inode>::iterator it = inodes.find(ino);
+        if (it == inodes.end() || ino == ROOT_INODE) return;
+        if (it->second.lookups > count) {
+            it->second.lookups -= count;
+            return;
+        }
+        map<string, uint64_t>::iterator p = paths.find(it->second.path);
+        if (p != paths.end() && p->second == ino) paths.erase(p);
+        inodes.erase(it);
+    }
+
+    /**
+       path was removed: its inode keeps its number until it is
+       forgotten, but a file created there later gets a new one.
+     */
+    void unlink(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        detach(path);
+    }
+
+    /** from was renamed to to, along with everything below it. */
+    void rename(const string& from, const string& to)
+    {
+        lock_guard<mutex> guard(lock);
+        // whatever was at to has been replaced
+        detach(to);
+        vector<pair<string, uint64_t> > moved;
+        map<string, uint64_t>::iterator it = paths.find(from);
+        if (it != paths.end()) moved.push_back(*it);
+        string prefix = from + "/";
+        for (it = paths.lower_bound(prefix);
+             it != paths.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+            moved.push_back(*it);
+        for (size_t i = 0; i < moved.size(); ++i) {
+            string path = to + moved[i].first.substr(from.size());
+            paths.erase(moved[i].first);
+            paths[path] = moved[i].second;
+            inodes[moved[i].second].path = path;
+        }
+    }
+
+    /** @return the number of inodes the kernel holds, the root included. */
+    size_t size()
+    {
+        lock_guard<mutex> guard(lock);
+        return inodes.size();
+    }
+
+private:
+    struct inode {
+        string path;
+        uint64_t lookups;
+
+        inode() : lookups(0) {}
+    };
+
+    mutex lock;
+    uint64_t next;
+    map<string, uint64_t> paths;            /* ordered, so a subtree is a range */
+    unordered_map<uint64_t, inode> inodes;
+
+    /** Unlink path and everything below it; must be called with lock held. */
+    void detach(const string& path)
+    {
+        paths.erase(path);
+        string prefix = path + "/";
+        map<string, uint64_t>::iterator it = paths.lower_bound(prefix);
+        while (it != paths.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+            paths.erase(it++);
+    }
+};
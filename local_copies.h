@@ -0,0 +1,213 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Local copies of device files, kept after they are closed.
+
+   A file opened for writing is pulled whole into the temporary
+   directory, and that copy used to be deleted when the file was
+   closed, so opening it again pulled it again.  A local_copies
+   remembers, for each copy that still holds what the device has, the
+   (size, mtime) the device file had when it was pulled; if the device
+   reports the same on the next open the copy is used as it is.
+
+   Copies that no handle has open are kept up to a byte budget; past
+   that the least recently used ones are given back to the caller to
+   delete.  Entries are keyed like localCopyLocks, by escaped device
+   path; copies are only made or deleted with the path's lock held.
+*/
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class local_copies {
+public:
+    local_copies() : budget(0), bytes(0), clock(0) {}
+
+    /** Set the byte budget for copies no handle has open. */
+    void set_budget(unsigned long long b)
+    {
+        lock_guard<mutex> guard(lock);
+        budget = b;
+    }
+
+    /** A handle on the copy of path was opened. */
+    void acquire(const string& path, const string& local)
+    {
+        lock_guard<mutex> guard(lock);
+        entry& e = entries[path];
+        e.local = local;
+        ++e.users;
+    }
+
+    /**
+       A handle on the copy of path was closed.
+
+       @return true if the copy is worth keeping, false if the caller
+       should delete it.
+     */
+    bool release(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, entry>::iterator it = entries.find(path);
+        if (it == entries.end()) return false;
+        if (it->second.users > 0) --it->second.users;
+        if (it->second.valid || it->second.users > 0) return true;
+        entries.erase(it);
+        return false;
+    }
+
+    /**
+       @return true if the copy of path was pulled from the device file
+       as it is now, and has not been changed since.
+     */
+    bool matches(const string& path, off_t size, time_t mtime)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, entry>::iterator it = entries.find(path);
+        if (it == entries.end() || !it->second.valid) return false;
+        entry& e = it->second;
+        if (e.size != size || e.mtime != mtime) return false;
+        recent.erase(e.used);
+        e.used = ++clock;
+        recent[e.used] = path;
+        return true;
+    }
+
+    /** The copy of path now holds the device file of (size, mtime). */
+    void pulled(const string& path, off_t size, time_t mtime)
+    {
+        lock_guard<mutex> guard(lock);
+        entry& e = entries[path];
+        drop(e);
+        e.valid = true;
+        e.size = size;
+        e.mtime = mtime;
+        bytes += size;
+        e.used = ++clock;
+        recent[e.used] = path;
+    }
+
+    /**
+       The copy of path was written to, so it may no longer hold what
+       the device has.
+     */
+    void forget(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, entry>::iterator it = entries.find(path);
+        if (it == entries.end()) return;
+        drop(it->second);
+        if (it->second.users == 0) entries.erase(it);
+    }
+
+    /**
+       The device file of path was removed, replaced or renamed, so
+       the copy can not be restored either.
+     */
+    void discard(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, entry>::iterator it = entries.find(path);
+        if (it == entries.end()) return;
+        drop(it->second);
+        it->second.size = -1;
+        if (it->second.users == 0) entries.erase(it);
+    }
+
+    /**
+       The copy of path, written to since it was pulled, turned out to
+       hold what the device has after all, which has not changed.
+
+       @return false if there is no record to restore.
+     */
+    bool restore(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, entry>::iterator it = entries.find(path);
+        if (it == entries.end() || it->second.valid || it->second.size < 0) return false;
+        entry& e = it->second;
+        e.valid = true;
+        bytes += e.size;
+        e.used = ++clock;
+        recent[e.used] = path;
+        return true;
+    }
+
+    /** @return true if a handle has the copy of path open. */
+    bool in_use(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, entry>::iterator it = entries.find(path);
+        return it != entries.end() && it->second.users > 0;
+    }
+
+    /** @return true if nothing is recorded for path, so its copy may go. */
+    bool unused(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        return entries.find(path) == entries.end();
+    }
+
+    /**
+       Take the least recently used copies that no handle has open off
+       the books until the rest fit the budget.
+
+       @return (path, local copy) of each; the caller deletes the copy
+       with the path's lock held if unused() still says so.
+     */
+    vector<pair<string, string> > over_budget()
+    {
+        lock_guard<mutex> guard(lock);
+        vector<pair<string, string> > victims;
+        map<unsigned long, string>::iterator it = recent.begin();
+        while (bytes > budget && it != recent.end()) {
+            map<string, entry>::iterator e = entries.find(it->second);
+            if (e->second.users > 0) {
+                ++it;
+                continue;
+            }
+            victims.push_back(make_pair(e->first, e->second.local));
+            bytes -= e->second.size;
+            recent.erase(it++);
+            entries.erase(e);
+        }
+        return victims;
+    }
+
+private:
+    struct entry {
+        string local;
+        unsigned users;
+        bool valid;
+        off_t size;                         /* -1 if never pulled */
+        time_t mtime;
+        unsigned long used;                 /* key in recent, if valid */
+
+        entry() : users(0), valid(false), size(-1), mtime(0), used(0) {}
+    };
+
+    mutex lock;
+    unsigned long long budget;
+    unsigned long long bytes;               /* of valid copies */
+    unsigned long clock;
+    map<string, entry> entries;
+    map<unsigned long, string> recent;      /* valid copies, least recent first */
+
+    /** Must be called with lock held. */
+    void drop(entry& e)
+    {
+        if (!e.valid) return;
+        e.valid = false;
+        bytes -= e.size;
+        recent.erase(e.used);
+    }
+};
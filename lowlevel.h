@@ -0,0 +1,495 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   A backend for the FUSE 3 low-level API, built with "make FUSE3=1".
+
+   Through the high-level API the kernel looks up every name on its
+   own and libfuse turns its node numbers back into paths, with
+   attributes kept for a second: listing a directory of N files cost a
+   readdir and then N getattr round trips through the kernel, although
+   adb_readdir had just put the attributes of all of them in fileData.
+   This backend serves the kernel directly.  Files are numbered by an
+   inode_table, with the kernel's lookups counted and forgotten;
+   READDIRPLUS returns the attributes along with the names; and the
+   kernel is allowed to keep entries, attributes and misses for as
+   long as adbfs' own caches keep them.
+
+   The file system itself is still the path based callbacks of
+   adbfs.cpp, declared here in their FUSE 2.6 form, so that both
+   backends run the same code; this only maps numbers to paths.
+*/
+
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef int (*fuse_fill_dir_t)(void* buf, const char* name, const struct stat* stbuf, off_t off);
+
+/** The high-level callbacks adbfs implements, as FUSE 2.6 declares them. */
+struct fuse_operations {
+    int (*getattr)(const char*, struct stat*);
+    int (*readlink)(const char*, char*, size_t);
+    int (*mknod)(const char*, mode_t, dev_t);
+    int (*mkdir)(const char*, mode_t);
+    int (*unlink)(const char*);
+    int (*rmdir)(const char*);
+    int (*rename)(const char*, const char*);
+    int (*truncate)(const char*, off_t);
+    int (*open)(const char*, struct fuse_file_info*);
+    int (*read)(const char*, char*, size_t, off_t, struct fuse_file_info*);
+    int (*write)(const char*, const char*, size_t, off_t, struct fuse_file_info*);
+    int (*flush)(const char*, struct fuse_file_info*);
+    int (*release)(const char*, struct fuse_file_info*);
+    int (*fsync)(const char*, int, struct fuse_file_info*);
+    int (*readdir)(const char*, void*, fuse_fill_dir_t, off_t, struct fuse_file_info*);
+    void* (*init)(struct fuse_conn_info*);
+    void (*destroy)(void*);
+    int (*access)(const char*, int);
+    int (*utimens)(const char*, const struct timespec[2]);
+};
+
+/** d_ino of listed names the kernel has not looked up, as libfuse uses. */
+static const fuse_ino_t UNKNOWN_INODE = 0xffffffff;
+
+static const struct fuse_operations* lowlevelOps;
+static inode_table lowlevelInodes;
+static double lowlevelAttrTimeout;
+static double lowlevelNegativeTimeout;
+
+/** A directory as opendir listed it, handed to readdir in pieces. */
+struct dir_listing {
+    string path;
+    vector<string> names;
+};
+
+static string child_path(const string& dir, const char* name)
+{
+    return dir == "/" ? "/" + string(name) : dir + "/" + name;
+}
+
+/**
+   @param path receives the path of ino, or of name in ino if name is
+   given.
+   @return false, having replied ESTALE, if ino has been forgotten.
+ */
+static bool inode_path(fuse_req_t req, fuse_ino_t ino, string& path, const char* name = NULL)
+{
+    if (!lowlevelInodes.path(ino, path)) {
+        fuse_reply_err(req, ESTALE);
+        return false;
+    }
+    if (name) path = child_path(path, name);
+    return true;
+}
+
+/**
+   Fill e with the attributes of path, counting a lookup of it.
+
+   @return 0, or -errno from getattr, in which case nothing is counted.
+ */
+static int lookup_entry(const string& path, struct fuse_entry_param& e)
+{
+    memset(&e, 0, sizeof e);
+    int res = lowlevelOps->getattr(path.c_str(), &e.attr);
+    if (res < 0) return res;
+    e.ino = lowlevelInodes.lookup(path);
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = lowlevelAttrTimeout;
+    e.entry_timeout = lowlevelAttrTimeout;
+    return 0;
+}
+
+/** Reply to a request that made path with its entry. */
+static void reply_made(fuse_req_t req, const string& path, int res)
+{
+    struct fuse_entry_param e;
+    if (res == 0) res = lookup_entry(path, e);
+    if (res < 0) fuse_reply_err(req, -res);
+    else if (fuse_reply_entry(req, &e) != 0) lowlevelInodes.forget(e.ino, 1);
+}
+
+static void ll_init(void* userdata, struct fuse_conn_info* conn)
+{
+    // adb_open expects O_TRUNC to come as a truncate first, as in FUSE 2
+    conn->want &= ~FUSE_CAP_ATOMIC_O_TRUNC;
+    if (conn->capable & FUSE_CAP_READDIRPLUS) {
+        // attributes with every listing, not only the first one
+        conn->want |= FUSE_CAP_READDIRPLUS;
+        conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    }
+    lowlevelOps->init(conn);
+}
+
+static void ll_destroy(void* userdata)
+{
+    lowlevelOps->destroy(NULL);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    string path;
+    if (!inode_path(req, parent, path, name)) return;
+    struct fuse_entry_param e;
+    int res = lookup_entry(path, e);
+    if (res == -ENOENT) {
+        // a negative entry, which the kernel keeps as adbfs does
+        memset(&e, 0, sizeof e);
+        e.entry_timeout = lowlevelNegativeTimeout;
+        fuse_reply_entry(req, &e);
+    } else if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else if (fuse_reply_entry(req, &e) != 0) {
+        lowlevelInodes.forget(e.ino, 1);
+    }
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    lowlevelInodes.forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets)
+{
+    for (size_t i = 0; i < count; ++i) lowlevelInodes.forget(forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    string path;
+    if (!inode_path(req, ino, path)) return;
+    struct stat st;
+    int res = lowlevelOps->getattr(path.c_str(), &st);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, lowlevelAttrTimeout);
+}
+
+/**
+   Size and times are set through truncate and utimens; there is no
+   chmod or chown, as with the high-level API.
+ */
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
+                       struct fuse_file_info* fi)
+{
+    string path;
+    if (!inode_path(req, ino, path)) return;
+    int res = 0;
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) res = -ENOSYS;
+    if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+        res = lowlevelOps->truncate(path.c_str(), attr->st_size);
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME
+                               | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))) {
+        struct timespec ts[2];
+        ts[0].tv_sec = ts[1].tv_sec = 0;
+        ts[0].tv_nsec = ts[1].tv_nsec = UTIME_OMIT;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) ts[0].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_ATIME) ts[0] = attr->st_atim;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) ts[1].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_MTIME) ts[1] = attr->st_mtim;
+        res = lowlevelOps->utimens(path.c_str(), ts);
+    }
+    struct stat st;
+    if (res == 0) res = lowlevelOps->getattr(path.c_str(), &st);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, lowlevelAttrTimeout);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    string path;
+    if (!inode_path(req, ino, path)) return;
+    char buf[PATH_MAX + 1];
+    int res = lowlevelOps->readlink(path.c_str(), buf, sizeof buf);
+    if (res < 0) fuse_reply_err(req, -res);
+    else fuse_reply_readlink(req, buf);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+                     dev_t rdev)
+{
+    string path;
+    if (!inode_path(req, parent, path, name)) return;
+    reply_made(req, path, lowlevelOps->mknod(path.c_str(), mode, rdev));
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
+{
+    string path;
+    if (!inode_path(req, parent, path, name)) return;
+    reply_made(req, path, lowlevelOps->mkdir(path.c_str(), mode));
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    string path;
+    if (!inode_path(req, parent, path, name)) return;
+    int res = lowlevelOps->unlink(path.c_str());
+    if (res == 0) lowlevelInodes.unlink(path);
+    fuse_reply_err(req, -res);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    string path;
+    if (!inode_path(req, parent, path, name)) return;
+    int res = lowlevelOps->rmdir(path.c_str());
+    if (res == 0) lowlevelInodes.unlink(path);
+    fuse_reply_err(req, -res);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+                      fuse_ino_t newparent, const char* newname, unsigned int flags)
+{
+    string from, to;
+    if (!inode_path(req, parent, from, name) || !inode_path(req, newparent, to, newname)) return;
+    // RENAME_NOREPLACE and RENAME_EXCHANGE can not be done atomically with mv
+    if (flags) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    int res = lowlevelOps->rename(from.c_str(), to.c_str());
+    if (res == 0) lowlevelInodes.rename(from, to);
+    fuse_reply_err(req, -res);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    string path;
+    if (!inode_path(req, ino, path)) return;
+    int res = lowlevelOps->open(path.c_str(), fi);
+    if (res < 0) fuse_reply_err(req, -res);
+    else if (fuse_reply_open(req, fi) != 0) lowlevelOps->release(path.c_str(), fi);  // interrupted
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info* fi)
+{
+    string path;
+    if (!inode_path(req, ino, path)) return;
+    vector<char> buf(size);
+    int res = lowlevelOps->read(path.c_str(), buf.data(), size, off, fi);
+    if (res < 0) fuse_reply_err(req, -res);
+    else fuse_reply_buf(req, buf.data(), res);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t off,
+                     struct fuse_file_info* fi)
+{
+    string path;
+    if (!inode_path(req, ino, path)) return;
+    int res = lowlevelOps->write(path.c_str(), buf, size, off, fi);
+    if (res < 0) fuse_reply_err(req, -res);
+    else fuse_reply_write(req, res);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    string path;
+    if (!inode_path(req, ino, path)) return;
+    fuse_reply_err(req, -lowlevelOps->flush(path.c_str(), fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    string path;
+    if (!inode_path(req, ino, path)) return;
+    fuse_reply_err(req, -lowlevelOps->release(path.c_str(), fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
+{
+    string path;
+    if (!inode_path(req, ino, path)) return;
+    fuse_reply_err(req, -lowlevelOps->fsync(path.c_str(), datasync, fi));
+}
+
+static int collect_name(void* buf, const char* name, const struct stat* stbuf, off_t off)
+{
+    static_cast<dir_listing*>(buf)->names.push_back(name);
+    return 0;
+}
+
+/** List the directory once, so that readdir offsets index a fixed list. */
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    unique_ptr<dir_listing> listing(new dir_listing);
+    if (!inode_path(req, ino, listing->path)) return;
+    int res = lowlevelOps->readdir(listing->path.c_str(), listing.get(), collect_name, 0, fi);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fi->fh = reinterpret_cast<uintptr_t>(listing.get());
+    if (fuse_reply_open(req, fi) == 0) listing.release();
+}
+
+/**
+   Reply with as many names from off on as fit in size bytes; with
+   plus, with the attributes of each, which are counted as lookups.
+   adb_readdir has just put them in fileData, so getting them costs no
+   round trip to the device.
+ */
+static void reply_listing(fuse_req_t req, size_t size, off_t off, struct fuse_file_info* fi,
+                          bool plus)
+{
+    dir_listing* listing = reinterpret_cast<dir_listing*>(fi->fh);
+    vector<char> buf(size);
+    size_t used = 0;
+    for (size_t i = off; i < listing->names.size(); ++i) {
+        const char* name = listing->names[i].c_str();
+        bool dots = !strcmp(name, ".") || !strcmp(name, "..");
+        string path = child_path(listing->path, name);
+        size_t needed;
+        if (plus) {
+            struct fuse_entry_param e;
+            memset(&e, 0, sizeof e);
+            if (dots) {
+                // no lookup is counted for an entry of inode 0
+                e.attr.st_ino = UNKNOWN_INODE;
+                e.attr.st_mode = S_IFDIR;
+            } else if (lookup_entry(path, e) < 0) {
+                continue;   // gone since it was listed
+            }
+            needed = fuse_add_direntry_plus(req, &buf[used], size - used, name, &e, i + 1);
+            if (needed > size - used && e.ino) lowlevelInodes.forget(e.ino, 1);
+        } else {
+            struct stat st;
+            memset(&st, 0, sizeof st);
+            st.st_ino = dots ? 0 : lowlevelInodes.find(path);
+            if (st.st_ino == 0) st.st_ino = UNKNOWN_INODE;
+            needed = fuse_add_direntry(req, &buf[used], size - used, name, &st, i + 1);
+        }
+        if (needed > size - used) break;
+        used += needed;
+    }
+    fuse_reply_buf(req, buf.data(), used);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info* fi)
+{
+    reply_listing(req, size, off, fi, false);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info* fi)
+{
+    reply_listing(req, size, off, fi, true);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    delete reinterpret_cast<dir_listing*>(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    string path;
+    if (!inode_path(req, ino, path)) return;
+    fuse_reply_err(req, -lowlevelOps->access(path.c_str(), mask));
+}
+
+/**
+   Mount with the low-level API and serve requests until unmounted,
+   as fuse_main does with the high-level one.
+
+   @param attr_timeout seconds the kernel may keep entries and
+   attributes.
+   @param negative_timeout seconds it may remember that a name does
+   not exist.
+   @return the exit status.
+ */
+static int lowlevel_main(struct fuse_args* args, const struct fuse_operations* ops,
+                         double attr_timeout, double negative_timeout)
+{
+    lowlevelOps = ops;
+    lowlevelAttrTimeout = attr_timeout;
+    lowlevelNegativeTimeout = negative_timeout;
+
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(args, &opts) != 0) return 1;
+    if (opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", args->argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        free(opts.mountpoint);
+        return 0;
+    }
+    if (opts.show_version) {
+        fuse_lowlevel_version();
+        free(opts.mountpoint);
+        return 0;
+    }
+    if (!opts.mountpoint) {
+        fprintf(stderr, "usage: %s [options] <mountpoint>\n", args->argv[0]);
+        return 1;
+    }
+
+    struct fuse_lowlevel_ops ll;
+    memset(&ll, 0, sizeof ll);
+    ll.init = ll_init;
+    ll.destroy = ll_destroy;
+    ll.lookup = ll_lookup;
+    ll.forget = ll_forget;
+    ll.forget_multi = ll_forget_multi;
+    ll.getattr = ll_getattr;
+    ll.setattr = ll_setattr;
+    ll.readlink = ll_readlink;
+    ll.mknod = ll_mknod;
+    ll.mkdir = ll_mkdir;
+    ll.unlink = ll_unlink;
+    ll.rmdir = ll_rmdir;
+    ll.rename = ll_rename;
+    ll.open = ll_open;
+    ll.read = ll_read;
+    ll.write = ll_write;
+    ll.flush = ll_flush;
+    ll.release = ll_release;
+    ll.fsync = ll_fsync;
+    ll.opendir = ll_opendir;
+    ll.readdir = ll_readdir;
+    ll.readdirplus = ll_readdirplus;
+    ll.releasedir = ll_releasedir;
+    ll.access = ll_access;
+
+    int res = 1;
+    struct fuse_session* se = fuse_session_new(args, &ll, sizeof ll, NULL);
+    if (se) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                // daemonizes like fuse_main, before init starts any thread
+                fuse_daemonize(opts.foreground);
+                res = opts.singlethread ? fuse_session_loop(se)
+                    : fuse_session_loop_mt(se, opts.clone_fd);
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+    free(opts.mountpoint);
+    fuse_opt_free_args(args);
+    return res ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Paths known not to exist on the device.
+
+   File managers and shells look up the same missing names over and
+   over (.hidden, .directory, desktop.ini, .git, ...), and every miss
+   used to cost an adb round trip once the generic attribute cache
+   entry had expired.  A negative_cache remembers such misses for a
+   fixed time, grouped by parent directory.  Creating a name through
+   adbfs forgets it at once; a directory listing forgets the names it
+   shows, which catches files created on the device itself.
+*/
+
+#include <map>
+#include <mutex>
+
+using namespace std;
+
+class negative_cache {
+public:
+    negative_cache() : ttl(0), generation(0), size(0) {}
+
+    /** Set how long a miss is remembered, in seconds; 0 disables. */
+    void set_ttl(unsigned seconds) { ttl = seconds; }
+
+    /**
+       Note the start of a lookup, so that a miss found by a lookup
+       that raced with a creation is not recorded.
+
+       @return the token to hand to add().
+     */
+    unsigned long begin()
+    {
+        lock_guard<mutex> guard(lock);
+        return generation;
+    }
+
+    /** @return true if path is recorded as missing and not expired. */
+    bool missing(const string& path)
+    {
+        if (ttl == 0) return false;
+        string dir, name;
+        split_path(path, dir, name);
+        lock_guard<mutex> guard(lock);
+        map<string, names>::iterator d = dirs.find(dir);
+        if (d == dirs.end()) return false;
+        names::iterator n = d->second.find(name);
+        if (n == d->second.end()) return false;
+        if (n->second > time(NULL)) return true;
+        d->second.erase(n);
+        --size;
+        if (d->second.empty()) dirs.erase(d);
+        return false;
+    }
+
+    /**
+       Record that a lookup found nothing at path.
+
+       @param since the value begin() returned before the lookup.
+     */
+    void add(const string& path, unsigned long since)
+    {
+        if (ttl == 0) return;
+        string dir, name;
+        split_path(path, dir, name);
+        lock_guard<mutex> guard(lock);
+        if (since != generation) return;
+        if (size >= MAX_ENTRIES) expire();
+        names& entries = dirs[dir];
+        if (entries.find(name) == entries.end()) ++size;
+        entries[name] = time(NULL) + ttl;
+    }
+
+    /** A name was created at path. */
+    void forget(const string& path)
+    {
+        string dir, name;
+        split_path(path, dir, name);
+        lock_guard<mutex> guard(lock);
+        ++generation;
+        map<string, names>::iterator d = dirs.find(dir);
+        if (d == dirs.end()) return;
+        size -= d->second.erase(name);
+        if (d->second.empty()) dirs.erase(d);
+    }
+
+    /**
+       Something was moved to path, which may be a directory: forget
+       path and every miss below it.
+     */
+    void forget_tree(const string& path)
+    {
+        forget(path);
+        string prefix = path == "/" ? path : path + "/";
+        lock_guard<mutex> guard(lock);
+        map<string, names>::iterator d = dirs.find(path);
+        if (d != dirs.end()) {
+            size -= d->second.size();
+            dirs.erase(d);
+        }
+        d = dirs.lower_bound(prefix);
+        while (d != dirs.end() && d->first.compare(0, prefix.size(), prefix) == 0) {
+            size -= d->second.size();
+            dirs.erase(d++);
+        }
+    }
+
+private:
+    typedef map<string, time_t> names;
+
+    /** Bound on remembered misses; past it expired ones are dropped. */
+    static const size_t MAX_ENTRIES = 8192;
+
+    unsigned ttl;
+    mutex lock;
+    map<string, names> dirs;    /* parent directory -> name -> expiry */
+    unsigned long generation;   /* bumped by every forget() */
+    size_t size;
+
+    /**
+       Drop expired entries, or everything if none had expired.  Must
+       be called with lock held.
+     */
+    void expire()
+    {
+        time_t now = time(NULL);
+        for (map<string, names>::iterator d = dirs.begin(); d != dirs.end();) {
+            for (names::iterator n = d->second.begin(); n != d->second.end();) {
+                if (n->second <= now) {
+                    d->second.erase(n++);
+                    --size;
+                } else ++n;
+            }
+            if (d->second.empty()) dirs.erase(d++);
+            else ++d;
+        }
+        if (size >= MAX_ENTRIES) {
+            dirs.clear();
+            size = 0;
+        }
+    }
+};
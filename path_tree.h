@@ -0,0 +1,429 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   The attribute cache (fileData), kept as a tree of path components.
+
+   A flat map keyed by full path stores every directory name once per
+   file below it, and has no notion of a subtree: removing or renaming
+   a directory could only forget the directory's own entry and left
+   its descendants behind under a path that no longer exists.  A
+   path_tree has one node per component, with each distinct name
+   stored once however many directories it appears in.  A lookup
+   walks one node per component; rename_tree moves a whole subtree by
+   re-linking a single node, and erase_tree drops one.
+
+   Entries are stored in a compact form and turned back into a
+   fileCache on the way out.  With a budget set, the least recently
+   used entries are dropped once the tree's estimated size exceeds
+   it, and nodes left with neither entry nor children are freed.
+*/
+
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+class path_tree {
+public:
+    path_tree() : newest(NULL), oldest(NULL), entries(0), nodes(0), bytes(0),
+                  budget(0)
+    {
+        root = new node(intern(string()), NULL);
+    }
+
+    /** Set the most memory to use, in bytes; 0 means no limit. */
+    void set_budget(size_t limit)
+    {
+        lock_guard<mutex> guard(lock);
+        budget = limit;
+        evict();
+    }
+
+    /** @return false if there is no entry for path. */
+    bool get(const string& path, fileCache& value)
+    {
+        lock_guard<mutex> guard(lock);
+        node* n = find(path);
+        if (!n || !n->has_entry) return false;
+        touch(n);
+        unpack(*n, value);
+        return true;
+    }
+
+    /** @return the entry for path, or a default constructed fileCache. */
+    fileCache get(const string& path)
+    {
+        fileCache value = fileCache();
+        get(path, value);
+        return value;
+    }
+
+    void set(const string& path, const fileCache& value)
+    {
+        lock_guard<mutex> guard(lock);
+        node* n = create(path);
+        pack(value, *n);
+        evict();
+    }
+
+    /** @return false if there was no entry for path. */
+    bool erase(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        node* n = find(path);
+        if (!n || !n->has_entry) return false;
+        drop_entry(n);
+        prune(n);
+        return true;
+    }
+
+    /**
+       Apply f to the entry for path, creating a default constructed
+       entry first if there is none.  f must not touch the tree.
+     */
+    template <class F> void update(const string& path, F f)
+    {
+        lock_guard<mutex> guard(lock);
+        node* n = create(path);
+        fileCache value = fileCache();
+        if (n->has_entry) unpack(*n, value);
+        f(value);
+        pack(value, *n);
+        evict();
+    }
+
+    /** Forget path and everything below it. */
+    void erase_tree(const string& path)
+    {
+        lock_guard<mutex> guard(lock);
+        node* n = find(path);
+        if (!n || n == root) return;
+        node* parent = n->parent;
+        detach(n);
+        destroy(n);
+        prune(parent);
+    }
+
+    /**
+       from was renamed to to: whatever was cached at to is forgotten,
+       and the entries at and below from move there.
+     */
+    void rename_tree(const string& from, const string& to)
+    {
+        lock_guard<mutex> guard(lock);
+        node* n = find(from);
+        node* old = find(to);
+        if (n == old) return;
+        if (n && old && (below(n, old) || below(old, n))) {
+            // a directory cannot be moved into itself; be safe
+            drop_subtree(n);
+            drop_subtree(old);
+            return;
+        }
+        if (old) drop_subtree(old);
+        if (!n) return;
+
+        node* from_parent = n->parent;
+        detach(n);
+        const string* name = NULL;
+        node* to_parent = create_parent(to, name);
+        release(n->name);
+        n->name = name;
+        n->parent = to_parent;
+        attach(to_parent, n);
+        prune(from_parent);
+    }
+
+    /** Number of paths with an entry. */
+    size_t size()
+    {
+        lock_guard<mutex> guard(lock);
+        return entries;
+    }
+
+    /** Estimated memory held by the tree, in bytes. */
+    size_t memory()
+    {
+        lock_guard<mutex> guard(lock);
+        return bytes;
+    }
+
+private:
+    struct node {
+        const string* name;         /* interned; see intern() */
+        node* parent;
+        vector<node*> children;     /* sorted by name pointer */
+        node* newer;                /* LRU list of nodes with entries */
+        node* older;
+        bool has_entry;
+        bool have_stat;
+        bool have_link;
+        uint32_t mode, nlink, uid, gid;
+        uint64_t size, rdev;
+        int64_t atime, mtime, ctime;
+        time_t timestamp;
+        unique_ptr<string> link;
+
+        node(const string* name, node* parent)
+            : name(name), parent(parent), newer(NULL), older(NULL),
+              has_entry(false) {}
+    };
+
+    /** Overhead per interned name, on top of its characters. */
+    static const size_t NAME_OVERHEAD = 64;
+
+    mutex lock;
+    node* root;
+    unordered_map<string, size_t> names;    /* name -> nodes using it */
+    node* newest;
+    node* oldest;
+    size_t entries;
+    size_t nodes;
+    size_t bytes;
+    size_t budget;
+
+    const string* intern(const string& name)
+    {
+        pair<unordered_map<string, size_t>::iterator, bool> it =
+            names.insert(make_pair(name, 0));
+        if (it.second) bytes += name.size() + NAME_OVERHEAD;
+        ++it.first->second;
+        return &it.first->first;
+    }
+
+    void release(const string* name)
+    {
+        unordered_map<string, size_t>::iterator it = names.find(*name);
+        if (--it->second == 0) {
+            bytes -= name->size() + NAME_OVERHEAD;
+            names.erase(it);
+        }
+    }
+
+    static bool by_name(const node* a, const string* name) { return a->name < name; }
+
+    static node* child(node* parent, const string* name)
+    {
+        vector<node*>::iterator it = lower_bound(parent->children.begin(),
+                                                 parent->children.end(), name, by_name);
+        return it != parent->children.end() && (*it)->name == name ? *it : NULL;
+    }
+
+    static void attach(node* parent, node* n)
+    {
+        parent->children.insert(lower_bound(parent->children.begin(),
+                                            parent->children.end(), n->name, by_name), n);
+    }
+
+    void detach(node* n)
+    {
+        vector<node*>& siblings = n->parent->children;
+        siblings.erase(lower_bound(siblings.begin(), siblings.end(), n->name, by_name));
+        if (siblings.empty()) vector<node*>().swap(siblings);
+    }
+
+    /** Calls f with each component of path; stops when f returns false. */
+    template <class F> static void components(const string& path, F f)
+    {
+        size_t start = 0;
+        while (start < path.size()) {
+            size_t end = path.find('/', start);
+            if (end == string::npos) end = path.size();
+            if (end > start && !f(start, end)) return;
+            start = end + 1;
+        }
+    }
+
+    node* find(const string& path)
+    {
+        node* n = root;
+        string name;
+        components(path, [&](size_t start, size_t end) {
+            name.assign(path, start, end - start);
+            unordered_map<string, size_t>::iterator it = names.find(name);
+            n = it == names.end() ? NULL : child(n, &it->first);
+            return n != NULL;
+        });
+        return n;
+    }
+
+    node* create(const string& path)
+    {
+        node* n = root;
+        components(path, [&](size_t start, size_t end) {
+            const string* name = intern(path.substr(start, end - start));
+            node* next = child(n, name);
+            if (next) {
+                release(name);
+            } else {
+                next = new node(name, n);
+                attach(n, next);
+                ++nodes;
+                bytes += sizeof(node) + sizeof(node*);
+            }
+            n = next;
+            return true;
+        });
+        return n;
+    }
+
+    /**
+       Create the parent of path and intern its last component.
+     */
+    node* create_parent(const string& path, const string*& name)
+    {
+        size_t end = path.find_last_not_of('/');
+        size_t slash = end == string::npos ? string::npos : path.rfind('/', end);
+        size_t start = slash == string::npos ? 0 : slash + 1;
+        name = intern(end == string::npos ? string() : path.substr(start, end + 1 - start));
+        return slash == string::npos ? root : create(path.substr(0, slash));
+    }
+
+    static bool below(const node* n, const node* ancestor)
+    {
+        for (; n; n = n->parent) if (n == ancestor) return true;
+        return false;
+    }
+
+    void drop_subtree(node* n)
+    {
+        if (n == root) {
+            while (!root->children.empty()) {
+                node* c = root->children.back();
+                detach(c);
+                destroy(c);
+            }
+            if (root->has_entry) drop_entry(root);
+            return;
+        }
+        node* parent = n->parent;
+        detach(n);
+        destroy(n);
+        prune(parent);
+    }
+
+    /** Free n and everything below it; n must be detached. */
+    void destroy(node* n)
+    {
+        for (size_t i = 0; i < n->children.size(); ++i) destroy(n->children[i]);
+        if (n->has_entry) drop_entry(n);
+        release(n->name);
+        --nodes;
+        bytes -= sizeof(node) + sizeof(node*);
+        delete n;
+    }
+
+    /** Free n and its ancestors as long as they hold nothing. */
+    void prune(node* n)
+    {
+        while (n != root && !n->has_entry && n->children.empty()) {
+            node* parent = n->parent;
+            detach(n);
+            destroy(n);
+            n = parent;
+        }
+    }
+
+    void unlink_lru(node* n)
+    {
+        (n->newer ? n->newer->older : newest) = n->older;
+        (n->older ? n->older->newer : oldest) = n->newer;
+        n->newer = n->older = NULL;
+    }
+
+    void push_lru(node* n)
+    {
+        n->older = newest;
+        n->newer = NULL;
+        (newest ? newest->newer : oldest) = n;
+        newest = n;
+    }
+
+    void touch(node* n)
+    {
+        if (n == newest) return;
+        unlink_lru(n);
+        push_lru(n);
+    }
+
+    void drop_entry(node* n)
+    {
+        unlink_lru(n);
+        if (n->link) bytes -= n->link->capacity();
+        n->link.reset();
+        n->has_entry = false;
+        --entries;
+    }
+
+    /** Drop the least recently used entries while over budget. */
+    void evict()
+    {
+        while (budget && bytes > budget && oldest) {
+            node* n = oldest;
+            drop_entry(n);
+            prune(n);
+        }
+    }
+
+    void pack(const fileCache& value, node& n)
+    {
+        if (n.has_entry) {
+            touch(&n);
+        } else {
+            push_lru(&n);
+            n.has_entry = true;
+            ++entries;
+        }
+        n.timestamp = value.timestamp;
+        n.have_stat = value.haveStat;
+        n.have_link = value.haveLink;
+        n.mode = value.st.st_mode;
+        n.nlink = value.st.st_nlink;
+        n.uid = value.st.st_uid;
+        n.gid = value.st.st_gid;
+        n.size = value.st.st_size;
+        n.rdev = value.st.st_rdev;
+        n.atime = value.st.st_atime;
+        n.mtime = value.st.st_mtime;
+        n.ctime = value.st.st_ctime;
+        if (n.link) bytes -= n.link->capacity();
+        if (value.link.empty()) {
+            n.link.reset();
+        } else {
+            n.link.reset(new string(value.link));
+            bytes += n.link->capacity();
+        }
+    }
+
+    static void unpack(const node& n, fileCache& value)
+    {
+        value.timestamp = n.timestamp;
+        value.haveStat = n.have_stat;
+        value.haveLink = n.have_link;
+        memset(&value.st, 0, sizeof(struct stat));
+        if (n.link) value.link = *n.link;
+        else value.link.clear();
+        if (n.mode == 0) return;
+        value.st.st_ino = 1;    /* inode number, fake. */
+        value.st.st_mode = n.mode;
+        value.st.st_nlink = n.nlink;
+        value.st.st_uid = n.uid;
+        value.st.st_gid = n.gid;
+        value.st.st_size = n.size;
+        value.st.st_rdev = n.rdev;
+        value.st.st_blksize = 512;
+        value.st.st_blocks = (n.size + 256) / 512;
+        value.st.st_atime = n.atime;
+        value.st.st_mtime = n.mtime;
+        value.st.st_ctime = n.ctime;
+    }
+};
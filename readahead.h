@@ -0,0 +1,163 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Readahead for files read on demand (see remote_file.h).
+
+   Fetching only the blocks that are asked for makes a sequential read
+   of a large file a string of small round trips: the kernel sends one
+   128 KiB read, we fetch it, the kernel sends the next one.  Each open
+   handle therefore remembers where its last read ended.  Once reads
+   keep picking up where the previous one stopped, background workers
+   start fetching the blocks ahead of the reader, with a window that
+   doubles on every sequential read up to a configured maximum.  New
+   work is queued when the reader has used up half of what was fetched
+   ahead, so the transfer never runs dry while the reader catches up.
+   A read anywhere else collapses the window and cancels whatever was
+   queued or in flight for that handle.
+*/
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+/** Blocks fetched ahead after the first sequential read. */
+static const size_t READAHEAD_INITIAL_BLOCKS = 2;
+
+/** Largest single transfer queued by the readahead workers. */
+static const size_t READAHEAD_CHUNK_BLOCKS = 16;
+
+/**
+   Access pattern of one open file handle.
+ */
+struct readahead_state {
+    mutex lock;
+    off_t next;                 /* offset just after the previous read */
+    bool seen;                  /* whether there was a previous read */
+    size_t window;              /* blocks to keep ahead; 0 if random */
+    size_t ahead;               /* first block not queued for fetching */
+    atomic<unsigned> generation;    /* bumped to cancel queued work */
+    readahead_state() : next(0), seen(false), window(0), ahead(0),
+                        generation(0) {}
+};
+
+class readahead_engine {
+public:
+    readahead_engine() : max_window(0), owner(0) {}
+
+    /** Set the largest window, in blocks; 0 disables readahead. */
+    void set_max_window(size_t blocks) { max_window = blocks; }
+
+    /**
+       Account for a read on a handle and queue whatever should be
+       fetched ahead of it.
+
+       @param file the file being read.
+       @param ra the handle's access pattern.
+       @param offset start of the read.
+       @param count length of the read.
+     */
+    void on_read(const shared_ptr<remote_file>& file,
+                 const shared_ptr<readahead_state>& ra,
+                 off_t offset, size_t count)
+    {
+        if (max_window == 0 || count == 0) return;
+        lock_guard<mutex> guard(ra->lock);
+        bool sequential = ra->seen ? offset == ra->next : offset == 0;
+        ra->seen = true;
+        ra->next = offset + count;
+        if (!sequential) {
+            if (ra->window > 0) {
+                ra->generation++;
+                ra->window = 0;
+            }
+            ra->ahead = 0;
+            return;
+        }
+        ra->window = ra->window == 0 ? READAHEAD_INITIAL_BLOCKS
+                                     : min(ra->window * 2, max_window);
+
+        size_t reached = (offset + count + REMOTE_BLOCK_SIZE - 1) / REMOTE_BLOCK_SIZE;
+        size_t target = min(reached + ra->window, file->blocks());
+        if (ra->ahead < reached) ra->ahead = reached;
+        // only top up once half of what is in flight has been consumed
+        if (ra->ahead >= target || ra->ahead - reached > ra->window / 2) return;
+
+        unsigned generation = ra->generation;
+        lock_guard<mutex> queue_guard(lock);
+        start_workers();
+        for (size_t b = ra->ahead; b < target; b += READAHEAD_CHUNK_BLOCKS) {
+            readahead_job job;
+            job.file = file;
+            job.ra = ra;
+            job.generation = generation;
+            job.first = b;
+            job.count = min(READAHEAD_CHUNK_BLOCKS, target - b);
+            jobs.push_back(job);
+        }
+        ra->ahead = target;
+        cond.notify_all();
+    }
+
+    /** Cancel everything queued for a handle that is being closed. */
+    void cancel(const shared_ptr<readahead_state>& ra)
+    {
+        ra->generation++;
+    }
+
+private:
+    struct readahead_job {
+        weak_ptr<remote_file> file;
+        shared_ptr<readahead_state> ra;
+        unsigned generation;
+        size_t first;
+        size_t count;
+    };
+
+    static const unsigned WORKERS = 2;
+
+    size_t max_window;
+    mutex lock;
+    condition_variable cond;
+    deque<readahead_job> jobs;
+    pid_t owner;
+
+    /**
+       Start the workers in the process that will use them; fuse_main
+       forks after we set up.  Must be called with lock held.
+     */
+    void start_workers()
+    {
+        if (owner == getpid()) return;
+        owner = getpid();
+        for (unsigned i = 0; i < WORKERS; ++i)
+            thread(&readahead_engine::work, this).detach();
+    }
+
+    void work()
+    {
+        for (;;) {
+            readahead_job job;
+            {
+                unique_lock<mutex> guard(lock);
+                while (jobs.empty()) cond.wait(guard);
+                job = jobs.front();
+                jobs.pop_front();
+            }
+            if (job.ra->generation != job.generation) continue;
+            shared_ptr<remote_file> file = job.file.lock();
+            if (!file) continue;
+            file->prefetch(job.first, job.count, &job.ra->generation,
+                           job.generation);
+        }
+    }
+};
@@ -0,0 +1,578 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Device files read on demand, and the block cache that keeps them.
+
+   Instead of pulling a whole file when it is opened, a remote_file
+   creates a sparse local backing file of the right size and copies in
+   only the blocks that are actually read.  Missing blocks are fetched
+   with "dd bs= skip= count=" over the binary-safe "exec:" service, so
+   the time to the first byte does not depend on the size of the file.
+
+   remote_files live in a content_cache, keyed by device path and
+   validated against the device's (size, mtime) on every open, so a
+   file that is opened again is served from the blocks fetched last
+   time.  The cache holds at most a fixed number of blocks; when it is
+   full a CLOCK sweep punches the least recently used ones out of their
+   backing files.
+
+   No lock is held while a block is fetched.  A block being fetched
+   has a slot that is not filled yet; a reader that needs it waits for
+   that slot, while readers of other blocks are served meanwhile.
+*/
+
+#include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+using namespace std;
+
+/** Granularity at which device files are fetched and cached. */
+static const size_t REMOTE_BLOCK_SIZE = 64 * 1024;
+
+class content_cache;
+
+/** What content_cache::pin() found for a block. */
+enum block_state {
+    BLOCK_CACHED,       /* present and pinned */
+    BLOCK_MISSING,      /* reserved and pinned; the caller fetches it */
+    BLOCK_IN_FLIGHT     /* being fetched by someone else; not pinned */
+};
+
+class remote_file {
+public:
+    /**
+       @param cache the cache accounting for this file's blocks.
+       @param remote unescaped device path.
+       @param backing local descriptor the blocks are stored in; owned
+       by the remote_file from now on.
+       @param size size of the device file.
+       @param mtime modification time of the device file.
+     */
+    remote_file(content_cache& cache, const string& remote, int backing,
+                off_t size, time_t mtime)
+        : cache(cache), remote(remote), backing(backing), size(size),
+          mtime(mtime), cached_blocks(0),
+          slot((size + REMOTE_BLOCK_SIZE - 1) / REMOTE_BLOCK_SIZE, -1)
+    {
+        ftruncate(backing, size);
+    }
+
+    ~remote_file();
+
+    /**
+       A new descriptor for the backing file, used as the FUSE file
+       handle so that every open gets a distinct one.
+     */
+    int dup_fd() const { return fcntl(backing, F_DUPFD_CLOEXEC, 0); }
+
+    /** Whether this copy still describes the device file. */
+    bool matches(off_t device_size, time_t device_mtime) const
+    {
+        return size == device_size && mtime == device_mtime;
+    }
+
+    /**
+       Read from the file, fetching whatever part of the requested
+       range is not present locally yet.
+
+       @return bytes read, or a negative errno.
+     */
+    int read(char* buf, size_t count, off_t offset);
+
+    /**
+       Fetch blocks ahead of the reader into the cache.  The transfer
+       is abandoned as soon as *generation stops being expected.
+
+       @return false if the blocks could not be fetched.
+     */
+    bool prefetch(size_t first, size_t count,
+                  const atomic<unsigned>* generation, unsigned expected);
+
+    /** Number of REMOTE_BLOCK_SIZE blocks in the file. */
+    size_t blocks() const { return slot.size(); }
+
+private:
+    friend class content_cache;
+
+    content_cache& cache;
+    string remote;
+    int backing;
+    off_t size;
+    time_t mtime;
+    size_t cached_blocks;
+    vector<int> slot;       /* cache slot of each block, -1 if absent */
+    mutex pull_lock;        /* whole-file pulls share the file offset */
+
+    int load(size_t first, size_t last, vector<size_t>& pinned,
+             const atomic<unsigned>* generation, unsigned expected);
+    int fetch(size_t first, size_t count, const atomic<unsigned>* generation,
+              unsigned expected, bool compress = true);
+    bool fetch_all(size_t first, size_t count);
+};
+
+/**
+   Counters for sizing the cache budget.
+ */
+struct content_cache_stats {
+    unsigned long long hits;        /* blocks served from the cache */
+    unsigned long long misses;      /* blocks fetched from the device */
+    unsigned long long evictions;
+    unsigned long long bytes;       /* currently cached */
+};
+
+class content_cache {
+public:
+    /** @param serial device the cached files are on; see adbSerial. */
+    content_cache(const string& serial = string())
+        : serial(serial), hand(0), max_slots(1)
+    {
+        memset(&counters, 0, sizeof counters);
+    }
+
+    /** Set the byte budget; takes effect as blocks are replaced. */
+    void set_budget(unsigned long long bytes)
+    {
+        lock_guard<mutex> guard(lock);
+        max_slots = max(1ULL, bytes / REMOTE_BLOCK_SIZE);
+    }
+
+    /**
+       Get the cached copy of a device file, or start a new one if the
+       file is not cached or has changed on the device.
+
+       @param tmpdir directory for the sparse backing file.
+       @param reused if given, set to whether the cached copy was still
+       current, so that pages read from it before are too.
+       @return the file, or an empty pointer with errno set.
+     */
+    shared_ptr<remote_file> open(const string& remote, off_t size,
+                                 time_t mtime, const string& tmpdir,
+                                 bool* reused = NULL)
+    {
+        shared_ptr<remote_file> stale;
+        lock_guard<mutex> guard(lock);
+        if (reused) *reused = false;
+        map<string, shared_ptr<remote_file> >::iterator it = files.find(remote);
+        if (it != files.end()) {
+            if (it->second->matches(size, mtime)) {
+                if (reused) *reused = true;
+                return it->second;
+            }
+            detach(*it->second);
+            stale = it->second;
+            files.erase(it);
+        }
+        string backing_template = tmpdir + "cache-XXXXXX";
+        int fd = mkostemp(&backing_template[0], O_CLOEXEC);
+        if (fd < 0) return shared_ptr<remote_file>();
+        unlink(backing_template.c_str());
+        shared_ptr<remote_file> file(new remote_file(*this, remote, fd, size, mtime));
+        files[remote] = file;
+        return file;
+    }
+
+    /**
+       Forget the cached copy of a device file that we changed, removed
+       or renamed.  Handles that still have it open keep working.
+     */
+    void invalidate(const string& remote)
+    {
+        shared_ptr<remote_file> stale;
+        lock_guard<mutex> guard(lock);
+        map<string, shared_ptr<remote_file> >::iterator it = files.find(remote);
+        if (it == files.end()) return;
+        detach(*it->second);
+        stale = it->second;
+        files.erase(it);
+    }
+
+    content_cache_stats stats()
+    {
+        lock_guard<mutex> guard(lock);
+        content_cache_stats copy = counters;
+        return copy;
+    }
+
+private:
+    friend class remote_file;
+
+    const string serial;
+
+    struct cache_slot {
+        remote_file* file;  /* NULL if free */
+        size_t block;
+        bool referenced;
+        unsigned pins;
+        bool filled;
+    };
+
+    mutex lock;
+    condition_variable fetched;     /* a reserved slot was filled or freed */
+    vector<cache_slot> slots;
+    vector<int> free_slots;
+    size_t hand;
+    unsigned long long max_slots;
+    map<string, shared_ptr<remote_file> > files;
+    vector< shared_ptr<remote_file> > graveyard;
+    content_cache_stats counters;
+
+    /**
+       Pin a block of file so that it cannot be evicted while we use
+       it.  If it is not cached, reserve a slot for it first.
+
+       @return BLOCK_MISSING if the block has to be fetched and then
+       passed to fill(), BLOCK_IN_FLIGHT if someone else is fetching it
+       (see wait_fetched()).
+     */
+    block_state pin(remote_file& file, size_t block)
+    {
+        lock_guard<mutex> guard(lock);
+        int i = file.slot[block];
+        if (i >= 0) {
+            if (!slots[i].filled) return BLOCK_IN_FLIGHT;
+            slots[i].referenced = true;
+            slots[i].pins++;
+            counters.hits++;
+            return BLOCK_CACHED;
+        }
+
+        if (!free_slots.empty()) {
+            i = free_slots.back();
+            free_slots.pop_back();
+        } else if (slots.size() < max_slots || (i = victim()) < 0) {
+            // everything is pinned: go over budget rather than fail
+            i = slots.size();
+            slots.push_back(cache_slot());
+        }
+        cache_slot& s = slots[i];
+        s.file = &file;
+        s.block = block;
+        s.referenced = true;
+        s.pins = 1;
+        s.filled = false;
+        file.slot[block] = i;
+        file.cached_blocks++;
+        counters.misses++;
+        return BLOCK_MISSING;
+    }
+
+    /** Mark a reserved block as fetched, or give its slot back. */
+    void fill(remote_file& file, size_t block, bool ok)
+    {
+        lock_guard<mutex> guard(lock);
+        int i = file.slot[block];
+        if (i < 0 || slots[i].filled) return;
+        if (ok) {
+            slots[i].filled = true;
+            counters.bytes += REMOTE_BLOCK_SIZE;
+        } else {
+            release_slot(i);
+        }
+        fetched.notify_all();
+    }
+
+    /**
+       Wait until a block that pin() found in flight is fetched, or its
+       fetch failed; pin it again afterwards.
+     */
+    void wait_fetched(remote_file& file, size_t block)
+    {
+        unique_lock<mutex> guard(lock);
+        int i = file.slot[block];
+        while (i >= 0 && file.slot[block] == i && !slots[i].filled)
+            fetched.wait(guard);
+    }
+
+    void unpin(remote_file& file, size_t block)
+    {
+        lock_guard<mutex> guard(lock);
+        int i = file.slot[block];
+        if (i >= 0 && slots[i].pins > 0) slots[i].pins--;
+    }
+
+    /** Called by ~remote_file; must not run with lock held. */
+    void forget(remote_file& file)
+    {
+        lock_guard<mutex> guard(lock);
+        detach(file);
+    }
+
+    /** Destroy files dropped under the lock, now that it is free. */
+    void collect()
+    {
+        vector< shared_ptr<remote_file> > dead;
+        {
+            lock_guard<mutex> guard(lock);
+            dead.swap(graveyard);
+        }
+    }
+
+    /** Must be called with lock held. */
+    void detach(remote_file& file)
+    {
+        for (size_t b = 0; b < file.slot.size(); ++b)
+            if (file.slot[b] >= 0) release_slot(file.slot[b]);
+        // readers waiting for a block of it fetch the block themselves
+        fetched.notify_all();
+    }
+
+    /** Must be called with lock held. */
+    void release_slot(int i)
+    {
+        cache_slot& s = slots[i];
+        if (s.filled) counters.bytes -= REMOTE_BLOCK_SIZE;
+        s.file->slot[s.block] = -1;
+        s.file->cached_blocks--;
+        s.file = NULL;
+        s.filled = false;
+        free_slots.push_back(i);
+    }
+
+    /**
+       Advance the CLOCK hand to an unpinned block that has not been
+       used since the last sweep, and evict it.  Must be called with
+       lock held.
+
+       @return the freed slot, or -1 if every block is pinned.
+     */
+    int victim()
+    {
+        for (size_t sweep = 0; sweep < 2 * slots.size(); ++sweep) {
+            int i = hand;
+            hand = (hand + 1) % slots.size();
+            cache_slot& s = slots[i];
+            // free slots are always taken from free_slots first
+            if (s.file == NULL || s.pins > 0) continue;
+            if (s.referenced) {
+                s.referenced = false;
+                continue;
+            }
+            remote_file* file = s.file;
+#ifdef FALLOC_FL_PUNCH_HOLE
+            fallocate(file->backing, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      (off_t)s.block * REMOTE_BLOCK_SIZE, REMOTE_BLOCK_SIZE);
+#endif
+            counters.evictions++;
+            release_slot(i);
+            free_slots.pop_back();
+            if (file->cached_blocks == 0) {
+                map<string, shared_ptr<remote_file> >::iterator it = files.find(file->remote);
+                if (it != files.end() && it->second.get() == file && it->second.use_count() == 1) {
+                    graveyard.push_back(it->second);
+                    files.erase(it);
+                }
+            }
+            return i;
+        }
+        return -1;
+    }
+};
+
+remote_file::~remote_file()
+{
+    cache.forget(*this);
+    close(backing);
+}
+
+int remote_file::read(char* buf, size_t count, off_t offset)
+{
+    vector<size_t> pinned;
+    int res = 0;
+    if (offset < size) {
+        size_t first = offset / REMOTE_BLOCK_SIZE;
+        size_t last = (min((off_t)(offset + count), size) - 1) / REMOTE_BLOCK_SIZE;
+        res = load(first, last, pinned, NULL, 0);
+    }
+    if (res == 0) {
+        ssize_t n = pread(backing, buf, count, offset);
+        res = n < 0 ? -errno : n;
+    }
+    for (size_t i = 0; i < pinned.size(); ++i) cache.unpin(*this, pinned[i]);
+    cache.collect();
+    return res;
+}
+
+bool remote_file::prefetch(size_t first, size_t count,
+                           const atomic<unsigned>* generation, unsigned expected)
+{
+    if (first >= slot.size() || *generation != expected) return true;
+    vector<size_t> pinned;
+    size_t last = min(first + count, slot.size()) - 1;
+    int res = load(first, last, pinned, generation, expected);
+    for (size_t i = 0; i < pinned.size(); ++i) cache.unpin(*this, pinned[i]);
+    cache.collect();
+    return res == 0;
+}
+
+/**
+   Make blocks first..last present, pinning each of them.  Blocks that
+   are in flight are waited for by a read and skipped by a prefetch
+   (generation given).
+
+   @return 0, or a negative errno.
+ */
+int remote_file::load(size_t first, size_t last, vector<size_t>& pinned,
+                      const atomic<unsigned>* generation, unsigned expected)
+{
+    size_t i = first;
+    while (i <= last) {
+        block_state state = cache.pin(*this, i);
+        if (state == BLOCK_CACHED) {
+            pinned.push_back(i);
+            ++i;
+            continue;
+        }
+        if (state == BLOCK_IN_FLIGHT) {
+            if (generation) ++i;
+            else cache.wait_fetched(*this, i);
+            continue;
+        }
+        // fetch the whole run of missing blocks in one go
+        size_t reserved = pinned.size();
+        pinned.push_back(i);
+        size_t run = i + 1;
+        bool cached_after = false;
+        while (run <= last) {
+            state = cache.pin(*this, run);
+            if (state == BLOCK_MISSING) {
+                pinned.push_back(run++);
+                continue;
+            }
+            if (state == BLOCK_CACHED) {
+                pinned.push_back(run);
+                cached_after = true;
+            }
+            break;
+        }
+        int res = fetch(i, run - i, generation, expected);
+        // only devices without "exec:" are worth a whole pull; a short
+        // reply means the file changed, which a pull would not fix.
+        // Readahead is no use when the reader pulls the whole file.
+        if (res == -ENOSYS && !generation) res = fetch_all(i, run - i) ? 0 : -EIO;
+        for (size_t b = i; b < run; ++b) cache.fill(*this, b, res == 0);
+        if (res < 0) {
+            // their slots are gone, and may be someone else's by now
+            pinned.erase(pinned.begin() + reserved, pinned.begin() + reserved + (run - i));
+            return res;
+        }
+        i = cached_after ? run + 1 : run;
+    }
+    return 0;
+}
+
+/**
+   Copy count blocks starting at block first into the backing file.
+   If generation is given, give up as soon as it changes.
+
+   @param compress gzip the transfer if it is worth it.
+   @return 0; -ECANCELED if generation changed; -ENOSYS if the
+   "exec:" service could not be started; -EIO if the reply was cut
+   short or did not arrive.
+ */
+int remote_file::fetch(size_t first, size_t count, const atomic<unsigned>* generation,
+                       unsigned expected, bool compress)
+{
+    char range[96];
+    snprintf(range, sizeof range, " bs=%zu skip=%zu count=%zu 2>/dev/null",
+             REMOTE_BLOCK_SIZE, first, count);
+    // also called from readahead workers, which serve no FUSE call
+    adb_serial_scope device(cache.serial);
+    string command = "exec:dd if=" + shell_single_quote(remote) + range;
+    bool compressed = compress && transferCompression.worth_it(remote, size);
+    if (compressed) command += " | gzip -1 -c";
+    TRACE(TRACE_INFO, "fetch: " << remote << " blocks " << first << "+" << count
+          << (compressed ? " (gzip)" : ""));
+    stats_timer timer(adbfsStats.commands[CMD_DD]);
+    int sock = adb_device_service(command, NULL);
+    if (sock < 0) return -ENOSYS;
+
+    vector<char> buf(REMOTE_BLOCK_SIZE);
+    off_t start = (off_t)first * REMOTE_BLOCK_SIZE;
+    off_t pos = start;
+    bool ok = true;
+    bool cancelled = false;
+    gunzip_stream gz;
+    auto store = [&](const char* data, size_t n) {
+        if (pwrite(backing, data, n, pos) != (ssize_t)n) return false;
+        pos += n;
+        adbfsStats.add(BYTES_FETCHED, n);
+        return true;
+    };
+    for (;;) {
+        ssize_t n = ::read(sock, &buf[0], buf.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (generation && *generation != expected) cancelled = true;
+        if (n < 0 || cancelled) ok = false;
+        if (n <= 0 || !ok) break;
+        if (!(compressed ? gz.feed(&buf[0], n, store) : store(&buf[0], n))) {
+            ok = false;
+            break;
+        }
+    }
+    close(sock);
+    if (cancelled) return -ECANCELED;
+    if (compressed && ok) {
+        if (!gz.done()) {
+            // the device's gzip broke off; ask again without it
+            TRACE(TRACE_ERROR, "fetch: gzip stream of " << remote << " is incomplete");
+            return fetch(first, count, generation, expected, false);
+        }
+        if (gz.raw() > gz.compressed())
+            adbfsStats.add(BYTES_SAVED, gz.raw() - gz.compressed());
+        transferCompression.observe(remote, gz.raw(), gz.compressed());
+    }
+    // dd's errors go to /dev/null, so a file that can not be read or
+    // is gone only shows as a short reply; its blocks are not valid
+    off_t wanted = min((off_t)(count * REMOTE_BLOCK_SIZE), max(size - start, (off_t)0));
+    if (ok && pos - start < wanted) {
+        TRACE(TRACE_ERROR, "fetch: " << remote << " gave " << pos - start << " of "
+              << wanted << " bytes");
+        return -EIO;
+    }
+    return ok ? 0 : -EIO;
+}
+
+/**
+   Fallback for devices whose adbd has no "exec:" service: pull the
+   whole file through the sync service, if it is still the version we
+   know.  Blocks first..first+count-1 are reserved by the caller; the
+   others are entered into the cache like fetched ones, so the copy
+   counts against the budget and evicted blocks are pulled again.
+ */
+bool remote_file::fetch_all(size_t first, size_t count)
+{
+    {
+        lock_guard<mutex> guard(pull_lock);
+        stats_timer timer(adbfsStats.commands[CMD_PULL]);
+        adb_serial_scope device(cache.serial);
+        adb_sync sync;
+        sync_stat st;
+        if (!sync.connect() || !sync.stat(remote, st)) return false;
+        if (st.mode == 0 || (off_t)st.size != size || (time_t)st.mtime != mtime) {
+            TRACE(TRACE_ERROR, "fetch: " << remote << " changed on the device");
+            return false;
+        }
+        if (lseek(backing, 0, SEEK_SET) < 0 || !sync.recv(remote, backing)) return false;
+        if (lseek(backing, 0, SEEK_CUR) != size) {
+            TRACE(TRACE_ERROR, "fetch: " << remote << " changed while it was pulled");
+            return false;
+        }
+        adbfsStats.add(BYTES_PULLED, size);
+    }
+    for (size_t b = 0; b < slot.size(); ++b) {
+        if (b >= first && b < first + count) continue;
+        block_state state = cache.pin(*this, b);
+        if (state == BLOCK_IN_FLIGHT) continue;
+        if (state == BLOCK_MISSING) cache.fill(*this, b, true);
+        cache.unpin(*this, b);
+    }
+    return true;
+}
@@ -0,0 +1,351 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Long-lived "adb shell" sessions used by adb_shell().
+
+   Forking the local shell, the adb client and a fresh device shell for
+   every getattr costs tens of milliseconds.  Instead we keep a small
+   pool of device shells open and feed them framed commands on stdin.
+   Every command is followed by a printf of a per-session sentinel and
+   the exit status, so the reader thread knows where one reply ends and
+   the next begins.  Replies come back in the order the commands were
+   written, which lets several callers pipeline requests on the same
+   session.
+
+   Sessions are "shell:sh" streams opened through the adb server (see
+   adb_client.h), or "adb shell sh" child processes if the server is
+   not reachable.
+*/
+
+#include <sys/wait.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+/**
+   One command in flight on a shell_session.
+ */
+struct shell_request {
+    queue<string> output;
+    int status;
+    bool done;
+    bool failed;
+    shell_request() : status(-1), done(false), failed(false) {}
+};
+
+/**
+   Quote a string so that the device shell sees it as a single word.
+ */
+string shell_single_quote(const string& s)
+{
+    string quoted = s;
+    string_replacer(quoted, "'", "'\\''");
+    quoted.insert(0, "'");
+    quoted.append("'");
+    return quoted;
+}
+
+class shell_session {
+public:
+    /**
+       Wrap an already running device shell.
+
+       @param to_device descriptor connected to the shell's stdin.
+       @param from_device descriptor connected to the shell's stdout;
+       the same socket as to_device for a native adb connection.
+       @param pid local process owning the connection, or 0 if none.
+     */
+    shell_session(int to_device, int from_device, pid_t pid)
+        : to_device(to_device), from_device(from_device), pid(pid),
+          dead(false)
+    {
+        char buf[64];
+        snprintf(buf, sizeof buf, "ADBFS-%d-%p-%ld:",
+                 (int)getpid(), (void*)this, (long)time(NULL));
+        sentinel.assign(buf);
+        reader = thread(&shell_session::read_loop, this);
+
+        // Old adbd versions hand us a pty; switch off echo so our
+        // frames do not show up in the output.  The reply to this
+        // first frame is thrown away.
+        shell_request handshake;
+        string frame = "stty -echo 2>/dev/null; printf '\\n";
+        frame.append(sentinel);
+        frame.append(" %d\\n' 0\n");
+        submit(frame, handshake);
+    }
+
+    ~shell_session()
+    {
+        if (to_device == from_device) {
+            shutdown(to_device, SHUT_RDWR);
+        } else {
+            close(to_device);
+        }
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+        }
+        if (reader.joinable()) reader.join();
+        close(from_device);
+    }
+
+    /**
+       Run a command on the device and wait for its reply.  Other
+       callers may queue commands behind this one while it runs.
+
+       @param command device shell command line.
+       @param getStderr merge stderr into the returned output.
+       @param req receives the output lines and exit status.
+       @return false if the session died before the reply arrived.
+     */
+    bool run(const string& command, bool getStderr, shell_request& req)
+    {
+        string frame = "(eval ";
+        frame.append(shell_single_quote(command));
+        frame.append(") </dev/null");
+        if (getStderr) frame.append(" 2>&1");
+        frame.append("; printf '\\n");
+        frame.append(sentinel);
+        frame.append(" %d\\n' $?\n");
+        return submit(frame, req);
+    }
+
+    size_t in_flight()
+    {
+        lock_guard<mutex> guard(lock);
+        return pending.size();
+    }
+
+    bool is_dead()
+    {
+        lock_guard<mutex> guard(lock);
+        return dead;
+    }
+
+private:
+    int to_device;
+    int from_device;
+    pid_t pid;
+    string sentinel;
+    mutex lock;
+    mutex write_lock;       /* taken before lock, never while holding it */
+    condition_variable cond;
+    deque<shell_request*> pending;
+    bool dead;
+    thread reader;
+
+    bool submit(const string& frame, shell_request& req)
+    {
+        {
+            // Holding write_lock from the push to the end of the write
+            // keeps the order of frames on the wire identical to the
+            // order of the pending queue.  The reader only needs lock,
+            // so it keeps draining replies while a large frame is
+            // written; otherwise a shell blocked on its output would
+            // never read the rest of our frame.
+            lock_guard<mutex> writing(write_lock);
+            {
+                lock_guard<mutex> guard(lock);
+                if (dead) return false;
+                pending.push_back(&req);
+            }
+            if (!write_all(to_device, frame.data(), frame.size())) {
+                lock_guard<mutex> guard(lock);
+                fail_all();
+                return false;
+            }
+        }
+        unique_lock<mutex> guard(lock);
+        while (!req.done) cond.wait(guard);
+        return !req.failed;
+    }
+
+    /** Must be called with lock held. */
+    void fail_all()
+    {
+        dead = true;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            pending[i]->failed = true;
+            pending[i]->done = true;
+        }
+        pending.clear();
+        cond.notify_all();
+    }
+
+    void complete_line(string& line, bool& held_empty)
+    {
+        while (line.size() > 0 &&
+               (line[line.size() - 1] == '\r' || line[line.size() - 1] == '\n'))
+            line.erase(line.size() - 1);
+
+        lock_guard<mutex> guard(lock);
+        if (pending.empty()) return;     /* stray output, nobody waits for it */
+        shell_request* req = pending.front();
+        if (line.compare(0, sentinel.size(), sentinel) == 0) {
+            // The frame prints one '\n' before the sentinel; if the
+            // command's own output ended with a newline that shows up
+            // as an extra empty line, which we drop here.
+            held_empty = false;
+            req->status = atoi(line.c_str() + sentinel.size());
+            req->done = true;
+            pending.pop_front();
+            cond.notify_all();
+            return;
+        }
+        if (held_empty) req->output.push("");
+        held_empty = line.empty();
+        if (!held_empty) req->output.push(line);
+    }
+
+    void read_loop()
+    {
+        char buf[4096];
+        string line;
+        bool held_empty = false;
+        for (;;) {
+            ssize_t n = read(from_device, buf, sizeof buf);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            for (ssize_t i = 0; i < n; ++i) {
+                line.push_back(buf[i]);
+                if (buf[i] == '\n') {
+                    complete_line(line, held_empty);
+                    line.clear();
+                }
+            }
+        }
+        lock_guard<mutex> guard(lock);
+        fail_all();
+    }
+};
+
+/**
+   Open a device shell.  We ask the adb server for a "shell:sh" stream
+   directly; if the server cannot be reached (or use_server is false)
+   we start "adb shell sh" with its stdin and stdout connected to pipes.
+
+   @return the new session, or an empty pointer if adb could not be run.
+ */
+shared_ptr<shell_session> spawn_adb_shell_session(bool use_server)
+{
+    if (use_server) {
+        int fd = adb_device_service("shell:sh", NULL);
+        if (fd >= 0)
+            return shared_ptr<shell_session>(new shell_session(fd, fd, 0));
+    }
+
+    int in[2], out[2];
+    if (pipe(in) < 0) return shared_ptr<shell_session>();
+    if (pipe(out) < 0) {
+        close(in[0]); close(in[1]);
+        return shared_ptr<shell_session>();
+    }
+    // keep these out of other sessions' and popen()ed children
+    for (int i = 0; i < 2; ++i) {
+        fcntl(in[i], F_SETFD, FD_CLOEXEC);
+        fcntl(out[i], F_SETFD, FD_CLOEXEC);
+    }
+    string serial = adb_serial();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        return shared_ptr<shell_session>();
+    }
+    if (pid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        if (serial.empty()) execlp("adb", "adb", "shell", "sh", (char*)NULL);
+        else execlp("adb", "adb", "-s", serial.c_str(), "shell", "sh", (char*)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    return shared_ptr<shell_session>(new shell_session(in[1], out[0], pid));
+}
+
+/**
+   A bounded set of shell sessions.  A new session is only started when
+   every existing one already has a command in flight.
+
+   The pool is never destroyed; the adb children notice the closed pipes
+   and exit on their own when we do.
+ */
+class shell_session_pool {
+public:
+    shell_session_pool() : owner(0), starting(0) {}
+
+    /**
+       Pick the least busy live session, starting one if allowed.
+
+       @param max_sessions upper bound on the number of sessions.
+       @param use_server talk to the adb server instead of forking adb.
+       @return a session, or an empty pointer if none could be started.
+     */
+    shared_ptr<shell_session> acquire(unsigned max_sessions, bool use_server)
+    {
+        unique_lock<mutex> guard(lock);
+        if (owner != getpid()) {
+            // fuse_main daemonizes after we probed the device; the
+            // reader threads did not survive the fork, so the sessions
+            // inherited from the parent can neither be used nor safely
+            // destroyed, and those being started will never arrive.
+            // Park them and start over.
+            inherited.insert(inherited.end(), sessions.begin(), sessions.end());
+            sessions.clear();
+            starting = 0;
+            owner = getpid();
+        }
+        for (;;) {
+            shared_ptr<shell_session> best;
+            size_t best_load = 0;
+            for (size_t i = 0; i < sessions.size(); ) {
+                if (sessions[i]->is_dead()) {
+                    sessions.erase(sessions.begin() + i);
+                    continue;
+                }
+                size_t load = sessions[i]->in_flight();
+                if (!best || load < best_load) {
+                    best = sessions[i];
+                    best_load = load;
+                }
+                ++i;
+            }
+            if ((!best || best_load > 0) && sessions.size() + starting < max_sessions) {
+                // starting a session takes a round trip; reserve its slot
+                // so that other commands can use the sessions there are
+                ++starting;
+                guard.unlock();
+                shared_ptr<shell_session> fresh = spawn_adb_shell_session(use_server);
+                guard.lock();
+                --starting;
+                if (fresh && !fresh->is_dead()) {
+                    sessions.push_back(fresh);
+                    best = fresh;
+                }
+                started.notify_all();
+                return best;
+            }
+            if (best || starting == 0) return best;
+            // every slot is still starting up; wait for one of them
+            started.wait(guard);
+        }
+    }
+
+private:
+    mutex lock;
+    pid_t owner;
+    unsigned starting;      /* sessions being spawned, without the lock */
+    condition_variable started;
+    vector< shared_ptr<shell_session> > sessions;
+    vector< shared_ptr<shell_session> > inherited;
+};
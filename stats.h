@@ -0,0 +1,208 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Counters behind the /.adbfs/stats control file.
+
+   Every FUSE callback and every command sent to the device is timed
+   into a latency_histogram, and transfers and cache lookups bump
+   plain counters.  All of them are relaxed atomics, updated without
+   locks, so the instrumentation stays on permanently; a reader of the
+   stats file gets a snapshot that is consistent per counter, not
+   across counters.
+*/
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+enum adbfs_op {
+    OP_GETATTR, OP_READDIR, OP_READLINK, OP_OPEN, OP_READ, OP_WRITE,
+    OP_FLUSH, OP_FSYNC, OP_RELEASE, OP_TRUNCATE, OP_UTIMENS, OP_MKNOD,
+    OP_MKDIR, OP_RENAME, OP_RMDIR, OP_UNLINK, OP_COUNT
+};
+
+static const char* const OP_NAMES[OP_COUNT] = {
+    "getattr", "readdir", "readlink", "open", "read", "write",
+    "flush", "fsync", "release", "truncate", "utimens", "mknod",
+    "mkdir", "rename", "rmdir", "unlink"
+};
+
+/** Kinds of device commands, by what they do. */
+enum adbfs_command {
+    CMD_LS, CMD_FIND, CMD_MV, CMD_RM, CMD_MKDIR, CMD_RMDIR, CMD_TOUCH,
+    CMD_SYNC, CMD_RESCAN, CMD_DD, CMD_STAT, CMD_LIST, CMD_PULL, CMD_PUSH,
+    CMD_OTHER, CMD_COUNT
+};
+
+static const char* const COMMAND_NAMES[CMD_COUNT] = {
+    "ls", "find", "mv", "rm", "mkdir", "rmdir", "touch",
+    "sync", "rescan", "dd (read)", "sync STAT", "sync LIST", "pull", "push",
+    "other"
+};
+
+enum adbfs_counter {
+    BYTES_PULLED, BYTES_PUSHED, BYTES_FETCHED, BYTES_SAVED,
+    ATTR_HITS, ATTR_MISSES, ATTR_EXPIRED,
+    LISTING_HITS, LISTING_MISSES, NEGATIVE_HITS,
+    LOOKUPS_BATCHED, LOOKUPS_MERGED, FILES_FETCHED_AHEAD, PULLS_SKIPPED,
+    RANGED_WRITES, PUSHES_ELIDED,
+    COUNTER_COUNT
+};
+
+static const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+    "bytes pulled", "bytes pushed", "bytes read on demand",
+    "bytes saved by compression",
+    "attribute cache hits", "attribute cache misses", "attribute cache expired",
+    "listing cache hits", "listing cache misses", "negative cache hits",
+    "lookups sent in batches", "lookups merged", "files fetched ahead",
+    "pulls skipped", "ranged writes", "pushes skipped as unchanged"
+};
+
+/**
+   Call count and a histogram of durations in power-of-two buckets of
+   microseconds.
+ */
+class latency_histogram {
+public:
+    static const int BUCKETS = 32;
+
+    latency_histogram() : calls(0), total_us(0)
+    {
+        for (int i = 0; i < BUCKETS; ++i) buckets[i] = 0;
+    }
+
+    void record(uint64_t us)
+    {
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && (us >> bucket) > 1) ++bucket;
+        buckets[bucket].fetch_add(1, memory_order_relaxed);
+        calls.fetch_add(1, memory_order_relaxed);
+        total_us.fetch_add(us, memory_order_relaxed);
+    }
+
+    uint64_t count() const { return calls.load(memory_order_relaxed); }
+    uint64_t total() const { return total_us.load(memory_order_relaxed); }
+
+    /**
+       @param fraction e.g. 0.99.
+       @return the upper bound, in microseconds, of the bucket that
+       holds that fraction of the calls.
+     */
+    uint64_t percentile(double fraction) const
+    {
+        uint64_t counts[BUCKETS], sum = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            counts[i] = buckets[i].load(memory_order_relaxed);
+            sum += counts[i];
+        }
+        if (sum == 0) return 0;
+        uint64_t rank = (uint64_t)(fraction * sum + 0.5), seen = 0;
+        if (rank < 1) rank = 1;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) return (uint64_t)2 << i;
+        }
+        return (uint64_t)2 << (BUCKETS - 1);
+    }
+
+private:
+    atomic<uint64_t> calls;
+    atomic<uint64_t> total_us;
+    atomic<uint64_t> buckets[BUCKETS];
+};
+
+/**
+   Times the scope it lives in into a histogram.
+ */
+class stats_timer {
+public:
+    stats_timer(latency_histogram& histogram)
+        : histogram(histogram), start(chrono::steady_clock::now()) {}
+
+    ~stats_timer()
+    {
+        histogram.record(chrono::duration_cast<chrono::microseconds>(
+                             chrono::steady_clock::now() - start).count());
+    }
+
+private:
+    latency_histogram& histogram;
+    chrono::steady_clock::time_point start;
+};
+
+struct adbfs_stats {
+    latency_histogram ops[OP_COUNT];
+    latency_histogram commands[CMD_COUNT];
+    atomic<uint64_t> counters[COUNTER_COUNT];
+
+    adbfs_stats()
+    {
+        for (int i = 0; i < COUNTER_COUNT; ++i) counters[i] = 0;
+    }
+
+    void add(adbfs_counter counter, uint64_t n = 1)
+    {
+        counters[counter].fetch_add(n, memory_order_relaxed);
+    }
+
+    /** The kind of a shell command, from its first word. */
+    static adbfs_command classify(const string& command)
+    {
+        size_t start = command.find_first_not_of(" ");
+        size_t end = command.find_first_of(" ;", start);
+        string verb = start == string::npos ? string()
+            : command.substr(start, end == string::npos ? string::npos : end - start);
+        if (verb == "ls") return CMD_LS;
+        if (verb == "find") return CMD_FIND;
+        if (verb == "mv") return CMD_MV;
+        if (verb == "rm") return CMD_RM;
+        if (verb == "mkdir") return CMD_MKDIR;
+        if (verb == "rmdir") return CMD_RMDIR;
+        if (verb == "touch") return CMD_TOUCH;
+        if (verb == "sync") return CMD_SYNC;
+        if (verb == "am") return CMD_RESCAN;
+        if (verb == "dd") return CMD_DD;
+        return CMD_OTHER;
+    }
+
+    /** The counters as text, one table per kind, skipping idle rows. */
+    string render() const
+    {
+        ostringstream out;
+        out << "operation          calls   p50 us   p99 us   total ms\n";
+        for (int i = 0; i < OP_COUNT; ++i) row(out, OP_NAMES[i], ops[i]);
+        out << "\ncommand            calls   p50 us   p99 us   total ms\n";
+        for (int i = 0; i < CMD_COUNT; ++i) row(out, COMMAND_NAMES[i], commands[i]);
+        out << "\n";
+        for (int i = 0; i < COUNTER_COUNT; ++i)
+            out << COUNTER_NAMES[i] << ": " << counters[i].load(memory_order_relaxed) << "\n";
+        return out.str();
+    }
+
+private:
+    static void row(ostringstream& out, const char* name, const latency_histogram& h)
+    {
+        if (h.count() == 0) return;
+        char line[128];
+        snprintf(line, sizeof line, "%-14s %9llu %8llu %8llu %10.1f\n", name,
+                 (unsigned long long)h.count(),
+                 (unsigned long long)h.percentile(0.5),
+                 (unsigned long long)h.percentile(0.99),
+                 h.total() / 1000.0);
+        out << line;
+    }
+};
+
+/**
+   The one set of counters of this process.
+ */
+adbfs_stats adbfsStats;
@@ -0,0 +1,140 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   State shared by the FUSE callbacks, which fuse_main runs on several
+   threads at once.
+
+   A striped_map spreads its entries over a fixed number of shards by
+   the hash of the key, each shard with its own mutex, so that callbacks
+   working on different paths or handles hardly ever wait for each
+   other.  Values are copied in and out; no reference into the map is
+   ever used without holding the shard's lock.
+
+   A striped_lock is a fixed set of mutexes picked the same way, for
+   serializing operations on one path (such as the pull, push and
+   removal of its local copy) without a lock per path.
+*/
+
+#include <functional>
+#include <map>
+#include <mutex>
+
+using namespace std;
+
+template <class K, class V, size_t SHARDS = 16>
+class striped_map {
+public:
+    /** @return false if there is no entry for key. */
+    bool get(const K& key, V& value)
+    {
+        shard& s = shard_for(key);
+        lock_guard<mutex> guard(s.lock);
+        typename map<K, V>::iterator it = s.entries.find(key);
+        if (it == s.entries.end()) return false;
+        value = it->second;
+        return true;
+    }
+
+    /** @return the entry for key, or a default constructed V. */
+    V get(const K& key)
+    {
+        V value = V();
+        get(key, value);
+        return value;
+    }
+
+    bool contains(const K& key)
+    {
+        shard& s = shard_for(key);
+        lock_guard<mutex> guard(s.lock);
+        return s.entries.count(key) > 0;
+    }
+
+    void set(const K& key, const V& value)
+    {
+        shard& s = shard_for(key);
+        lock_guard<mutex> guard(s.lock);
+        s.entries[key] = value;
+    }
+
+    /** @return false if there was no entry for key. */
+    bool erase(const K& key)
+    {
+        shard& s = shard_for(key);
+        lock_guard<mutex> guard(s.lock);
+        return s.entries.erase(key) > 0;
+    }
+
+    /**
+       Remove the entry for key, handing it to the caller.
+
+       @return false if there was no entry for key.
+     */
+    bool take(const K& key, V& value)
+    {
+        shard& s = shard_for(key);
+        lock_guard<mutex> guard(s.lock);
+        typename map<K, V>::iterator it = s.entries.find(key);
+        if (it == s.entries.end()) return false;
+        value = it->second;
+        s.entries.erase(it);
+        return true;
+    }
+
+    /**
+       Apply f to the entry for key under the shard lock, creating a
+       default constructed entry first if there is none.  f must not
+       touch the map.
+     */
+    template <class F> void update(const K& key, F f)
+    {
+        shard& s = shard_for(key);
+        lock_guard<mutex> guard(s.lock);
+        typename map<K, V>::iterator it = s.entries.find(key);
+        if (it == s.entries.end()) it = s.entries.insert(make_pair(key, V())).first;
+        f(it->second);
+    }
+
+    /**
+       Apply f(key, value) to every entry, one shard locked at a time.
+       f must not touch the map.
+     */
+    template <class F> void update_all(F f)
+    {
+        for (size_t i = 0; i < SHARDS; ++i) {
+            lock_guard<mutex> guard(shards[i].lock);
+            for (typename map<K, V>::iterator it = shards[i].entries.begin();
+                 it != shards[i].entries.end(); ++it)
+                f(it->first, it->second);
+        }
+    }
+
+private:
+    struct shard {
+        mutex lock;
+        map<K, V> entries;
+    };
+    shard shards[SHARDS];
+
+    shard& shard_for(const K& key)
+    {
+        return shards[hash<K>()(key) % SHARDS];
+    }
+};
+
+template <size_t STRIPES = 64>
+class striped_lock {
+public:
+    mutex& operator[](const string& key)
+    {
+        return locks[hash<string>()(key) % STRIPES];
+    }
+
+private:
+    mutex locks[STRIPES];
+};
@@ -0,0 +1,238 @@
+/*
+   Protocol-level tests for adb_client.h.  Run through tests/protocol.sh,
+   which starts tests/fake_adb_server.py and points
+   ANDROID_ADB_SERVER_PORT at it.
+*/
+
+#include "../adb_client.h"
+#include <fcntl.h>
+#include <iostream>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            cout << "FAIL " << __FILE__ << ":" << __LINE__ << ": " #cond << endl; \
+            ++failures; \
+        } \
+    } while (0)
+
+static void test_host_query()
+{
+    string reply, error;
+    CHECK(adb_query("host:version", reply, &error));
+    CHECK(reply == "0029");
+    CHECK(!adb_query("host:no-such-service", reply, &error));
+    CHECK(error.find("unknown service") != string::npos);
+}
+
+static void test_features()
+{
+    string features;
+    CHECK(adb_device_features(features));
+    CHECK(adb_has_feature(features, "stat_v2"));
+    CHECK(adb_has_feature(features, "ls_v2"));
+    CHECK(!adb_has_feature(features, "ls"));
+}
+
+static void test_devices()
+{
+    vector<string> serials = adb_parse_devices("b2\tdevice\nzz\toffline\na1\tdevice\n");
+    CHECK(serials.size() == 2 && serials[0] == "a1" && serials[1] == "b2");
+
+    string reply;
+    CHECK(adb_devices(serials));
+    CHECK(serials.size() == 1 && serials[0] == "fake0001");
+
+    int fd = adb_server_connect();
+    CHECK(fd >= 0 && adb_request(fd, "host:track-devices", NULL));
+    CHECK(adb_read_payload(fd, reply) && reply == "fake0001\tdevice\n");
+    CHECK(adb_query("host:fake-attach:fake0002", reply, NULL));
+    CHECK(adb_read_payload(fd, reply));
+    CHECK(adb_parse_devices(reply).size() == 2);
+    close(fd);
+
+    {
+        adb_serial_scope scope("fake0002");
+        string output;
+        CHECK(adb_exec("echo $ADB_FAKE_SERIAL", output));
+        CHECK(output == "fake0002\n");
+    }
+    CHECK(adb_query("host:fake-detach:fake0002", reply, NULL));
+    {
+        adb_serial_scope scope("fake0002");
+        string output;
+        CHECK(!adb_exec("true", output));
+    }
+}
+
+static void test_exec_is_binary_safe()
+{
+    string output;
+    CHECK(adb_exec("printf 'a\\000b\\r\\n'", output));
+    CHECK(output == string("a\0b\r\n", 5));
+}
+
+static void test_exec_lines()
+{
+    vector<string> lines;
+    CHECK(adb_exec_lines("printf 'one\\ntwo\\n\\nlast'",
+                         [&](const string& line) { lines.push_back(line); }));
+    CHECK(lines.size() == 4 && lines[0] == "one" && lines[1] == "two"
+          && lines[2] == "" && lines[3] == "last");
+
+    // more than one read's worth
+    size_t count = 0;
+    CHECK(adb_exec_lines("seq 1 100000", [&](const string& line) {
+        if (line == to_string(count + 1)) ++count;
+    }));
+    CHECK(count == 100000);
+}
+
+static void test_shell_stream()
+{
+    int fd = adb_device_service("shell:sh", NULL);
+    CHECK(fd >= 0);
+    if (fd < 0) return;
+    const char script[] = "echo one\necho two\nexit\n";
+    CHECK(write_all(fd, script, sizeof script - 1));
+    string output;
+    char buf[256];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) > 0) output.append(buf, n);
+    close(fd);
+    CHECK(output == "one\ntwo\n");
+}
+
+static void test_sync_round_trip(const string& root)
+{
+    adb_sync sync;
+    CHECK(sync.connect());
+
+    string local = root + "/../local-source";
+    int fd = open(local.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    string content(200000, 'x');
+    content[12345] = '\0';
+    CHECK(write_all(fd, content.data(), content.size()));
+    lseek(fd, 0, SEEK_SET);
+    string error;
+    CHECK(sync.send("/pushed.bin", S_IFREG | 0640, fd, 1234567890, &error));
+    close(fd);
+
+    sync_stat st;
+    CHECK(sync.stat("/pushed.bin", st));
+    CHECK(S_ISREG(st.mode));
+    CHECK((st.mode & 0777) == 0640);
+    CHECK(st.size == content.size());
+    CHECK(st.mtime == 1234567890);
+
+    CHECK(sync.stat("/missing", st));
+    CHECK(st.mode == 0);
+
+    vector<sync_dirent> entries;
+    CHECK(sync.list("/", entries));
+    bool found = false;
+    for (size_t i = 0; i < entries.size(); ++i)
+        if (entries[i].name == "pushed.bin") found = entries[i].st.size == content.size();
+    CHECK(found);
+
+    string pulled = root + "/../local-copy";
+    fd = open(pulled.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CHECK(sync.recv("/pushed.bin", fd, &error));
+    string back(content.size() + 1, '\0');
+    CHECK(pread(fd, &back[0], back.size(), 0) == (ssize_t)content.size());
+    back.resize(content.size());
+    CHECK(back == content);
+    close(fd);
+
+    CHECK(sync.stat_v2("/pushed.bin", st));
+    CHECK(st.error == 0);
+    CHECK(st.size == content.size());
+    CHECK(st.mtime == 1234567890);
+    CHECK(st.nlink == 1);
+    CHECK(sync.stat_v2("/missing", st));
+    CHECK(st.error == ENOENT);
+
+    vector<string> paths;
+    paths.push_back("/missing");
+    paths.push_back("/pushed.bin");
+    paths.push_back("/");
+    for (int v2 = 0; v2 < 2; ++v2) {
+        vector<sync_stat> many;
+        CHECK(sync.stat_many(paths, v2, many));
+        CHECK(many.size() == 3);
+        CHECK(many[0].mode == 0);
+        CHECK(S_ISREG(many[1].mode) && many[1].size == content.size());
+        CHECK(S_ISDIR(many[2].mode));
+    }
+
+    entries.clear();
+    CHECK(sync.list_v2("/", entries));
+    found = false;
+    for (size_t i = 0; i < entries.size(); ++i)
+        if (entries[i].name == "pushed.bin") found = entries[i].st.size == content.size();
+    CHECK(found);
+    CHECK(entries.size() == 3);
+
+    // a local read error fails the push, and the connection survives
+    int dir_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+    error.clear();
+    CHECK(!sync.send("/unreadable.bin", S_IFREG | 0640, dir_fd, 1234567890, &error));
+    CHECK(error == strerror(EISDIR));
+    CHECK(sync.connected());
+    close(dir_fd);
+
+    error.clear();
+    fd = open(pulled.c_str(), O_RDWR | O_TRUNC);
+    CHECK(!sync.recv("/missing", fd, &error));
+    CHECK(!error.empty());
+    CHECK(sync.connected());
+    close(fd);
+}
+
+static void test_streamed_send(const string& root)
+{
+    adb_sync sync;
+    CHECK(sync.connect());
+
+    string content;
+    for (int i = 0; content.size() < 300000; ++i) content.append(1, 'a' + i % 26);
+    CHECK(sync.send_begin("/streamed.bin", S_IFREG | 0600));
+    // pieces of uneven size, one larger than a DATA packet
+    CHECK(sync.send_data(content.data(), 10));
+    CHECK(sync.send_data(content.data() + 10, 100000));
+    CHECK(sync.send_data(content.data() + 100010, content.size() - 100010));
+    string error;
+    CHECK(sync.send_end(1234567890, &error));
+
+    sync_stat st;
+    CHECK(sync.stat("/streamed.bin", st));
+    CHECK(st.size == content.size());
+    CHECK(st.mtime == 1234567890);
+
+    string pulled = root + "/../local-copy";
+    int fd = open(pulled.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CHECK(sync.recv("/streamed.bin", fd, &error));
+    string back(content.size(), '\0');
+    CHECK(pread(fd, &back[0], back.size(), 0) == (ssize_t)content.size());
+    CHECK(back == content);
+    close(fd);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        cout << "usage: adb_client_test <device root>" << endl;
+        return 2;
+    }
+    test_host_query();
+    test_features();
+    test_devices();
+    test_exec_is_binary_safe();
+    test_exec_lines();
+    test_shell_stream();
+    test_sync_round_trip(argv[1]);
+    test_streamed_send(argv[1]);
+    cout << (failures ? "FAIL" : "PASS") << " adb_client_test" << endl;
+    return failures ? 1 : 0;
+}
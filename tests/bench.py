@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""
+Time file system operations on an adbfs mount.  Run through
+tests/bench.sh, which provides a fake device to mount.
+
+Usage: bench.py <mount point> <device root> [--files N] [--size MB]
+
+The device root is the host directory the fake device serves; test
+files are put there directly, so that setting up does not go through
+adbfs.  Each operation runs for about a second (at least once) and is
+reported in operations or MB per second.
+"""
+
+import argparse
+import os
+import shutil
+import sys
+import time
+
+SECONDS = 1.0
+
+
+def rate(op, minimum=1):
+    """Run op() repeatedly for SECONDS; return calls per second."""
+    count = 0
+    start = time.monotonic()
+    while True:
+        op(count)
+        count += 1
+        elapsed = time.monotonic() - start
+        if count >= minimum and elapsed >= SECONDS:
+            return count / elapsed
+
+
+def report(name, value, unit):
+    print("%-22s %12.1f %s" % (name, value, unit), flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("mount")
+    parser.add_argument("device")
+    parser.add_argument("--files", type=int, default=200)
+    parser.add_argument("--size", type=int, default=32, help="MB")
+    args = parser.parse_args()
+
+    name = "bench-%d" % os.getpid()
+    device_dir = os.path.join(args.device, name)
+    mount_dir = os.path.join(args.mount, name)
+    os.mkdir(device_dir)
+    try:
+        small = ["file-%04d" % i for i in range(args.files)]
+        for f in small:
+            with open(os.path.join(device_dir, f), "wb") as out:
+                out.write(b"x" * 1000)
+        big = os.path.join(device_dir, "big")
+        block = bytes(range(256)) * 4096
+        with open(big, "wb") as out:
+            for _ in range(args.size):
+                out.write(block)
+        # what compression cannot shrink
+        noise = os.path.join(device_dir, "noise")
+        with open(noise, "wb") as out:
+            for _ in range(args.size):
+                out.write(os.urandom(len(block)))
+
+        paths = [os.path.join(mount_dir, f) for f in small]
+
+        report("getattr", rate(lambda i: os.stat(paths[i % len(paths)])), "ops/s")
+        report("readdir", rate(lambda i: os.listdir(mount_dir)), "ops/s")
+        report("getattr (missing)",
+               rate(lambda i: os.path.exists(os.path.join(mount_dir, ".hidden%d" % (i % 10)))),
+               "ops/s")
+
+        def open_close(i):
+            with open(paths[i % len(paths)], "rb") as f:
+                f.read(1)
+        report("open+read+close", rate(open_close), "ops/s")
+
+        def read_all(path):
+            start = time.monotonic()
+            total = 0
+            with open(path, "rb") as f:
+                while True:
+                    data = f.read(1 << 20)
+                    if not data:
+                        break
+                    total += len(data)
+            return total / (1 << 20) / (time.monotonic() - start)
+        report("sequential read", read_all(os.path.join(mount_dir, "big")), "MB/s")
+        report("sequential read again", read_all(os.path.join(mount_dir, "big")), "MB/s")
+        report("sequential read, random", read_all(os.path.join(mount_dir, "noise")), "MB/s")
+
+        written = os.path.join(mount_dir, "written")
+        start = time.monotonic()
+        with open(written, "wb") as f:
+            for _ in range(args.size):
+                f.write(block)
+        report("sequential write", args.size / (time.monotonic() - start), "MB/s")
+
+        def rename(i):
+            a, b = paths[i % len(paths)], paths[i % len(paths)] + ".renamed"
+            os.rename(a, b)
+            os.rename(b, a)
+        report("rename", 2 * rate(rename), "ops/s")
+
+        def create_unlink(i):
+            path = os.path.join(mount_dir, "new-%d" % i)
+            with open(path, "wb") as f:
+                f.write(b"y" * 1000)
+            os.unlink(path)
+        report("create+write+unlink", rate(create_unlink), "ops/s")
+    finally:
+        shutil.rmtree(device_dir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
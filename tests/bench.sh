@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# Mount adbfs on top of tests/fake_adb_server.py and time it with
+# tests/bench.py.  Needs FUSE, but no phone.
+# Usage: tests/bench.sh <adbfs binary> [adbfs options]...
+#
+# The fake device answers each request after LATENCY milliseconds
+# (default 2) and moves data at BANDWIDTH KB/s (default 30000, about
+# what USB 2 gives adb).  BENCH_ARGS is passed on to bench.py.
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+ADBFS=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+WORK_DIR=$(mktemp -d /tmp/adbfs-bench-XXXXXX)
+mkdir -p "$WORK_DIR/device" "$WORK_DIR/mnt"
+
+# Shell commands run on the fake device see the host's file system, so
+# the device's root is the host's, and the benchmark runs in our corner
+# of it.
+coproc SERVER { exec python3 "$TESTS_DIR/fake_adb_server.py" --port 0 \
+  --root / --latency "${LATENCY:-2}" --bandwidth "${BANDWIDTH:-30000}"; }
+read -r PORT <&"${SERVER[0]}"
+
+unmount() {
+  fusermount -u "$WORK_DIR/mnt" 2> /dev/null || umount "$WORK_DIR/mnt" 2> /dev/null
+}
+
+cleanup() {
+  unmount
+  [ -n "$ADBFS_PID" ] && wait "$ADBFS_PID" 2> /dev/null
+  kill "$SERVER_PID" 2> /dev/null
+  rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+if [ -z "$PORT" ]
+then
+  echo "fake adb server did not start"
+  exit 1
+fi
+export ANDROID_ADB_SERVER_PORT=$PORT
+unset ANDROID_SERIAL
+
+"$ADBFS" -f "$@" "$WORK_DIR/mnt" > "$WORK_DIR/adbfs.log" 2>&1 &
+ADBFS_PID=$!
+for i in $(seq 50)
+do
+  [ -d "$WORK_DIR/mnt/$WORK_DIR/device" ] && break
+  sleep 0.1
+done
+if [ ! -d "$WORK_DIR/mnt/$WORK_DIR/device" ]
+then
+  echo "adbfs did not mount; see below"
+  tail -20 "$WORK_DIR/adbfs.log"
+  exit 1
+fi
+
+echo "latency ${LATENCY:-2} ms, bandwidth ${BANDWIDTH:-30000} KB/s, adbfs $*"
+python3 "$TESTS_DIR/bench.py" "$WORK_DIR/mnt$WORK_DIR/device" "$WORK_DIR/device" $BENCH_ARGS
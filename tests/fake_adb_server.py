@@ -0,0 +1,428 @@
+#!/usr/bin/env python3
+"""
+A stand-in for the adb server, good enough to exercise adb_client.h
+and to mount adbfs without a phone.
+
+It accepts the smart-socket requests adbfs sends (host:version,
+host:features, host:transport*, shell:, exec:, sync:) and serves a host
+directory as the device's root file system.  Shell and exec commands run
+through the local /bin/sh with the device root as working directory.
+With GNU ls on the host, "ls -l" prints dates the way toybox does
+(2012-06-22 02:16), so adbfs' ls parser sees what it sees on a phone.
+
+--devices names the attached devices; all of them serve the same root.
+"host:fake-attach:<serial>" and "host:fake-detach:<serial>" plug devices
+in and out, for testing "host:track-devices".  Shell and exec commands
+see the serial they were sent to as $ADB_FAKE_SERIAL.
+"host:fake-exec:off" refuses "exec:" from then on, as adbd before
+Android 5 did, and "host:fake-exec:on" accepts it again.
+
+--latency and --bandwidth make it behave like a device at the end of a
+USB cable: every service request, sync request and chunk of shell input
+waits the given number of milliseconds, and all data, both ways, shares
+a link of the given number of KB/s.
+
+Usage: fake_adb_server.py [--port N] [--root DIR] [--features LIST]
+                          [--devices LIST] [--latency MS] [--bandwidth KBPS]
+
+With --port 0 the chosen port is printed on stdout.
+"""
+
+import argparse
+import atexit
+import os
+import shutil
+import signal
+import socketserver
+import stat
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+SYNC_DATA_MAX = 64 * 1024
+
+
+def stat_v2(path):
+    """The part of an LST2/DNT2 record after the id."""
+    try:
+        st = os.lstat(path)
+    except OSError as e:
+        return struct.pack("<IQQIIIIQqqq", e.errno, 0, 0, 0, 0, 0, 0, 0,
+                           0, 0, 0)
+    return struct.pack("<IQQIIIIQqqq", 0, st.st_dev, st.st_ino, st.st_mode,
+                       st.st_nlink, st.st_uid, st.st_gid, st.st_size,
+                       int(st.st_atime), int(st.st_mtime), int(st.st_ctime))
+
+
+class Link:
+    """A client connection, slowed down to the configured device link."""
+
+    def __init__(self, sock, server):
+        self.sock = sock
+        self.server = server
+
+    def fileno(self):
+        return self.sock.fileno()
+
+    def recv(self, n):
+        data = self.sock.recv(n)
+        self.server.transfer(len(data))
+        return data
+
+    def sendall(self, data):
+        self.server.transfer(len(data))
+        self.sock.sendall(data)
+
+
+def read_exact(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def okay(sock, payload=None):
+    sock.sendall(b"OKAY")
+    if payload is not None:
+        sock.sendall(b"%04x" % len(payload) + payload)
+
+
+def fail(sock, message):
+    message = message.encode()
+    sock.sendall(b"FAIL" + b"%04x" % len(message) + message)
+
+
+class Handler(socketserver.BaseRequestHandler):
+
+    def device_path(self, path):
+        path = path.decode("utf-8", "surrogateescape")
+        # Shell commands see the host's file system, so a client that
+        # mixes shell and sync requests uses host paths inside the root;
+        # those are taken as they are.
+        if path == self.server.root or \
+                path.startswith(self.server.root.rstrip("/") + "/"):
+            return path
+        return os.path.join(self.server.root, path.lstrip("/"))
+
+    def handle(self):
+        self.serial = None
+        sock = Link(self.request, self.server)
+        try:
+            while True:
+                length = int(read_exact(sock, 4), 16)
+                service = read_exact(sock, length).decode()
+                self.server.delay()
+                if not self.dispatch(sock, service):
+                    return
+        except (EOFError, ConnectionError):
+            return
+
+    def dispatch(self, sock, service):
+        """Return True if the connection expects another request."""
+        if service == "host:version":
+            okay(sock, b"0029")
+        elif service.startswith("host:transport:"):
+            return self.transport(sock, service[len("host:transport:"):])
+        elif service.startswith("host-serial:") and \
+                service.endswith(":transport"):
+            return self.transport(sock, service.split(":")[1])
+        elif service.startswith("host:transport"):
+            return self.transport(sock, None)
+        elif service.startswith("host-serial:") and \
+                service.endswith(":features"):
+            if service.split(":")[1] not in self.server.devices:
+                fail(sock, "device not found")
+            else:
+                okay(sock, self.server.features.encode())
+        elif service == "host:features":
+            okay(sock, self.server.features.encode())
+        elif service == "host:devices":
+            okay(sock, self.server.device_list())
+        elif service == "host:track-devices":
+            okay(sock)
+            self.track(sock)
+        elif service.startswith("host:fake-attach:") or \
+                service.startswith("host:fake-detach:"):
+            self.server.plug(service.split(":")[2],
+                             service.startswith("host:fake-attach:"))
+            okay(sock, b"")
+        elif service.startswith("host:fake-exec:"):
+            self.server.exec_enabled = service.endswith(":on")
+            okay(sock, b"")
+        elif service.startswith("exec:") and not self.server.exec_enabled:
+            fail(sock, "closed")
+        elif service.startswith("shell:") or service.startswith("exec:"):
+            command = service.split(":", 1)[1]
+            okay(sock)
+            self.run(sock, command, service.startswith("shell:"))
+        elif service == "sync:":
+            okay(sock)
+            self.sync(sock)
+        else:
+            fail(sock, "unknown service " + service)
+        return False
+
+    def transport(self, sock, serial):
+        """Bind the connection to a device; None for any device."""
+        with self.server.devices_changed:
+            devices = list(self.server.devices)
+        if serial is None and devices:
+            serial = devices[0]
+        if serial not in devices:
+            fail(sock, "device '%s' not found" % serial)
+            return False
+        self.serial = serial
+        okay(sock)
+        return True
+
+    def track(self, sock):
+        sent = None
+        while True:
+            with self.server.devices_changed:
+                while self.server.device_list() == sent:
+                    self.server.devices_changed.wait()
+                sent = self.server.device_list()
+            try:
+                sock.sendall(b"%04x" % len(sent) + sent)
+            except OSError:
+                return  # the client stopped tracking
+
+    def run(self, sock, command, merge_stderr):
+        fd = sock.fileno()
+        env = dict(self.server.env, ADB_FAKE_SERIAL=self.serial or "")
+        if not self.server.slow():
+            subprocess.call(["/bin/sh", "-c", command or "sh"],
+                            cwd=self.server.root, env=env,
+                            stdin=fd, stdout=fd,
+                            stderr=fd if merge_stderr else subprocess.DEVNULL)
+            return
+
+        # relay both ways, so that input and output take the slow link
+        proc = subprocess.Popen(
+            ["/bin/sh", "-c", command or "sh"], cwd=self.server.root,
+            env=env, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT if merge_stderr else subprocess.DEVNULL)
+
+        def feed():
+            try:
+                while True:
+                    data = sock.recv(SYNC_DATA_MAX)
+                    if not data:
+                        break
+                    self.server.delay()
+                    proc.stdin.write(data)
+                    proc.stdin.flush()
+            except (OSError, ValueError):
+                pass
+            try:
+                proc.stdin.close()
+            except OSError:
+                pass
+
+        threading.Thread(target=feed, daemon=True).start()
+        try:
+            while True:
+                data = proc.stdout.read1(SYNC_DATA_MAX)
+                if not data:
+                    break
+                sock.sendall(data)
+        except OSError:
+            proc.kill()
+        proc.wait()
+
+    def sync(self, sock):
+        while True:
+            header = read_exact(sock, 8)
+            cmd, length = header[:4], struct.unpack("<I", header[4:])[0]
+            if cmd == b"QUIT":
+                return
+            arg = read_exact(sock, length)
+            self.server.delay()
+            if cmd == b"STAT":
+                try:
+                    st = os.lstat(self.device_path(arg))
+                    reply = (st.st_mode, st.st_size & 0xffffffff,
+                             int(st.st_mtime))
+                except OSError:
+                    reply = (0, 0, 0)
+                sock.sendall(b"STAT" + struct.pack("<III", *reply))
+            elif cmd in (b"LST2", b"STA2"):
+                sock.sendall(b"LST2" + stat_v2(self.device_path(arg)))
+            elif cmd == b"LIST":
+                self.list(sock, self.device_path(arg))
+            elif cmd == b"LIS2":
+                self.list_v2(sock, self.device_path(arg))
+            elif cmd == b"RECV":
+                self.recv(sock, self.device_path(arg))
+            elif cmd == b"SEND":
+                path, _, mode = arg.rpartition(b",")
+                self.send(sock, self.device_path(path), int(mode))
+            else:
+                sock.sendall(b"FAIL" + struct.pack("<I", 7) + b"bad cmd")
+                return
+
+    def list(self, sock, path):
+        try:
+            names = [".", ".."] + sorted(os.listdir(path))
+        except OSError:
+            names = []
+        for name in names:
+            try:
+                st = os.lstat(os.path.join(path, name))
+            except OSError:
+                continue
+            raw = name.encode("utf-8", "surrogateescape")
+            sock.sendall(b"DENT" + struct.pack(
+                "<IIII", st.st_mode, st.st_size & 0xffffffff,
+                int(st.st_mtime), len(raw)) + raw)
+        sock.sendall(b"DONE" + struct.pack("<IIII", 0, 0, 0, 0))
+
+    def list_v2(self, sock, path):
+        try:
+            names = [".", ".."] + sorted(os.listdir(path))
+        except OSError:
+            names = []
+        for name in names:
+            raw = name.encode("utf-8", "surrogateescape")
+            sock.sendall(b"DNT2" + stat_v2(os.path.join(path, name)) +
+                         struct.pack("<I", len(raw)) + raw)
+        sock.sendall(b"DONE" + bytes(72))
+
+    def recv(self, sock, path):
+        try:
+            with open(path, "rb") as f:
+                while True:
+                    data = f.read(SYNC_DATA_MAX)
+                    if not data:
+                        break
+                    sock.sendall(b"DATA" + struct.pack("<I", len(data)) + data)
+        except OSError as e:
+            message = e.strerror.encode()
+            sock.sendall(b"FAIL" + struct.pack("<I", len(message)) + message)
+            return
+        sock.sendall(b"DONE" + struct.pack("<I", 0))
+
+    def send(self, sock, path, mode):
+        data = b""
+        while True:
+            header = read_exact(sock, 8)
+            cmd, length = header[:4], struct.unpack("<I", header[4:])[0]
+            if cmd == b"DATA":
+                data += read_exact(sock, length)
+            elif cmd == b"DONE":
+                mtime = length
+                break
+            else:
+                raise EOFError
+        try:
+            with open(path, "wb") as f:
+                f.write(data)
+            os.chmod(path, stat.S_IMODE(mode))
+            os.utime(path, (mtime, mtime))
+        except OSError as e:
+            message = e.strerror.encode()
+            sock.sendall(b"FAIL" + struct.pack("<I", len(message)) + message)
+            return
+        sock.sendall(b"OKAY" + struct.pack("<I", 0))
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+    latency = 0.0       # seconds per request
+    bandwidth = 0       # bytes per second; 0 means unlimited
+    exec_enabled = True
+    env = None
+
+    def __init__(self, *args):
+        socketserver.ThreadingTCPServer.__init__(self, *args)
+        self.link_lock = threading.Lock()
+        self.link_free = 0.0
+        self.devices = []
+        self.devices_changed = threading.Condition()
+
+    def device_list(self):
+        with self.devices_changed:
+            return b"".join(b"%s\tdevice\n" % serial.encode()
+                            for serial in self.devices)
+
+    def plug(self, serial, attach):
+        with self.devices_changed:
+            if attach and serial not in self.devices:
+                self.devices.append(serial)
+            elif not attach and serial in self.devices:
+                self.devices.remove(serial)
+            self.devices_changed.notify_all()
+
+    def slow(self):
+        return self.latency > 0 or self.bandwidth > 0
+
+    def delay(self):
+        if self.latency > 0:
+            time.sleep(self.latency)
+
+    def transfer(self, n):
+        """Wait for n bytes to cross the link, behind earlier transfers."""
+        if self.bandwidth <= 0 or n == 0:
+            return
+        with self.link_lock:
+            now = time.monotonic()
+            self.link_free = max(now, self.link_free) + n / self.bandwidth
+            wait = self.link_free - now
+        time.sleep(wait)
+
+
+def toybox_ls_env():
+    """An environment whose ls prints toybox style dates, if GNU ls is used."""
+    env = dict(os.environ)
+    try:
+        gnu = b"GNU" in subprocess.run(["ls", "--version"], capture_output=True).stdout
+    except OSError:
+        gnu = False
+    if not gnu:
+        return env
+    shims = tempfile.mkdtemp(prefix="fake-adb-")
+    atexit.register(shutil.rmtree, shims, True)
+    real_ls = subprocess.run(["sh", "-c", "command -v ls"], capture_output=True,
+                             text=True).stdout.strip()
+    with open(os.path.join(shims, "ls"), "w") as f:
+        f.write("#!/bin/sh\nexec %s --time-style='+%%Y-%%m-%%d %%H:%%M' \"$@\"\n"
+                % real_ls)
+    os.chmod(os.path.join(shims, "ls"), 0o755)
+    env["PATH"] = shims + os.pathsep + env.get("PATH", "")
+    return env
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--port", type=int, default=5037)
+    parser.add_argument("--root", default=".")
+    parser.add_argument("--features", default="shell_v2,cmd,stat_v2,ls_v2")
+    parser.add_argument("--devices", default="fake0001",
+                        help="comma separated serials of attached devices")
+    parser.add_argument("--latency", type=float, default=0,
+                        help="milliseconds added to every request")
+    parser.add_argument("--bandwidth", type=float, default=0,
+                        help="KB/s shared by all transfers; 0 for no limit")
+    args = parser.parse_args()
+
+    server = Server(("127.0.0.1", args.port), Handler)
+    server.root = os.path.abspath(args.root)
+    server.features = args.features
+    server.devices = [d for d in args.devices.split(",") if d]
+    server.latency = args.latency / 1000.0
+    server.bandwidth = args.bandwidth * 1024
+    server.env = toybox_ls_env()
+    signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
+    print(server.server_address[1], flush=True)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# Run the adb protocol tests against tests/fake_adb_server.py.
+# Usage: tests/protocol.sh <test binary>...
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+WORK_DIR=$(mktemp -d /tmp/adbfs-protocol-XXXXXX)
+mkdir -p "$WORK_DIR/device"
+
+coproc SERVER { exec python3 "$TESTS_DIR/fake_adb_server.py" --port 0 --root "$WORK_DIR/device"; }
+read -r PORT <&"${SERVER[0]}"
+
+cleanup() {
+  kill "$SERVER_PID" 2> /dev/null
+  rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+if [ -z "$PORT" ]
+then
+  echo "FAIL fake adb server did not start"
+  exit 1
+fi
+
+export ANDROID_ADB_SERVER_PORT=$PORT
+unset ANDROID_SERIAL
+
+status=0
+for test_binary in "$@"
+do
+  "$test_binary" "$WORK_DIR/device" || status=1
+done
+exit $status
@@ -0,0 +1,1302 @@
+/*
+   Runs the adbfs callbacks from many threads at once, the way the
+   multithreaded fuse_main loop does, against tests/fake_adb_server.py.
+   Run through tests/protocol.sh.
+
+   adbfs.cpp is compiled into the test with fuse_main replaced by
+   run_stress(), so options, temporary directory and the callback table
+   are set up exactly as for a real mount.  Shell commands on the fake
+   device see the host's file system, so all device paths used here are
+   host paths inside the fake device's root.
+
+   Data races rarely break the checks outright; build with
+   "make test CPPFLAGS=-fsanitize=thread" to have them reported.
+*/
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <atomic>
+#include <set>
+
+static int run_stress(const struct fuse_operations* op);
+
+#undef fuse_main
+#define fuse_main(argc, argv, op, user_data) run_stress(op)
+#define main adbfs_main
+#include "../adbfs.cpp"
+#undef main
+
+static string stress_dir;
+static atomic<int> failures(0);
+static atomic<bool> transfers_running(false);
+static atomic<int> metadata_during_transfers(0);
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            cerr << "FAIL " << __FILE__ << ":" << __LINE__ << ": " #cond << endl; \
+            ++failures; \
+        } \
+    } while (0)
+
+static const int FILES = 40;
+
+static string content_of(int seed, size_t size)
+{
+    string data(size, '\0');
+    for (size_t i = 0; i < size; ++i) data[i] = 'a' + (i * 31 + seed * 7 + i / 4096) % 26;
+    return data;
+}
+
+static string host_file(const string& path)
+{
+    ifstream in(path.c_str(), ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+static string seeded(int i)
+{
+    char name[32];
+    snprintf(name, sizeof name, "/seed-%02d", i);
+    return stress_dir + name;
+}
+
+static size_t seeded_size(int i)
+{
+    return i == 0 ? 8 << 20 : 1000 + i * 7919;
+}
+
+static int fill_count(void* buf, const char* name, const struct stat* st, off_t off)
+{
+    ++*static_cast<int*>(buf);
+    return 0;
+}
+
+static void metadata_worker(const struct fuse_operations* op, int id)
+{
+    for (int round = 0; round < 150; ++round) {
+        int i = (round * 13 + id) % FILES;
+        struct stat st;
+        CHECK(op->getattr(seeded(i).c_str(), &st) == 0);
+        CHECK(S_ISREG(st.st_mode) && (size_t)st.st_size == seeded_size(i));
+        CHECK(op->getattr((stress_dir + "/missing").c_str(), &st) == -ENOENT);
+        if (round % 10 == 0) {
+            int entries = 0;
+            CHECK(op->readdir(stress_dir.c_str(), &entries, fill_count, 0, NULL) == 0);
+            CHECK(entries >= FILES + 2);
+        }
+        if (transfers_running) ++metadata_during_transfers;
+    }
+}
+
+static void read_worker(const struct fuse_operations* op, int id)
+{
+    for (int round = 0; round < 6; ++round) {
+        int i = (round + id) % 3 == 0 ? 0 : (round * 5 + id) % FILES;
+        string path = seeded(i);
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof fi);
+        fi.flags = O_RDONLY;
+        CHECK(op->open(path.c_str(), &fi) == 0);
+        string data;
+        vector<char> buf(128 * 1024);
+        for (;;) {
+            int n = op->read(path.c_str(), &buf[0], buf.size(), data.size(), &fi);
+            CHECK(n >= 0);
+            if (n <= 0) break;
+            data.append(&buf[0], n);
+        }
+        CHECK(data == content_of(i, seeded_size(i)));
+        op->release(path.c_str(), &fi);
+    }
+}
+
+static void write_worker(const struct fuse_operations* op, int id)
+{
+    for (int round = 0; round < 8; ++round) {
+        char name[32];
+        snprintf(name, sizeof name, "/written-%d-%d", id, round);
+        string path = stress_dir + name;
+        string data = content_of(id * 100 + round, 200000 + round * 50000);
+        CHECK(op->mknod(path.c_str(), S_IFREG | 0644, 0) == 0);
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof fi);
+        fi.flags = O_WRONLY;
+        CHECK(op->open(path.c_str(), &fi) == 0);
+        for (size_t off = 0; off < data.size(); off += 65536) {
+            size_t n = min((size_t)65536, data.size() - off);
+            CHECK(op->write(path.c_str(), data.data() + off, n, off, &fi) == (int)n);
+        }
+        if (round % 2) {
+            // go back, which moves the handle to a local copy
+            CHECK(op->write(path.c_str(), "back", 4, 10, &fi) == 4);
+            memcpy(&data[10], "back", 4);
+        }
+        CHECK(op->flush(path.c_str(), &fi) == 0);
+        CHECK(op->release(path.c_str(), &fi) == 0);
+        CHECK(host_file(path) == data);
+
+        string renamed = path + ".moved";
+        CHECK(op->rename(path.c_str(), renamed.c_str()) == 0);
+        struct stat st;
+        CHECK(op->getattr(renamed.c_str(), &st) == 0 && (size_t)st.st_size == data.size());
+        CHECK(op->unlink(renamed.c_str()) == 0);
+        CHECK(op->getattr(renamed.c_str(), &st) == -ENOENT);
+    }
+}
+
+/** Misses remembered by getattr must not hide names created since. */
+static void check_negative_lookups(const struct fuse_operations* op)
+{
+    string created = stress_dir + "/probe", moved = stress_dir + "/probe.moved";
+    struct stat st;
+    CHECK(op->getattr(created.c_str(), &st) == -ENOENT);
+    CHECK(op->getattr(moved.c_str(), &st) == -ENOENT);
+    CHECK(op->mknod(created.c_str(), S_IFREG | 0644, 0) == 0);
+    CHECK(op->getattr(created.c_str(), &st) == 0);
+    CHECK(op->rename(created.c_str(), moved.c_str()) == 0);
+    CHECK(op->getattr(moved.c_str(), &st) == 0);
+    CHECK(op->unlink(moved.c_str()) == 0);
+}
+
+static int fill_names(void* buf, const char* name, const struct stat* st, off_t off)
+{
+    static_cast<set<string>*>(buf)->insert(name);
+    return 0;
+}
+
+static set<string> list(const struct fuse_operations* op, const string& dir)
+{
+    set<string> names;
+    CHECK(op->readdir(dir.c_str(), &names, fill_names, 0, NULL) == 0);
+    return names;
+}
+
+/**
+   A listing is served from the cache, so a file created behind adbfs'
+   back stays out of it, while changes made through adbfs show up.
+ */
+static void check_listings(const struct fuse_operations* op)
+{
+    string dir = stress_dir + "/listed";
+    CHECK(op->mkdir(dir.c_str(), 0755) == 0);
+    CHECK(list(op, dir).size() == 2);
+    CHECK(list(op, stress_dir).count("listed") == 1);
+
+    ofstream((dir + "/behind").c_str());
+    CHECK(list(op, dir).count("behind") == 0);
+
+    string file = dir + "/made", sub = dir + "/sub";
+    CHECK(op->mknod(file.c_str(), S_IFREG | 0644, 0) == 0);
+    CHECK(op->mkdir(sub.c_str(), 0755) == 0);
+    CHECK(op->mknod((sub + "/inner").c_str(), S_IFREG | 0644, 0) == 0);
+    CHECK(list(op, sub).count("inner") == 1);
+    set<string> names = list(op, dir);
+    CHECK(names.count("made") == 1 && names.count("sub") == 1);
+
+    string moved = dir + "/moved";
+    CHECK(op->rename(sub.c_str(), moved.c_str()) == 0);
+    names = list(op, dir);
+    CHECK(names.count("sub") == 0 && names.count("moved") == 1);
+    CHECK(list(op, moved).count("inner") == 1);
+
+    CHECK(op->unlink((moved + "/inner").c_str()) == 0);
+    CHECK(list(op, moved).size() == 2);
+    CHECK(op->rmdir(moved.c_str()) == 0);
+    CHECK(op->unlink(file.c_str()) == 0);
+    names = list(op, dir);
+    CHECK(names.count("moved") == 0 && names.count("made") == 0);
+
+    // a failed removal must not drop the name
+    string root = stress_dir.substr(0, stress_dir.rfind('/'));
+    CHECK(list(op, root).count("stress") == 1);
+    CHECK(op->rmdir(stress_dir.c_str()) == 0);
+    CHECK(list(op, root).count("stress") == 1);
+
+    unlink((dir + "/behind").c_str());
+    rmdir(dir.c_str());
+}
+
+/**
+   The first listing inside the -o prefetch tree lists all of it, so
+   files created below it afterwards stay out of the cached listings
+   and attributes.
+ */
+static void check_prefetch(const struct fuse_operations* op)
+{
+    string tree = stress_dir + "/tree";
+    CHECK(list(op, tree).count("a") == 1);
+    ofstream((tree + "/a/b/late").c_str());
+    CHECK(list(op, tree + "/a/b").count("late") == 0);
+    CHECK(list(op, tree + "/a/b").count("leaf") == 1);
+    ofstream((tree + "/a/b/leaf").c_str(), ios::app) << "grown";
+    struct stat st;
+    CHECK(op->getattr((tree + "/a/b/leaf").c_str(), &st) == 0 && st.st_size == 4);
+    CHECK(op->getattr((tree + "/a").c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+/**
+   /.adbfs/stats is read-only, stays out of the root listing and
+   reports the operations that ran.
+ */
+static void check_stats(const struct fuse_operations* op)
+{
+    struct stat st;
+    CHECK(op->getattr("/.adbfs", &st) == 0 && S_ISDIR(st.st_mode));
+    CHECK(op->getattr("/.adbfs/stats", &st) == 0 && S_ISREG(st.st_mode));
+    CHECK(op->getattr("/.adbfs/other", &st) == -ENOENT);
+    CHECK(list(op, "/.adbfs").count("stats") == 1);
+    CHECK(list(op, "/").count(".adbfs") == 0);
+    CHECK(op->unlink("/.adbfs/stats") == -EROFS);
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    CHECK(op->open("/.adbfs/stats", &fi) == -EACCES);
+    fi.flags = O_RDONLY;
+    CHECK(op->open("/.adbfs/stats", &fi) == 0);
+    string text;
+    char buf[1000];
+    int n;
+    while ((n = op->read("/.adbfs/stats", buf, sizeof(buf), text.size(), &fi)) > 0)
+        text.append(buf, n);
+    CHECK(n == 0);
+    CHECK(op->release("/.adbfs/stats", &fi) == 0);
+    CHECK(text.find("\ngetattr ") != string::npos);
+    CHECK(text.find("\nrelease ") != string::npos);
+    CHECK(text.find("\nsync STAT ") != string::npos);
+    CHECK(text.find("bytes pushed: 0\n") == string::npos);
+    CHECK(text.find("attribute cache hits: 0\n") == string::npos);
+}
+
+/**
+   Only enabled levels are formatted, and a dump holds the newest
+   events in order, even after the ring has wrapped.
+ */
+static void check_trace()
+{
+    int evaluated = 0;
+    CHECK(!traceLog.set_level("loud"));
+    CHECK(traceLog.set_level("error"));
+    TRACE(TRACE_DEBUG, "never " << ++evaluated);
+    CHECK(evaluated == 0);
+
+    CHECK(traceLog.set_level("debug"));
+    for (uint64_t i = 0; i < tracer::EVENTS + 10; ++i)
+        TRACE(TRACE_DEBUG, "event " << i);
+    TRACE(TRACE_ERROR, "last\n");
+    char path[] = "/tmp/adbfs-trace-XXXXXX";
+    int fd = mkstemp(path);
+    traceLog.dump(fd, 3);
+    close(fd);
+    ifstream in(path);
+    string dump((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    unlink(path);
+    size_t a = dump.find(" D event " + to_string(tracer::EVENTS + 8) + "\n");
+    size_t b = dump.find(" D event " + to_string(tracer::EVENTS + 9) + "\n");
+    size_t c = dump.find(" E last\n");
+    CHECK(a != string::npos && a < b && b != string::npos && b < c && c != string::npos);
+    CHECK(dump.find("event " + to_string(tracer::EVENTS + 7) + "\n") == string::npos);
+    traceLog.flush();
+    CHECK(traceLog.set_level("info"));
+}
+
+/**
+   getattr misses from concurrent threads share device round trips and
+   still get their own answers, through the sync service and through
+   ls alike.
+ */
+static void check_batched_lookups(const struct fuse_operations* op)
+{
+    string dir = stress_dir + "/batch";
+    mkdir(dir.c_str(), 0755);
+    const int N = 16;
+    for (int i = 0; i < N; ++i)
+        ofstream((dir + "/f" + to_string(i)).c_str()) << string(i, 'x');
+    uint64_t batched = adbfsStats.counters[LOOKUPS_BATCHED];
+    atomic<int> ready(0);
+    vector<thread> threads;
+    for (int i = 0; i < 2 * N; ++i) {
+        threads.push_back(thread([&, i] {
+            // odd threads probe a missing name, two threads per name
+            string path = dir + (i % 2 ? "/missing" : "/f") + to_string(i / 2);
+            ++ready;
+            while (ready < 2 * N) this_thread::yield();
+            struct stat st;
+            int res = op->getattr(path.c_str(), &st);
+            if (i % 2) CHECK(res == -ENOENT);
+            else CHECK(res == 0 && S_ISREG(st.st_mode) && st.st_size == i / 2);
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+    CHECK(adbfsStats.counters[LOOKUPS_BATCHED] > batched);
+
+    vector<string> paths;
+    paths.push_back(dir + "/f3");
+    paths.push_back(dir + "/missing");
+    paths.push_back(dir);
+    for (int sync = 0; sync < 2; ++sync) {
+        bool available = device().syncMetadata.available;
+        device().syncMetadata.available = sync && available;
+        vector<attr_lookup> results(paths.size());
+        lookup_attributes(paths, results);
+        device().syncMetadata.available = available;
+        CHECK(results[0].ok && S_ISREG(results[0].entry.st.st_mode)
+              && results[0].entry.st.st_size == 3);
+        CHECK(results[1].ok && results[1].entry.haveStat && results[1].entry.st.st_mode == 0);
+        CHECK(results[2].ok && S_ISDIR(results[2].entry.st.st_mode));
+    }
+    for (int i = 0; i < N; ++i) unlink((dir + "/f" + to_string(i)).c_str());
+    rmdir(dir.c_str());
+}
+
+static string read_through(const struct fuse_operations* op, const string& path, int flags)
+{
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = flags;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    string data;
+    char buf[65536];
+    int n;
+    while ((n = op->read(path.c_str(), buf, sizeof buf, data.size(), &fi)) > 0)
+        data.append(buf, n);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+    return data;
+}
+
+/**
+   Opening a file again that has not changed on the device transfers
+   nothing and lets the kernel keep its pages; a change made through
+   adbfs is pulled again.
+ */
+static void check_reopen(const struct fuse_operations* op)
+{
+    string path = stress_dir + "/reopen.db";
+    string data = content_of(3, 300000);
+    ofstream(path.c_str(), ios::binary) << data;
+    struct stat st;
+    CHECK(op->getattr(path.c_str(), &st) == 0);
+
+    uint64_t pulled = adbfsStats.counters[BYTES_PULLED];
+    uint64_t skipped = adbfsStats.counters[PULLS_SKIPPED];
+    CHECK(read_through(op, path, O_RDWR) == data);
+    CHECK(adbfsStats.counters[BYTES_PULLED] == pulled + data.size());
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    CHECK(fi.keep_cache);
+    CHECK(adbfsStats.counters[PULLS_SKIPPED] == skipped + 1);
+    CHECK(adbfsStats.counters[BYTES_PULLED] == pulled + data.size());
+
+    CHECK(op->write(path.c_str(), "X", 1, 10, &fi) == 1);
+    CHECK(op->flush(path.c_str(), &fi) == 0);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+    data[10] = 'X';
+    CHECK(host_file(path) == data);
+    CHECK(op->getattr(path.c_str(), &st) == 0);
+    CHECK(read_through(op, path, O_RDWR) == data);
+    CHECK(adbfsStats.counters[BYTES_PULLED] == pulled + 2 * data.size());
+
+    CHECK(read_through(op, path, O_RDONLY) == data);
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDONLY;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    CHECK(fi.keep_cache);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+
+    // an entry from ls has its mtime rounded to the minute, so it
+    // cannot vouch for the local copy
+    CHECK(op->getattr(path.c_str(), &st) == 0);
+    string rewritten = data;
+    rewritten[20] = 'Y';
+    ofstream(path.c_str(), ios::binary) << rewritten;
+    struct timeval times[2] = { { st.st_mtime + 1, 0 }, { st.st_mtime + 1, 0 } };
+    CHECK(utimes(path.c_str(), times) == 0);
+    fileCache entry = fileCache();
+    cache_ls_line(entry, "-rw-rw-r-- root     sdcard_rw   300000 2012-06-22 02:16 reopen.db");
+    entry.st.st_mtime = st.st_mtime;
+    entry.timestamp = time(NULL);
+    device().fileData.set(path, entry);
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    CHECK(!fi.keep_cache);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+    CHECK(read_through(op, path, O_RDWR) == rewritten);
+
+    // an open the local copy refuses fails, and leaves no handle behind
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR | O_DIRECTORY;
+    CHECK(op->open(path.c_str(), &fi) == -ENOTDIR);
+    CHECK(op->truncate(path.c_str(), 10) == 0);
+    CHECK(op->open(path.c_str(), &fi) == -ENOTDIR);
+    CHECK(read_through(op, path, O_RDWR) == rewritten.substr(0, 10));
+    CHECK(op->unlink(path.c_str()) == 0);
+}
+
+/**
+   The readahead window doubles with every sequential read up to its
+   limit, and a read elsewhere collapses it and cancels what was
+   queued.  Readers of the same blocks share one fetch of them.
+ */
+static void check_readahead()
+{
+    string path = stress_dir + "/ahead";
+    string data = content_of(13, 40 * REMOTE_BLOCK_SIZE);
+    ofstream(path.c_str(), ios::binary) << data;
+    struct stat st;
+    CHECK(stat(path.c_str(), &st) == 0);
+    // never destroyed: the engine's workers are detached
+    content_cache* cache = new content_cache;
+    cache->set_budget(64 * REMOTE_BLOCK_SIZE);
+    readahead_engine* engine = new readahead_engine;
+    engine->set_max_window(8);
+
+    shared_ptr<remote_file> file = cache->open(path, st.st_size, st.st_mtime, stress_dir + "/");
+    shared_ptr<readahead_state> ra(new readahead_state);
+    size_t expected_window[] = { 2, 4, 8, 8 };
+    size_t read_size = 2 * REMOTE_BLOCK_SIZE;
+    for (size_t i = 0; i < 4; ++i) {
+        engine->on_read(file, ra, i * read_size, read_size);
+        CHECK(ra->window == expected_window[i]);
+    }
+    CHECK(ra->ahead > 4 * read_size / REMOTE_BLOCK_SIZE);
+    unsigned generation = ra->generation;
+    engine->on_read(file, ra, 30 * REMOTE_BLOCK_SIZE, 4096);
+    CHECK(ra->window == 0 && ra->ahead == 0);
+    CHECK(ra->generation == generation + 1);
+    engine->cancel(ra);
+
+    string shared_path = path + "-shared";
+    ofstream(shared_path.c_str(), ios::binary) << data;
+    CHECK(stat(shared_path.c_str(), &st) == 0);
+    file = cache->open(shared_path, st.st_size, st.st_mtime, stress_dir + "/");
+    content_cache_stats before = cache->stats();
+    vector<thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.push_back(thread([&]() {
+            string buf(16 * REMOTE_BLOCK_SIZE, '\0');
+            CHECK(file->read(&buf[0], buf.size(), 0) == (int)buf.size());
+            CHECK(buf == data.substr(0, buf.size()));
+        }));
+    }
+    for (size_t i = 0; i < readers.size(); ++i) readers[i].join();
+    CHECK(cache->stats().misses == before.misses + 16);
+    unlink(path.c_str());
+    unlink(shared_path.c_str());
+}
+
+/**
+   Blocks the device did not send are an error, not zeroes, and a file
+   that changed is not pulled in their place.  Only without "exec:" is
+   the whole file pulled, and then its blocks count against the cache
+   budget.
+ */
+static void check_short_fetch(const struct fuse_operations* op)
+{
+    string path = stress_dir + "/vanishing";
+    ofstream(path.c_str(), ios::binary) << content_of(7, 300000);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDONLY;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    unlink(path.c_str());
+    vector<char> buf(4096);
+    CHECK(op->read(path.c_str(), &buf[0], buf.size(), 200000, &fi) == -EIO);
+    CHECK(op->read(path.c_str(), &buf[0], buf.size(), 200000, &fi) == -EIO);
+    op->release(path.c_str(), &fi);
+
+    string shrunk = stress_dir + "/shrinking";
+    ofstream(shrunk.c_str(), ios::binary) << content_of(8, 300000);
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDONLY;
+    CHECK(op->open(shrunk.c_str(), &fi) == 0);
+    ofstream(shrunk.c_str(), ios::binary) << content_of(9, 100000);
+    uint64_t pulled = adbfsStats.counters[BYTES_PULLED];
+    CHECK(op->read(shrunk.c_str(), &buf[0], buf.size(), 200000, &fi) == -EIO);
+    CHECK(adbfsStats.counters[BYTES_PULLED] == pulled);
+    op->release(shrunk.c_str(), &fi);
+    unlink(shrunk.c_str());
+
+    string reply;
+    CHECK(adb_query("host:fake-exec:off", reply, NULL));
+    // alone in its directory, so that no siblings are fetched with it
+    string old_dir = stress_dir + "/no-exec";
+    mkdir(old_dir.c_str(), 0755);
+    string old = old_dir + "/file";
+    string data = content_of(10, 300000);
+    ofstream(old.c_str(), ios::binary) << data;
+    content_cache_stats before = device().contentCache->stats();
+    CHECK(read_through(op, old, O_RDONLY) == data);
+    CHECK(adbfsStats.counters[BYTES_PULLED] == pulled + data.size());
+    CHECK(device().contentCache->stats().bytes >= before.bytes + 4 * REMOTE_BLOCK_SIZE);
+    CHECK(read_through(op, old, O_RDONLY) == data);
+    CHECK(adbfsStats.counters[BYTES_PULLED] == pulled + data.size());
+    CHECK(adb_query("host:fake-exec:on", reply, NULL));
+    unlink(old.c_str());
+    rmdir(old_dir.c_str());
+}
+
+/**
+   A flush sends only the written ranges of a large file, and the whole
+   file once they cover most of it.
+ */
+static void check_ranged_writes(const struct fuse_operations* op)
+{
+    dirty_extents dirty(100);
+    dirty.add(10, 5);
+    dirty.add(30, 10);
+    dirty.add(12, 20);
+    dirty.add(8000, 1);
+    CHECK(dirty.bytes() == 31 && dirty.end() == 8001);
+    vector<pair<off_t, off_t> > blocks = dirty.aligned(4096, 8010);
+    CHECK(blocks.size() == 1 && blocks[0].first == 0 && blocks[0].second == 8010);
+
+    string path = stress_dir + "/ranged.db";
+    string data = content_of(5, 3 << 20);
+    ofstream(path.c_str(), ios::binary) << data;
+    struct stat st;
+    CHECK(op->getattr(path.c_str(), &st) == 0);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    uint64_t pushed = adbfsStats.counters[BYTES_PUSHED];
+    uint64_t ranged = adbfsStats.counters[RANGED_WRITES];
+    string page(100, 'P'), tail = "appended line\n";
+    CHECK(op->write(path.c_str(), page.data(), page.size(), 1000000, &fi) == 100);
+    CHECK(op->write(path.c_str(), tail.data(), tail.size(), data.size(), &fi)
+          == (int)tail.size());
+    CHECK(op->flush(path.c_str(), &fi) == 0);
+    data.replace(1000000, page.size(), page);
+    data += tail;
+    CHECK(host_file(path) == data);
+    CHECK(adbfsStats.counters[RANGED_WRITES] == ranged + 1);
+    CHECK(adbfsStats.counters[BYTES_PUSHED] < pushed + 3 * 4096);
+
+    // again on the same handle, then most of the file
+    CHECK(op->write(path.c_str(), "Q", 1, 5, &fi) == 1);
+    CHECK(op->flush(path.c_str(), &fi) == 0);
+    data[5] = 'Q';
+    CHECK(host_file(path) == data);
+    CHECK(adbfsStats.counters[RANGED_WRITES] == ranged + 2);
+    string most(data.size() * 3 / 4, 'M');
+    CHECK(op->write(path.c_str(), most.data(), most.size(), 0, &fi) == (int)most.size());
+    CHECK(op->flush(path.c_str(), &fi) == 0);
+    data.replace(0, most.size(), most);
+    CHECK(host_file(path) == data);
+    CHECK(adbfsStats.counters[RANGED_WRITES] == ranged + 2);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+    CHECK(op->unlink(path.c_str()) == 0);
+}
+
+/**
+   Shrinking an open file and writing back out to its old size leaves
+   a hole the device must get too, not only the blocks written.
+ */
+static void check_truncated_writes(const struct fuse_operations* op)
+{
+    string path = stress_dir + "/shrunk.db";
+    string data = content_of(6, 4 << 20);
+    ofstream(path.c_str(), ios::binary) << data;
+    struct stat st;
+    CHECK(op->getattr(path.c_str(), &st) == 0);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    off_t shrunk = data.size() - 100000;
+    CHECK(op->truncate(path.c_str(), shrunk) == 0);
+    CHECK(op->write(path.c_str(), "Z", 1, data.size() - 1, &fi) == 1);
+    CHECK(op->flush(path.c_str(), &fi) == 0);
+    data.replace(shrunk, data.size() - shrunk, string(data.size() - shrunk, '\0'));
+    data[data.size() - 1] = 'Z';
+    CHECK(host_file(path) == data);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+    CHECK(op->unlink(path.c_str()) == 0);
+}
+
+/** Write data to path through a new handle from offset 0, and close it. */
+static void write_through(const struct fuse_operations* op, const string& path, int flags,
+                          const string& data)
+{
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = flags;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    for (size_t off = 0; off < data.size(); off += 65536) {
+        size_t n = min((size_t)65536, data.size() - off);
+        CHECK(op->write(path.c_str(), data.data() + off, n, off, &fi) == (int)n);
+    }
+    CHECK(op->flush(path.c_str(), &fi) == 0);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+}
+
+/**
+   Writing back the bytes a file had already, in place or after
+   truncating it as editors do, pushes nothing.
+ */
+static void check_unchanged_flush(const struct fuse_operations* op)
+{
+    md5 empty, abc;
+    abc.update("abc", 3);
+    CHECK(empty.hex() == "d41d8cd98f00b204e9800998ecf8427e");
+    CHECK(abc.hex() == "900150983cd24fb0d6963f7d28e17f72");
+
+    string path = stress_dir + "/same.txt";
+    string data = content_of(7, 2 << 20);
+    ofstream(path.c_str(), ios::binary) << data;
+    struct stat st;
+    CHECK(op->getattr(path.c_str(), &st) == 0);
+    uint64_t pushed = adbfsStats.counters[BYTES_PUSHED];
+    uint64_t elided = adbfsStats.counters[PUSHES_ELIDED];
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    CHECK(op->write(path.c_str(), data.data() + 70000, 100, 70000, &fi) == 100);
+    CHECK(op->flush(path.c_str(), &fi) == 0);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+    CHECK(adbfsStats.counters[PUSHES_ELIDED] == elided + 1);
+
+    // as an editor saves: truncate, then write it all again
+    CHECK(op->truncate(path.c_str(), 0) == 0);
+    write_through(op, path, O_WRONLY, data);
+    CHECK(adbfsStats.counters[PUSHES_ELIDED] == elided + 2);
+    CHECK(adbfsStats.counters[BYTES_PUSHED] == pushed);
+    CHECK(host_file(path) == data);
+
+    // a real change goes out, and so does changing it back
+    string changed = data;
+    changed[5] = '!';
+    write_through(op, path, O_RDWR, changed);
+    CHECK(host_file(path) == changed);
+    write_through(op, path, O_RDWR, data);
+    CHECK(host_file(path) == data);
+    CHECK(adbfsStats.counters[PUSHES_ELIDED] == elided + 2);
+
+    // without a digest, the device's md5sum tells
+    adbfs_conf.devicehash = 1;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    device().copyDigests.erase("" + path);
+    CHECK(op->write(path.c_str(), data.data(), 10, 0, &fi) == 10);
+    CHECK(op->flush(path.c_str(), &fi) == 0);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+    CHECK(adbfsStats.counters[PUSHES_ELIDED] == elided + 3);
+    adbfs_conf.devicehash = 0;
+    CHECK(op->unlink(path.c_str()) == 0);
+}
+
+/**
+   Truncating an open handle keeps what it wrote, and a shrink that is
+   written back out with the old bytes is still a change.
+ */
+static void check_truncated_flush(const struct fuse_operations* op)
+{
+    string path = stress_dir + "/cut.txt";
+    string data = content_of(8, 300000);
+    ofstream(path.c_str(), ios::binary) << data;
+    struct stat st;
+    CHECK(op->getattr(path.c_str(), &st) == 0);
+    uint64_t elided = adbfsStats.counters[PUSHES_ELIDED];
+
+    // write, then ftruncate, which comes down the path as a truncate
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    string page(5000, 'W');
+    CHECK(op->write(path.c_str(), page.data(), page.size(), 100000, &fi) == 5000);
+    CHECK(op->truncate(path.c_str(), 200000) == 0);
+    CHECK(op->flush(path.c_str(), &fi) == 0);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+    data.replace(100000, page.size(), page);
+    data.resize(200000);
+    CHECK(host_file(path) == data);
+
+    // shrink, then put the old tail back, leaving a hole before it
+    string tail = content_of(9, 400000);
+    write_through(op, path, O_RDWR, data + tail);
+    data += tail;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(op->open(path.c_str(), &fi) == 0);
+    CHECK(op->truncate(path.c_str(), 300000) == 0);
+    CHECK(op->write(path.c_str(), tail.data() + 324288, 75712, 524288, &fi) == 75712);
+    CHECK(op->flush(path.c_str(), &fi) == 0);
+    CHECK(op->release(path.c_str(), &fi) == 0);
+    data.replace(300000, 224288, string(224288, '\0'));
+    CHECK(host_file(path) == data);
+    CHECK(adbfsStats.counters[PUSHES_ELIDED] == elided);
+    CHECK(op->unlink(path.c_str()) == 0);
+}
+
+/** Pushes of the queue below are held until the test lets them go. */
+static mutex gate_lock;
+static condition_variable gate_cond;
+static bool gate_open = false;
+static vector<pair<string, string> > gate_pushed;
+
+/**
+   The write-back queue coalesces flushes of a path that has not been
+   pushed yet, holds renames of a directory until what is queued below
+   it is on the device, and reports a failed push once.
+ */
+static void check_writeback_queue()
+{
+    // never destroyed, like the devices' queues: its worker is detached
+    writeback_queue* queue = new writeback_queue(
+        [](const string& spool, const string& remote, string& error) {
+            unique_lock<mutex> guard(gate_lock);
+            while (!gate_open) gate_cond.wait(guard);
+            gate_pushed.push_back(make_pair(remote, host_file(spool)));
+            if (remote == "/refused") {
+                error = "refused";
+                return false;
+            }
+            return true;
+        });
+    string local = stress_dir + "/queued";
+    string tmpdir = stress_dir + "/";
+    ofstream(local.c_str()) << "first";
+    CHECK(queue->enqueue(local, "/d/first", tmpdir) == 0);
+    CHECK(queue->enqueue(local, "/d/a", tmpdir) == 0);
+    ofstream(local.c_str()) << "second";
+    CHECK(queue->enqueue(local, "/d/a", tmpdir) == 0);
+    struct stat st;
+    CHECK(queue->pending_stat("/d/a", st) && st.st_size == 6);
+    CHECK(queue->enqueue(local, "/d/b/c", tmpdir) == 0);
+    CHECK(queue->enqueue(local, "/d b", tmpdir) == 0);
+    CHECK(queue->enqueue(local, "/refused", tmpdir) == 0);
+    queue->discard_tree("/d/b");
+    CHECK(!queue->pending_stat("/d/b/c", st));
+
+    atomic<bool> waited(false);
+    thread waiter([&]() {
+        CHECK(queue->wait_tree("/d") == 0);
+        waited = true;
+    });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    CHECK(!waited);
+    {
+        lock_guard<mutex> guard(gate_lock);
+        gate_open = true;
+        gate_cond.notify_all();
+    }
+    waiter.join();
+    {
+        lock_guard<mutex> guard(gate_lock);
+        int pushes_of_a = 0;
+        for (size_t i = 0; i < gate_pushed.size(); ++i) {
+            if (gate_pushed[i].first == "/d/a") {
+                ++pushes_of_a;
+                CHECK(gate_pushed[i].second == "second");
+            }
+            CHECK(gate_pushed[i].first != "/d/b/c");
+        }
+        CHECK(pushes_of_a == 1);
+    }
+    CHECK(queue->wait("/refused") == -EIO);
+    CHECK(queue->wait("/refused") == 0);
+    queue->drain();
+    CHECK(!queue->pending_stat("/d b", st));
+    CHECK(gate_pushed.size() == 4);
+    unlink(local.c_str());
+}
+
+/**
+   With -o writeback, flushes reach the device in the background: the
+   queued copy is what getattr reports, fsync and unmount make it
+   durable, renamed directories take their queued children along, and
+   a failed push is reported by fsync.
+ */
+static void check_writeback(const struct fuse_operations* op)
+{
+    adbfs_conf.writeback = 1;
+    string dir = stress_dir + "/wb";
+    CHECK(op->mkdir(dir.c_str(), 0755) == 0);
+    string file = dir + "/file";
+    string data = content_of(11, 200000);
+    ofstream(file.c_str(), ios::binary) << data;
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(op->open(file.c_str(), &fi) == 0);
+    CHECK(op->write(file.c_str(), "tail", 4, data.size(), &fi) == 4);
+    CHECK(op->flush(file.c_str(), &fi) == 0);
+    data += "tail";
+    struct stat st;
+    CHECK(op->getattr(file.c_str(), &st) == 0 && st.st_size == (off_t)data.size());
+    CHECK(op->fsync(file.c_str(), 0, &fi) == 0);
+    CHECK(host_file(file) == data);
+    CHECK(op->release(file.c_str(), &fi) == 0);
+
+    // a large push ahead of them keeps the children queued
+    string large = stress_dir + "/wb-large";
+    ofstream(large.c_str(), ios::binary) << content_of(12, 16 << 20);
+    write_through(op, large, O_RDWR, "changed");
+    vector<string> children;
+    for (int i = 0; i < 4; ++i) {
+        string child = dir + "/child-" + to_string(i);
+        ofstream(child.c_str(), ios::binary) << "old";
+        write_through(op, child, O_RDWR, content_of(i, 100000));
+        children.push_back("/child-" + to_string(i));
+    }
+    string gone = dir + "/gone";
+    ofstream(gone.c_str(), ios::binary) << "old";
+    write_through(op, gone, O_RDWR, content_of(4, 100000));
+    CHECK(op->unlink(gone.c_str()) == 0);
+    string moved = stress_dir + "/wb-moved";
+    CHECK(op->rename(dir.c_str(), moved.c_str()) == 0);
+    device().writebackQueue->drain();
+    CHECK(access(dir.c_str(), F_OK) < 0);
+    CHECK(access((moved + "/gone").c_str(), F_OK) < 0);
+    for (int i = 0; i < 4; ++i)
+        CHECK(host_file(moved + children[i]) == content_of(i, 100000));
+    CHECK(op->unlink(large.c_str()) == 0);
+
+    string refused = moved + "/refused";
+    ofstream(refused.c_str(), ios::binary) << "old";
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(op->open(refused.c_str(), &fi) == 0);
+    unlink(refused.c_str());
+    mkdir(refused.c_str(), 0755);
+    CHECK(op->write(refused.c_str(), "new", 3, 0, &fi) == 3);
+    // reported once, by the flush if the push already failed
+    int flushed = op->flush(refused.c_str(), &fi);
+    int synced = op->fsync(refused.c_str(), 0, &fi);
+    CHECK(flushed == 0 ? synced == -EIO : flushed == -EIO && synced == 0);
+    CHECK(op->fsync(refused.c_str(), 0, &fi) == 0);
+    CHECK(op->release(refused.c_str(), &fi) == 0);
+    rmdir(refused.c_str());
+
+    string last = moved + "/last";
+    ofstream(last.c_str(), ios::binary) << "old";
+    write_through(op, last, O_RDWR, "pushed at unmount");
+    op->destroy(NULL);
+    CHECK(host_file(last) == "pushed at unmount");
+    adbfs_conf.writeback = 0;
+}
+
+/**
+   With -o compress, text goes both ways gzipped and arrives intact,
+   while names that say compressed, and extensions that turned out not
+   to shrink, are sent as they are.
+ */
+static void check_compression(const struct fuse_operations* op)
+{
+    transferCompression.set_enabled(true);
+    string text;
+    for (int i = 0; text.size() < 300000; ++i)
+        text += "line " + to_string(i) + ": the quick brown fox\n";
+    string log = stress_dir + "/app.log";
+    ofstream(log.c_str()) << text;
+
+    uint64_t saved = adbfsStats.counters[BYTES_SAVED];
+    CHECK(read_through(op, log, O_RDONLY) == text);
+    CHECK(adbfsStats.counters[BYTES_SAVED] > saved + text.size() / 2);
+    saved = adbfsStats.counters[BYTES_SAVED];
+    CHECK(read_through(op, log, O_RDWR) == text);
+    CHECK(adbfsStats.counters[BYTES_SAVED] > saved + text.size() / 2);
+
+    string copy = stress_dir + "/copy.log";
+    CHECK(op->mknod(copy.c_str(), S_IFREG | 0640, 0) == 0);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_WRONLY;
+    CHECK(op->open(copy.c_str(), &fi) == 0);
+    for (size_t off = 0; off < text.size(); off += 65536) {
+        size_t n = min((size_t)65536, text.size() - off);
+        CHECK(op->write(copy.c_str(), text.data() + off, n, off, &fi) == (int)n);
+    }
+    saved = adbfsStats.counters[BYTES_SAVED];
+    CHECK(op->flush(copy.c_str(), &fi) == 0);
+    CHECK(op->release(copy.c_str(), &fi) == 0);
+    CHECK(adbfsStats.counters[BYTES_SAVED] > saved + text.size() / 2);
+    CHECK(host_file(copy) == text);
+    struct stat st;
+    CHECK(stat(copy.c_str(), &st) == 0 && (st.st_mode & 0777) == 0640);
+    CHECK(list(op, stress_dir).count("copy.log") == 1);
+
+    // unpacked beside the target, with the local copy's time
+    string local = stress_dir + "/../local.log";
+    ofstream(local.c_str()) << text;
+    struct timeval times[2] = { { 1234567890, 0 }, { 1234567890, 0 } };
+    CHECK(utimes(local.c_str(), times) == 0);
+    CHECK(compressed_push(local, copy));
+    CHECK(host_file(copy) == text);
+    CHECK(stat(copy.c_str(), &st) == 0 && st.st_mtime == 1234567890);
+    DIR* dir = opendir(stress_dir.c_str());
+    while (struct dirent* entry = readdir(dir))
+        CHECK(strstr(entry->d_name, ".adbfs-") == NULL);
+    closedir(dir);
+    unlink(local.c_str());
+
+    CHECK(!transferCompression.worth_it(stress_dir + "/photo.JPG", 1 << 20));
+    CHECK(!transferCompression.worth_it(log, 1000));
+    CHECK(transferCompression.worth_it(stress_dir + "/other.noise", 1 << 20));
+    string noise = stress_dir + "/random.noise";
+    string data(200000, '\0');
+    for (size_t i = 0; i < data.size(); ++i) data[i] = rand();
+    ofstream(noise.c_str(), ios::binary) << data;
+    CHECK(read_through(op, noise, O_RDONLY) == data);
+    CHECK(!transferCompression.worth_it(stress_dir + "/other.noise", 1 << 20));
+    transferCompression.observe(stress_dir + "/README", 1 << 20, 1 << 20);
+    CHECK(transferCompression.worth_it(stress_dir + "/Makefile", 1 << 20));
+
+    transferCompression.set_enabled(false);
+    unlink(log.c_str());
+    unlink(copy.c_str());
+    unlink(noise.c_str());
+}
+
+/**
+   Background transfers leave a worker for interactive ones and queue
+   behind them, and a reader going through a directory finds the next
+   files fetched ahead of it.
+ */
+static void check_transfers(const struct fuse_operations* op)
+{
+    // never freed: its workers outlive it
+    transfer_pool& pool = *new transfer_pool;
+    pool.set_workers(2);
+    mutex gate;
+    gate.lock();
+    atomic<int> started(0);
+    vector<int> order;
+    mutex order_lock;
+    auto job = [&](int id, bool block) {
+        return [&, id, block] {
+            ++started;
+            if (block) lock_guard<mutex> wait(gate);
+            lock_guard<mutex> guard(order_lock);
+            order.push_back(id);
+        };
+    };
+    CHECK(pool.submit("slow", TRANSFER_BACKGROUND, job(1, true)));
+    while (started < 1) this_thread::yield();
+    CHECK(pool.submit("b", TRANSFER_BACKGROUND, job(2, false)));
+    CHECK(pool.submit("c", TRANSFER_BACKGROUND, job(3, false)));
+    CHECK(!pool.submit("c", TRANSFER_BACKGROUND, job(4, false)));
+    // one worker is busy, and the other is kept from background work
+    // but for c, which was moved up to go ahead of the run below
+    pool.promote("c");
+    pool.run(TRANSFER_INTERACTIVE, job(5, false));
+    CHECK(started == 3 && pool.queued() == 1);
+    gate.unlock();
+    while (pool.queued() > 0 || started < 4) this_thread::yield();
+    this_thread::sleep_for(chrono::milliseconds(20));
+    {
+        lock_guard<mutex> guard(order_lock);
+        CHECK(order.size() == 4 && order[0] == 3 && order[1] == 5
+              && order[2] == 1 && order[3] == 2);
+    }
+
+    // a single worker finishes the background job it has started, then
+    // takes the interactive one ahead of the background jobs queued
+    transfer_pool& single = *new transfer_pool;
+    single.set_workers(1);
+    gate.lock();
+    started = 0;
+    order.clear();
+    CHECK(single.submit("slow", TRANSFER_BACKGROUND, job(1, true)));
+    while (started < 1) this_thread::yield();
+    CHECK(single.submit("b", TRANSFER_BACKGROUND, job(2, false)));
+    thread interactive([&] { single.run(TRANSFER_INTERACTIVE, job(3, false)); });
+    while (single.queued() < 2) this_thread::yield();
+    CHECK(started == 1);
+    gate.unlock();
+    interactive.join();
+    while (single.queued() > 0 || started < 3) this_thread::yield();
+    this_thread::sleep_for(chrono::milliseconds(20));
+    {
+        lock_guard<mutex> guard(order_lock);
+        CHECK(order.size() == 3 && order[0] == 1 && order[1] == 3 && order[2] == 2);
+    }
+
+    string dir = stress_dir + "/camera";
+    mkdir(dir.c_str(), 0755);
+    const int N = 8;
+    for (int i = 0; i < N; ++i)
+        ofstream((dir + "/img" + to_string(i)).c_str(), ios::binary) << content_of(i, 150000);
+    list(op, dir);
+    uint64_t ahead = adbfsStats.counters[FILES_FETCHED_AHEAD];
+    CHECK(read_through(op, dir + "/img0", O_RDONLY) == content_of(0, 150000));
+    for (int wait = 0; wait < 500 && adbfsStats.counters[FILES_FETCHED_AHEAD] < ahead + 4; ++wait)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    CHECK(adbfsStats.counters[FILES_FETCHED_AHEAD] >= ahead + 4);
+    content_cache_stats before = device().contentCache->stats();
+    CHECK(read_through(op, dir + "/img1", O_RDONLY) == content_of(1, 150000));
+    CHECK(device().contentCache->stats().hits >= before.hits + 3);
+    for (int i = 0; i < N; ++i) unlink((dir + "/img" + to_string(i)).c_str());
+    rmdir(dir.c_str());
+}
+
+/**
+   With -o devices, every attached device is a directory of its own,
+   with its own sessions and caches, and one plugged in or out shows
+   up or goes away without a remount.
+ */
+static void check_devices()
+{
+    struct fuse_operations multi;
+    memset(&multi, 0, sizeof multi);
+    multi.readdir = devices_readdir;
+    adbfs_conf.devices = 1;
+    deviceTracker.set_listener(devices_changed);
+    set<string> serials = list(&multi, "/");
+    CHECK(serials.count("fake0001") && !serials.count("fake0002"));
+
+    string reply;
+    CHECK(adb_query("host:fake-attach:fake0002", reply, NULL));
+    for (int wait = 0; wait < 300 && !list(&multi, "/").count("fake0002"); ++wait)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    CHECK(list(&multi, "/").count("fake0002"));
+
+    adb_device* first = device_context("fake0001");
+    adb_device* second = device_context("fake0002");
+    CHECK(first != second && first != defaultDevice);
+    CHECK(first->contentCache != second->contentCache);
+    CHECK(first->tempDir != second->tempDir);
+    {
+        device_scope scope(second);
+        queue<string> output = adb_shell("echo $ADB_FAKE_SERIAL");
+        CHECK(!output.empty() && output.front() == "fake0002");
+    }
+
+    struct stat st;
+    string seed = seeded(0);
+    CHECK(devices_getattr(("/fake0002" + seed).c_str(), &st) == 0);
+    CHECK(st.st_size == (off_t)seeded_size(0));
+    CHECK(devices_rename(("/fake0001" + seed).c_str(),
+                         ("/fake0002" + seed + ".moved").c_str()) == -EXDEV);
+    CHECK(devices_mkdir("/fake0003", 0755) == -EPERM);
+    CHECK(devices_getattr("/fake0003", &st) == -ENOENT);
+
+    CHECK(adb_query("host:fake-detach:fake0002", reply, NULL));
+    for (int wait = 0; wait < 300 && devices_getattr("/fake0002", &st) == 0; ++wait)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    CHECK(devices_getattr("/fake0002", &st) == -ENOENT);
+    CHECK(!list(&multi, "/").count("fake0002"));
+
+    // once stopped, the tracker reports nothing until it is asked again
+    deviceTracker.stop();
+    CHECK(adb_query("host:fake-attach:fake0003", reply, NULL));
+    this_thread::sleep_for(chrono::milliseconds(200));
+    {
+        lock_guard<mutex> guard(deviceContextsLock);
+        CHECK(!deviceContexts.count("fake0003"));
+    }
+    CHECK(list(&multi, "/").count("fake0003"));
+    CHECK(adb_query("host:fake-detach:fake0003", reply, NULL));
+    adbfs_conf.devices = 0;
+}
+
+/**
+   Commands and replies too large for the socket buffers, pipelined on
+   the same sessions, must not stall their writer and reader on each
+   other.
+ */
+static void check_large_commands()
+{
+    vector<thread> callers;
+    for (int i = 0; i < 8; ++i) {
+        callers.push_back(thread([i]() {
+            string word(4 << 20, 'a' + i);
+            queue<string> output = adb_shell("echo " + word);
+            CHECK(!output.empty() && output.front() == word);
+        }));
+    }
+    for (size_t i = 0; i < callers.size(); ++i) callers[i].join();
+}
+
+/** The ls -l formats of toolbox and toybox, parsed into cache entries. */
+static void check_ls_parsing()
+{
+    struct tm when;
+    memset(&when, 0, sizeof when);
+    when.tm_year = 2012 - 1900;
+    when.tm_mon = 5;
+    when.tm_mday = 22;
+    when.tm_hour = 2;
+    when.tm_min = 16;
+    when.tm_isdst = -1;
+    time_t mtime = mktime(&when);
+
+    fileCache entry = fileCache();
+    cache_ls_line(entry, "-rw-rw-r-- root     sdcard_rw   763362 2012-06-22 02:16 file.html");
+    CHECK(entry.haveStat && entry.haveLink && entry.link.empty());
+    CHECK(entry.st.st_mode == (S_IFREG | 0664) && entry.st.st_nlink == 1);
+    CHECK(entry.st.st_size == 763362 && entry.st.st_mtime == mtime);
+    CHECK(entry.st.st_uid == 0);
+
+    cache_ls_line(entry, "drwxr-x--x   3 root   sdcard_rw      4096 2012-06-22 02:16 My Dir");
+    CHECK(entry.st.st_mode == (S_IFDIR | 0751) && entry.st.st_nlink == 3);
+    CHECK(entry.st.st_size == 0 && entry.st.st_mtime == mtime);
+
+    cache_ls_line(entry, "lrwxrwxrwx   1 root   root         21 2012-06-22 02:16 sdcard -> /storage/self/primary");
+    CHECK(S_ISLNK(entry.st.st_mode) && entry.link == "/storage/self/primary");
+
+    cache_ls_line(entry, "crw-rw-rw-   1 root   root      1,   3 2012-06-22 02:16 null");
+    CHECK(S_ISCHR(entry.st.st_mode) && entry.st.st_rdev == 259 && entry.st.st_mtime == mtime);
+
+    cache_ls_line(entry, "ls: /sdcard/nothing: No such file or directory");
+    CHECK(entry.haveStat && entry.st.st_mode == 0);
+
+    cache_ls_line(entry, "/sbin/healthd: Permission denied");
+    CHECK(!entry.haveStat);
+}
+
+/** Subtree operations and the memory budget of the attribute cache. */
+static void check_path_tree()
+{
+    path_tree tree;
+    fileCache entry = fileCache();
+    entry.haveStat = true;
+    entry.st.st_mode = S_IFREG | 0644;
+    entry.st.st_size = 42;
+    tree.set("/a/b/c", entry);
+    tree.set("/a/b/d", entry);
+    tree.set("/a/e", entry);
+    tree.set("/x/y/z", entry);
+    tree.rename_tree("/a/b", "/x/y");
+    CHECK(!tree.get("/a/b/c", entry) && !tree.get("/x/y/z", entry));
+    CHECK(tree.get("/x/y/c", entry) && entry.st.st_size == 42);
+    CHECK(tree.get("/a/e", entry) && tree.size() == 3);
+    tree.erase_tree("/x");
+    CHECK(!tree.get("/x/y/d", entry) && tree.size() == 1);
+
+    // a deep tree with unique file names, as in a photo collection
+    char name[64];
+    for (int i = 0; i < 200000; ++i) {
+        snprintf(name, sizeof name, "/storage/emulated/0/DCIM/d%02d/e%02d/IMG_%08d.jpg",
+                 i / 2000, i / 100 % 20, i);
+        tree.set(name, entry);
+    }
+    CHECK(tree.size() == 200001);
+    CHECK(tree.memory() < (48 << 20));
+
+    tree.get("/a/e", entry);
+    tree.set_budget(1 << 20);
+    CHECK(tree.memory() <= (1 << 20) && tree.size() < 200001);
+    CHECK(tree.get(name, entry));
+    CHECK(!tree.get("/storage/emulated/0/DCIM/d00/e00/IMG_00000000.jpg", entry));
+}
+
+/** Numbering of paths for the low-level backend. */
+static void check_inodes()
+{
+    inode_table inodes;
+    uint64_t dir = inodes.lookup("/d");
+    uint64_t file = inodes.lookup("/d/f");
+    CHECK(dir != ROOT_INODE && file != dir && inodes.lookup("/d/f") == file);
+    CHECK(inodes.find("/d/f") == file && inodes.find("/d/g") == 0);
+
+    // a rename moves everything below, and replaces what was there
+    uint64_t other = inodes.lookup("/e");
+    inodes.rename("/d", "/e");
+    string path;
+    CHECK(inodes.find("/e") == dir && inodes.find("/e/f") == file && inodes.find("/d/f") == 0);
+    CHECK(inodes.path(file, path) && path == "/e/f");
+    CHECK(inodes.path(other, path) && inodes.find("/e") != other);
+    inodes.forget(other, 1);
+    CHECK(!inodes.path(other, path));
+
+    // numbers last until the last lookup is forgotten, and are not reused
+    inodes.forget(file, 1);
+    CHECK(inodes.find("/e/f") == file);
+    inodes.forget(file, 1);
+    CHECK(inodes.find("/e/f") == 0 && inodes.lookup("/e/f") > other);
+
+    // a removed file keeps its path for the handles still open on it
+    uint64_t removed = inodes.lookup("/e/r");
+    inodes.unlink("/e/r");
+    CHECK(inodes.path(removed, path) && path == "/e/r");
+    CHECK(inodes.lookup("/e/r") != removed);
+    inodes.forget(ROOT_INODE, 1);
+    CHECK(inodes.path(ROOT_INODE, path) && path == "/");
+}
+
+static int run_stress(const struct fuse_operations* op)
+{
+    check_path_tree();
+    check_inodes();
+    check_ls_parsing();
+    check_trace();
+    check_prefetch(op);
+    check_negative_lookups(op);
+    check_listings(op);
+    check_batched_lookups(op);
+    check_reopen(op);
+    check_readahead();
+    check_short_fetch(op);
+    check_ranged_writes(op);
+    check_truncated_writes(op);
+    check_unchanged_flush(op);
+    check_truncated_flush(op);
+    check_writeback_queue();
+    check_writeback(op);
+    check_compression(op);
+    check_transfers(op);
+    check_devices();
+    check_large_commands();
+    vector<thread> workers;
+    for (int i = 0; i < 4; ++i) workers.push_back(thread(read_worker, op, i));
+    for (int i = 0; i < 3; ++i) workers.push_back(thread(write_worker, op, i));
+    transfers_running = true;
+    vector<thread> readers;
+    for (int i = 0; i < 6; ++i) readers.push_back(thread(metadata_worker, op, i));
+    for (size_t i = 0; i < readers.size(); ++i) readers[i].join();
+    for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+    transfers_running = false;
+    CHECK(metadata_during_transfers > 0);
+    check_stats(op);
+    op->destroy(NULL);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        cout << "usage: stress_test <device root>" << endl;
+        return 2;
+    }
+    char* root = realpath(argv[1], NULL);
+    stress_dir = string(root) + "/stress";
+    free(root);
+    mkdir(stress_dir.c_str(), 0755);
+    for (int i = 0; i < FILES; ++i) {
+        ofstream out(seeded(i).c_str(), ios::binary);
+        out << content_of(i, seeded_size(i));
+    }
+    string tree = stress_dir + "/tree";
+    mkdir(tree.c_str(), 0755);
+    mkdir((tree + "/a").c_str(), 0755);
+    mkdir((tree + "/a/b").c_str(), 0755);
+    ofstream((tree + "/a/b/leaf").c_str()) << "leaf";
+
+    // keep adbfs' chatter, including that of its atexit handler, out
+    // of the test output
+    int report = dup(1);
+    int quiet = open("/dev/null", O_WRONLY);
+    dup2(quiet, 1);
+    close(quiet);
+    char name[] = "adbfs";
+    char mountpoint[] = "/nonexistent";
+    char option[] = "-o";
+    string prefetch = "prefetch=" + tree;
+    char* adbfs_argv[] = { name, mountpoint, option, &prefetch[0], NULL };
+    adbfs_main(4, adbfs_argv);
+    cout.flush();
+
+    dprintf(report, "%s stress_test\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
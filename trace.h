@@ -0,0 +1,280 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Leveled tracing into an in-memory ring buffer.
+
+   Writing every message to cout, flushed with endl, from whichever
+   thread is serving a FUSE call made logging a measurable part of
+   listing a large directory, and left the lines of concurrent calls
+   mixed up.  TRACE() now formats a message only if its level is
+   enabled (otherwise it costs one relaxed load and a compare) and
+   stores it in a slot of a fixed ring without taking a lock.  A
+   background thread copies the ring to stdout in batches.
+
+   Each slot is guarded by a sequence number, as a seqlock: a writer
+   marks the slot busy, fills it and stamps it with its position, and
+   a reader copies a slot only if the stamp is the one it expects both
+   before and after the copy.  When the drain falls a whole ring
+   behind, the events it missed are counted and reported as lost.
+
+   dump() writes the newest events using nothing but write(2), so it
+   can run from a signal handler: on SIGUSR1, and when adbfs crashes.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+enum trace_level { TRACE_OFF, TRACE_ERROR, TRACE_INFO, TRACE_DEBUG };
+
+/**
+   Record a message at the given level; message is anything that can
+   follow "<<", e.g. TRACE(TRACE_INFO, "pulled " << path).
+ */
+#define TRACE(level, message)                               \
+    do {                                                    \
+        if (traceLog.enabled(level)) {                      \
+            ostringstream trace_message;                    \
+            trace_message << message;                       \
+            traceLog.record(level, trace_message.str());    \
+        }                                                   \
+    } while (0)
+
+class tracer {
+public:
+    /** Number of events the ring holds; a power of two. */
+    static const uint64_t EVENTS = 4096;
+    /** Longest message kept; the rest is cut off. */
+    static const size_t TEXT = 230;
+    /** Events written by dump() for a signal. */
+    static const uint64_t DUMP_EVENTS = 256;
+
+    tracer() : level(TRACE_INFO), head(0), tail(0), lost(0), owner(0),
+               threads(0), utc_offset(0)
+    {
+        for (uint64_t i = 0; i < EVENTS; ++i) ring[i].seq = 0;
+        time_t now = time(NULL);
+        struct tm local;
+        if (localtime_r(&now, &local)) utc_offset = local.tm_gmtoff;
+    }
+
+    bool enabled(int l) const { return l <= level.load(memory_order_relaxed); }
+
+    /**
+       @param name "off", "error", "info" or "debug", or its number.
+       @return false if name is not a level.
+     */
+    bool set_level(const string& name)
+    {
+        static const char* const names[] = { "off", "error", "info", "debug" };
+        for (int i = TRACE_OFF; i <= TRACE_DEBUG; ++i) {
+            if (name == names[i] || name == string(1, '0' + i)) {
+                level = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void record(int l, const string& text)
+    {
+        start_drain();
+        static thread_local unsigned thread_number = ++threads;
+        uint64_t pos = head.fetch_add(1, memory_order_relaxed);
+        slot& s = ring[pos & (EVENTS - 1)];
+        s.seq.store(2 * pos + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        s.e.sec = now.tv_sec + utc_offset;
+        s.e.usec = now.tv_nsec / 1000;
+        s.e.thread = thread_number;
+        s.e.level = l;
+        s.e.length = text.size() < TEXT ? text.size() : TEXT;
+        memcpy(s.e.text, text.data(), s.e.length);
+        s.seq.store(2 * pos + 2, memory_order_release);
+    }
+
+    /** Write out whatever the drain thread has not written yet. */
+    void flush()
+    {
+        lock_guard<mutex> guard(drain_lock);
+        drain();
+    }
+
+    /**
+       Write the newest events to fd.  Only async-signal-safe calls are
+       made, and nothing is allocated.
+
+       @param count how many events, at most.
+     */
+    void dump(int fd, uint64_t count = DUMP_EVENTS)
+    {
+        static const char header[] = "--- last trace events ---\n";
+        write_all(fd, header, sizeof(header) - 1);
+        uint64_t end = head.load(memory_order_acquire);
+        if (count > EVENTS) count = EVENTS;
+        uint64_t pos = end > count ? end - count : 0;
+        for (; pos < end; ++pos) {
+            event e;
+            if (copy(pos, e) != COPIED) continue;
+            char line[TEXT + 64];
+            write_all(fd, line, format(e, line));
+        }
+    }
+
+private:
+    struct event {
+        int64_t sec;        /* local time */
+        uint32_t usec;
+        uint32_t thread;
+        int level;
+        size_t length;
+        char text[TEXT];
+    };
+
+    struct slot {
+        atomic<uint64_t> seq;   /* 2 * position + 2 when filled, odd while being written */
+        event e;
+    };
+
+    enum copy_result { COPIED, NOT_YET, GONE };
+
+    slot ring[EVENTS];
+    atomic<int> level;
+    atomic<uint64_t> head;      /* position of the next event */
+    uint64_t tail;              /* next event for the drain; under drain_lock */
+    uint64_t lost;
+    atomic<pid_t> owner;
+    atomic<unsigned> threads;
+    long utc_offset;
+    mutex drain_lock;
+
+    copy_result copy(uint64_t pos, event& e)
+    {
+        const slot& s = ring[pos & (EVENTS - 1)];
+        uint64_t want = 2 * pos + 2;
+        uint64_t seq = s.seq.load(memory_order_acquire);
+        if (seq != want) return seq < want ? NOT_YET : GONE;
+        memcpy(&e, &s.e, sizeof(event));
+        atomic_thread_fence(memory_order_acquire);
+        return s.seq.load(memory_order_relaxed) == want ? COPIED : GONE;
+    }
+
+    /**
+       Start the drain in the process that will use it; fuse_main forks
+       after we set up.
+     */
+    void start_drain()
+    {
+        pid_t me = getpid();
+        pid_t was = owner.load(memory_order_relaxed);
+        if (was == me || !owner.compare_exchange_strong(was, me)) return;
+        thread([this] {
+            for (;;) {
+                this_thread::sleep_for(chrono::milliseconds(50));
+                flush();
+            }
+        }).detach();
+    }
+
+    /** Must be called with drain_lock held. */
+    void drain()
+    {
+        uint64_t end = head.load(memory_order_acquire);
+        if (end - tail > EVENTS) {
+            lost += end - EVENTS - tail;
+            tail = end - EVENTS;
+        }
+        string out;
+        char line[TEXT + 64];
+        for (; tail < end; ++tail) {
+            event e;
+            copy_result r = copy(tail, e);
+            if (r == NOT_YET) break;   /* still being written */
+            if (r == GONE) {
+                ++lost;
+                continue;
+            }
+            if (lost) {
+                out += "--- " + to_string(lost) + " trace events lost ---\n";
+                lost = 0;
+            }
+            out.append(line, format(e, line));
+        }
+        write_all(1, out.data(), out.size());
+    }
+
+    /** Format e as one line into buf; returns its length. */
+    static size_t format(const event& e, char* buf)
+    {
+        static const char levels[] = "-EID";
+        int64_t day = e.sec % 86400;
+        if (day < 0) day += 86400;
+        size_t n = 0;
+        n += digits(buf + n, day / 3600, 2);
+        buf[n++] = ':';
+        n += digits(buf + n, day / 60 % 60, 2);
+        buf[n++] = ':';
+        n += digits(buf + n, day % 60, 2);
+        buf[n++] = '.';
+        n += digits(buf + n, e.usec, 6);
+        buf[n++] = ' ';
+        buf[n++] = '[';
+        n += digits(buf + n, e.thread, 1);
+        buf[n++] = ']';
+        buf[n++] = ' ';
+        buf[n++] = levels[e.level & 3];
+        buf[n++] = ' ';
+        memcpy(buf + n, e.text, e.length);
+        n += e.length;
+        while (n > 0 && buf[n - 1] == '\n') --n;
+        buf[n++] = '\n';
+        return n;
+    }
+
+    /** Write v in decimal, zero-padded to width; returns the length. */
+    static size_t digits(char* buf, uint64_t v, size_t width)
+    {
+        char tmp[20];
+        size_t n = 0;
+        do {
+            tmp[n++] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        while (n < width) tmp[n++] = '0';
+        for (size_t i = 0; i < n; ++i) buf[i] = tmp[n - 1 - i];
+        return n;
+    }
+
+    static void write_all(int fd, const char* data, size_t size)
+    {
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            data += n;
+            size -= n;
+        }
+    }
+};
+
+/**
+   The trace of this process; see TRACE().
+ */
+tracer traceLog;
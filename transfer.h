@@ -0,0 +1,201 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   A bounded pool of workers for whole-file transfers.
+
+   Pulls and pushes used to run on whichever thread asked for them,
+   as many at once as there were callers, and nothing ran ahead of a
+   reader that opens one file after another, as a copy of a camera
+   folder does.  A transfer_pool runs them on a fixed number of
+   workers, taking queued jobs in order of priority: a FUSE call
+   waiting for a file goes ahead of background work such as
+   write-back pushes and fetching the next files of a directory.  With
+   two workers or more, one is always kept free of background work, so
+   an interactive transfer waits at most for the jobs ahead of it at
+   its own priority.  A single worker takes background jobs only while
+   no interactive one is queued, and does not stop one it has started,
+   so there an interactive transfer may also wait for one background
+   job to finish.
+
+   Background jobs carry a key, such as the path they fetch; one whose
+   key is still queued is not queued twice, and can be moved to the
+   front when a reader turns up for it.
+*/
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+enum transfer_priority { TRANSFER_INTERACTIVE, TRANSFER_BACKGROUND };
+
+class transfer_pool {
+public:
+    transfer_pool() : workers(4), running_background(0), started(0), next_seq(0),
+                      owner(0) {}
+
+    /** Set the number of workers; 0 runs every job on its caller. */
+    void set_workers(unsigned n)
+    {
+        lock_guard<mutex> guard(lock);
+        workers = n;
+    }
+
+    unsigned size()
+    {
+        lock_guard<mutex> guard(lock);
+        return workers;
+    }
+
+    /**
+       Run job on a worker and wait for it.
+     */
+    void run(int priority, function<void()> job)
+    {
+        unique_lock<mutex> guard(lock);
+        if (workers == 0) {
+            guard.unlock();
+            job();
+            return;
+        }
+        shared_ptr<task> t = add(string(), priority, job);
+        while (!t->done) cond.wait(guard);
+    }
+
+    /**
+       Queue job without waiting for it.
+
+       @return false if a job with the same key is queued already.
+     */
+    bool submit(const string& key, int priority, function<void()> job)
+    {
+        lock_guard<mutex> guard(lock);
+        if (workers == 0 || key.empty() || tasks.count(key)) return false;
+        add(key, priority, job);
+        return true;
+    }
+
+    /** Move the job with key, if it is still queued, to the front. */
+    void promote(const string& key)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, shared_ptr<task> >::iterator it = tasks.find(key);
+        if (it != tasks.end()) raise(it->second, TRANSFER_INTERACTIVE);
+    }
+
+    /** Number of jobs waiting for a worker. */
+    size_t queued()
+    {
+        lock_guard<mutex> guard(lock);
+        return order.size();
+    }
+
+private:
+    struct task {
+        string key;
+        int priority;
+        unsigned long seq;
+        function<void()> job;
+        bool queued;
+        bool done;
+    };
+
+    typedef pair<pair<int, unsigned long>, shared_ptr<task> > slot;
+
+    unsigned workers;
+    unsigned running_background;
+    unsigned started;
+    unsigned long next_seq;
+    pid_t owner;
+    mutex lock;
+    condition_variable cond;
+    map<string, shared_ptr<task> > tasks;   /* queued jobs with a key */
+    set<slot> order;                        /* queued, by priority, then age */
+
+    /** Must be called with lock held. */
+    shared_ptr<task> add(const string& key, int priority, function<void()>& job)
+    {
+        shared_ptr<task> t(new task);
+        t->key = key;
+        t->priority = priority;
+        t->seq = next_seq++;
+        t->job = job;
+        t->queued = true;
+        t->done = false;
+        if (!key.empty()) tasks[key] = t;
+        order.insert(slot(make_pair(priority, t->seq), t));
+        start_workers();
+        cond.notify_all();
+        return t;
+    }
+
+    /** Must be called with lock held. */
+    void raise(const shared_ptr<task>& t, int priority)
+    {
+        if (!t->queued || t->priority <= priority) return;
+        order.erase(slot(make_pair(t->priority, t->seq), t));
+        t->priority = priority;
+        order.insert(slot(make_pair(priority, t->seq), t));
+        cond.notify_all();
+    }
+
+    /**
+       Start the workers in the process that will use them; fuse_main
+       forks after we set up.  Must be called with lock held.
+     */
+    void start_workers()
+    {
+        if (owner != getpid()) {
+            owner = getpid();
+            started = 0;
+        }
+        for (; started < workers; ++started)
+            thread(&transfer_pool::work, this).detach();
+    }
+
+    /** @return the next job a worker may take, or an empty pointer. */
+    shared_ptr<task> next()
+    {
+        if (order.empty()) return shared_ptr<task>();
+        shared_ptr<task> t = order.begin()->second;
+        // keep a worker for interactive jobs; a single worker takes
+        // background jobs only when no interactive one is queued, which
+        // the order of the queue sees to
+        unsigned limit = workers > 1 ? workers - 1 : 1;
+        if (t->priority != TRANSFER_INTERACTIVE && running_background >= limit)
+            return shared_ptr<task>();
+        return t;
+    }
+
+    void work()
+    {
+        unique_lock<mutex> guard(lock);
+        for (;;) {
+            shared_ptr<task> t;
+            while (!(t = next())) cond.wait(guard);
+            order.erase(order.begin());
+            if (!t->key.empty()) tasks.erase(t->key);
+            t->queued = false;
+            bool background = t->priority != TRANSFER_INTERACTIVE;
+            if (background) ++running_background;
+            guard.unlock();
+            t->job();
+            guard.lock();
+            if (background) --running_background;
+            t->done = true;
+            t->job = function<void()>();
+            cond.notify_all();
+        }
+    }
+};
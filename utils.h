@@ -34,7 +34,10 @@
  *      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef ADBFS_FUSE3
 #include <fuse.h>
+#endif
+#include <sys/stat.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -53,7 +56,10 @@ using namespace std;
 
 struct fileCache{
     time_t timestamp;
-    string statOutput;
+    bool haveStat;      /* st is valid, st_mode 0 = missing; false: exists, no info */
+    bool haveLink;      /* came from ls, so link is known */
+    struct stat st;
+    string link;        /* target of a symbolic link */
 };
 
 queue<string> exec_command(const string&);
@@ -99,6 +105,22 @@ string& string_replacer(string &source, const string& find, const string& replac
     return source;
 }
 
+/**
+   Split a device path into its parent directory and last component.
+   The parent of "/a" is "/"; that of a name without a slash is empty.
+ */
+void split_path(const string& path, string& dir, string& name)
+{
+    size_t slash = path.rfind('/');
+    if (slash == string::npos) {
+        dir.clear();
+        name = path;
+        return;
+    }
+    dir = path.substr(0, slash == 0 ? 1 : slash);
+    name = path.substr(slash + 1);
+}
+
 int xtoi(const char* xs, unsigned int* result)
 {
  size_t szlen = strlen(xs);
@@ -155,7 +177,7 @@ int xtoi(const char* xs, unsigned int* result)
  */
 queue<string> exec_command(const string& command)
 {
-    cout << "--*-- " << "exec_command: "  << command << "\n";
+    TRACE(TRACE_INFO, "exec_command: " << command);
     queue<string> output;
     FILE *fp = popen(command.c_str(), "r" );
 
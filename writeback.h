@@ -0,0 +1,304 @@
+/*
+   @file
+   @section License
+
+   BSD; see comments in main source files for details.
+
+   @section Description
+
+   Write-back of files changed through adbfs (-o writeback).
+
+   Without it adb_flush pushes the whole file and then syncs the
+   device before returning, and editors and cp flush several times per
+   file.  In write-back mode adb_flush only snapshots the local copy
+   into a spool file and queues it; a background thread pushes queued
+   files one at a time.  Flushing a path that is still waiting in the
+   queue replaces its snapshot instead of queueing a second push.
+
+   Operations that need the device copy to be current (open, rename,
+   truncate, ...) wait for the path first; a rename also waits for
+   everything queued below it.  Durability is only forced
+   by fsync and at unmount.  A push that fails is logged, appended to
+   the "writeback-errors" file in the temporary directory, and reported
+   as EIO by the next open, flush or fsync of the path.
+*/
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+/**
+   Push a spool file to the device.
+
+   @param spool local file to push.
+   @param remote unescaped device path.
+   @param error receives a message if the push failed.
+   @return true if the file arrived on the device.
+ */
+typedef function<bool(const string& spool, const string& remote,
+                      string& error)> writeback_push;
+
+class writeback_queue {
+public:
+    writeback_queue(writeback_push push) : push(push), owner(0) {}
+
+    /**
+       Snapshot a local copy and queue it for pushing.
+
+       @param local the local copy written by the file handle.
+       @param remote unescaped device path.
+       @param tmpdir directory for the spool file.
+       @return 0, or a negative errno if the snapshot failed.
+     */
+    int enqueue(const string& local, const string& remote, const string& tmpdir)
+    {
+        string spool = tmpdir + "writeback-XXXXXX";
+        int res = snapshot(local, spool);
+        if (res < 0) return res;
+
+        string replaced;
+        {
+            lock_guard<mutex> guard(lock);
+            start_worker();
+            map<string, string>::iterator it = queued.find(remote);
+            if (it != queued.end()) {
+                replaced = it->second;
+                it->second = spool;
+            } else {
+                queued[remote] = spool;
+                order.push_back(remote);
+            }
+            cond.notify_all();
+        }
+        if (!replaced.empty()) {
+            TRACE(TRACE_INFO, "writeback: coalesced " << remote);
+            unlink(replaced.c_str());
+        }
+        return 0;
+    }
+
+    /**
+       Wait until nothing is queued or being pushed for a path.
+
+       @return -EIO if a push of the path failed since the last call,
+       0 otherwise.
+     */
+    int wait(const string& remote)
+    {
+        unique_lock<mutex> guard(lock);
+        while (queued.count(remote) || pushing.count(remote))
+            cond.wait(guard);
+        return take_error(remote);
+    }
+
+    /**
+       Like wait(), for a path and everything queued below it; used
+       before a directory is renamed, whose queued children would
+       otherwise be pushed to their old paths afterwards.
+
+       @return -EIO if a push of the path itself failed since the last
+       call, 0 otherwise.
+     */
+    int wait_tree(const string& remote)
+    {
+        unique_lock<mutex> guard(lock);
+        while (!tree_keys(queued, remote).empty() || !tree_keys(pushing, remote).empty())
+            cond.wait(guard);
+        return take_error(remote);
+    }
+
+    /**
+       Like wait(), without waiting.
+
+       @return -EIO if a push of the path failed since the last call.
+     */
+    int failed(const string& remote)
+    {
+        lock_guard<mutex> guard(lock);
+        return take_error(remote);
+    }
+
+    /** Wait until the whole queue has been pushed. */
+    void drain()
+    {
+        unique_lock<mutex> guard(lock);
+        while (!order.empty() || !pushing.empty()) cond.wait(guard);
+    }
+
+    /**
+       Drop whatever is queued for a path that is being removed, and
+       wait for a push that already started.
+     */
+    void discard(const string& remote)
+    {
+        string spool;
+        {
+            unique_lock<mutex> guard(lock);
+            map<string, string>::iterator it = queued.find(remote);
+            if (it != queued.end()) {
+                spool = it->second;
+                queued.erase(it);
+                order.erase(find(order.begin(), order.end(), remote));
+            }
+            while (pushing.count(remote)) cond.wait(guard);
+            errors.erase(remote);
+        }
+        if (!spool.empty()) unlink(spool.c_str());
+    }
+
+    /** Like discard(), for a path and everything queued below it. */
+    void discard_tree(const string& remote)
+    {
+        vector<string> spools;
+        {
+            unique_lock<mutex> guard(lock);
+            vector<string> keys = tree_keys(queued, remote);
+            for (size_t i = 0; i < keys.size(); ++i) {
+                spools.push_back(queued[keys[i]]);
+                queued.erase(keys[i]);
+                order.erase(find(order.begin(), order.end(), keys[i]));
+            }
+            while (!tree_keys(pushing, remote).empty()) cond.wait(guard);
+            keys = tree_keys(errors, remote);
+            for (size_t i = 0; i < keys.size(); ++i) errors.erase(keys[i]);
+        }
+        for (size_t i = 0; i < spools.size(); ++i) unlink(spools[i].c_str());
+    }
+
+    /**
+       The snapshot waiting to be pushed for a path, so that getattr can
+       report the size and time the file will have on the device.
+
+       @return true if st was filled in.
+     */
+    bool pending_stat(const string& remote, struct stat& st)
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, string>::iterator it = queued.find(remote);
+        if (it == queued.end()) {
+            // until a push completes the device copy may be partial
+            it = pushing.find(remote);
+            if (it == pushing.end()) return false;
+        }
+        return stat(it->second.c_str(), &st) == 0;
+    }
+
+    /** Report failed pushes to errors_path as well as on stdout. */
+    void set_error_log(const string& path) { errors_path = path; }
+
+private:
+    writeback_push push;
+    mutex lock;
+    condition_variable cond;
+    map<string, string> queued;     /* device path -> spool file */
+    deque<string> order;
+    map<string, string> pushing;    /* the same, being pushed now */
+    map<string, string> errors;
+    string errors_path;
+    pid_t owner;
+
+    /**
+       The keys of paths that are root or lie below it.  Must be called
+       with lock held.
+     */
+    static vector<string> tree_keys(const map<string, string>& paths, const string& root)
+    {
+        vector<string> keys;
+        if (paths.count(root)) keys.push_back(root);
+        // not the range from root: "a b" sorts between "a" and "a/b"
+        string below = root + "/";
+        for (map<string, string>::const_iterator it = paths.lower_bound(below);
+             it != paths.end() && it->first.compare(0, below.size(), below) == 0; ++it)
+            keys.push_back(it->first);
+        return keys;
+    }
+
+    /** Must be called with lock held. */
+    int take_error(const string& remote)
+    {
+        map<string, string>::iterator it = errors.find(remote);
+        if (it == errors.end()) return 0;
+        errors.erase(it);
+        return -EIO;
+    }
+
+    /**
+       Start the uploader in the process that will use it; fuse_main
+       forks after we set up.  Must be called with lock held.
+     */
+    void start_worker()
+    {
+        if (owner == getpid()) return;
+        owner = getpid();
+        thread(&writeback_queue::work, this).detach();
+    }
+
+    void work()
+    {
+        unique_lock<mutex> guard(lock);
+        for (;;) {
+            while (order.empty()) cond.wait(guard);
+            string remote = order.front();
+            order.pop_front();
+            string spool = queued[remote];
+            queued.erase(remote);
+            pushing[remote] = spool;
+            guard.unlock();
+
+            string error;
+            bool ok = push(spool, remote, error);
+            if (!ok) {
+                TRACE(TRACE_ERROR, "writeback: push of " << remote
+                      << " failed: " << error);
+                if (!errors_path.empty()) {
+                    ofstream log(errors_path.c_str(), ios::app);
+                    log << time(NULL) << " " << remote << ": " << error << "\n";
+                }
+            }
+
+            guard.lock();
+            unlink(spool.c_str());
+            pushing.erase(remote);
+            if (ok) errors.erase(remote);
+            else errors[remote] = error;
+            cond.notify_all();
+        }
+    }
+
+    /** Copy local into a new spool file named after the template. */
+    static int snapshot(const string& local, string& spool)
+    {
+        int in = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) return -errno;
+        struct stat st;
+        int out = fstat(in, &st) < 0 ? -1 : mkostemp(&spool[0], O_CLOEXEC);
+        if (out < 0) {
+            int res = -errno;
+            close(in);
+            return res;
+        }
+        fchmod(out, st.st_mode & 0777);
+        vector<char> buf(64 * 1024);
+        int res = 0;
+        for (;;) {
+            ssize_t n = read(in, &buf[0], buf.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) res = -errno;
+            if (n <= 0) break;
+            if (!write_all(out, &buf[0], n)) {
+                res = -errno;
+                break;
+            }
+        }
+        close(in);
+        close(out);
+        if (res < 0) unlink(spool.c_str());
+        return res;
+    }
+};